@@ -0,0 +1,108 @@
+// batch_bench: measures shell throughput in batch mode. writes a script of simple
+// commands (ls, cd, lseek, read on a small file) and runs filesys -f on it, once per
+// backend, reporting the commands per second the shell measured.
+//
+// usage: bin/batch_bench <scratch image> [lines]
+//
+// the script makes a BENCH directory with one file in it, so use a scratch copy.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+static const char *g_loop[] = {
+    "ls /BENCH",
+    "cd /BENCH",
+    "lseek LOG 0",
+    "read LOG 64",
+    "cd /",
+    "ls",
+};
+
+static int write_script(const char *path, unsigned long lines) {
+    FILE *script = fopen(path, "w");
+    if (script == NULL) return 1;
+
+    fprintf(script, "mkdir /BENCH\ncreat /BENCH/LOG\nopen /BENCH/LOG -rw\n");
+    fprintf(script, "write LOG \"batch bench payload, read back over and over\"\n");
+    unsigned long count = sizeof(g_loop) / sizeof(g_loop[0]);
+    for (unsigned long i = 4; i < lines; i++) {
+        fprintf(script, "%s\n", g_loop[i % count]);
+    }
+    return fclose(script) != 0;
+}
+
+// runs filesys on the script, stdout thrown away, and prints its summary line
+static int run_shell(const char *shell, const char *image, const char *script, int use_mmap) {
+    int pipefd[2];
+    if (pipe(pipefd) != 0) return 1;
+
+    pid_t pid = fork();
+    if (pid < 0) return 1;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(pipefd[1], STDERR_FILENO);
+        close(pipefd[0]);
+        if (use_mmap) execl(shell, shell, "-m", "-f", script, image, (char *)NULL);
+        else execl(shell, shell, "-f", script, image, (char *)NULL);
+        _exit(127);
+    }
+
+    close(pipefd[1]);
+    FILE *err = fdopen(pipefd[0], "r");
+    char line[512];
+    int found = 0;
+    while (fgets(line, sizeof(line), err) != NULL) {
+        if (strncmp(line, "Batch:", 6) == 0) {
+            printf("%-13s %s", use_mmap ? "mmap" : "pread/pwrite", line);
+            found = 1;
+        }
+    }
+    fclose(err);
+
+    int status;
+    waitpid(pid, &status, 0);
+    if (!found) {
+        fprintf(stderr, "filesys (%s) gave no summary, exit status %d\n", shell, WEXITSTATUS(status));
+        return 1;
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <scratch image> [lines]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    unsigned long lines = (argc > 2) ? strtoul(argv[2], NULL, 10) : 100000;
+    if (lines < 5) lines = 5;
+
+    // filesys sits next to this program in bin/
+    char shell[1024];
+    const char *slash = strrchr(argv[0], '/');
+    snprintf(shell, sizeof(shell), "%.*sfilesys", slash ? (int)(slash - argv[0] + 1) : 0, argv[0]);
+
+    char script[] = "/tmp/batch_bench_XXXXXX";
+    int fd = mkstemp(script);
+    if (fd < 0) {
+        perror("mkstemp");
+        return EXIT_FAILURE;
+    }
+    close(fd);
+    if (write_script(script, lines) != 0) {
+        fprintf(stderr, "Could not write the script.\n");
+        unlink(script);
+        return EXIT_FAILURE;
+    }
+
+    printf("%lu line script\n", lines);
+    // the second run finds BENCH already there, so its first two commands fail
+    int failed = run_shell(shell, argv[1], script, 0) | run_shell(shell, argv[1], script, 1);
+
+    unlink(script);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,133 @@
+// extent_bench: compares sequential read throughput of a file whose clusters were
+// allocated as contiguous extents with a file grown one cluster at a time next to
+// another growing file (the interleaving the single-cluster allocator produces).
+//
+// usage: bin/extent_bench <scratch image> [file size in MiB]
+//
+// only free clusters are written and the FAT is never flushed, so the file system
+// in the image is left as it was.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "structs.h"
+#include "commands.h"
+#include "block_cache.h"
+
+extern FS_STATE g_fs_state;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// drops the image from the page cache so reads actually hit the disk
+static void drop_image_cache() {
+    fsync(g_fs_state.image_fd);
+    posix_fadvise(g_fs_state.image_fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+// walks a chain and does one read per physically contiguous span
+// (write = 1 fills the clusters instead). returns the number of I/Os
+static unsigned long walk_chain(unsigned int first, unsigned char *buf, unsigned int max_span, int write) {
+    unsigned int cluster_size = g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus;
+    unsigned long ios = 0;
+    unsigned int c = first;
+
+    while (c >= 2 && c < 0x0FFFFFF8) {
+        unsigned int span = 1, last = c;
+        unsigned int next = read_fat_entry(last);
+        while (span < max_span && next == last + 1) {
+            last = next;
+            span++;
+            next = read_fat_entry(last);
+        }
+
+        long offset = get_sector_offset(get_cluster_sector(c));
+        size_t len = (size_t)span * cluster_size;
+        if ((write ? image_write(offset, buf, len) : image_read(offset, buf, len)) != 0) {
+            fprintf(stderr, "I/O error at cluster %u\n", c);
+            exit(EXIT_FAILURE);
+        }
+        ios++;
+        c = next;
+    }
+    return ios;
+}
+
+// grows one chain by a single cluster with the single-cluster allocator
+static unsigned int append_one(unsigned int *first, unsigned int tail) {
+    unsigned int c = get_free_cluster();
+    if (c == 0 || c >= 0x0FFFFFF8) {
+        fprintf(stderr, "Image is full.\n");
+        exit(EXIT_FAILURE);
+    }
+    write_fat_entry(c, 0x0FFFFFFF);
+    if (tail >= 2) write_fat_entry(tail, c);
+    else *first = c;
+    return c;
+}
+
+static void report(const char *label, unsigned int first, unsigned char *buf, unsigned int max_span, double mib) {
+    drop_image_cache();
+    double start = now_seconds();
+    unsigned long ios = walk_chain(first, buf, max_span, 0);
+    double secs = now_seconds() - start;
+    printf("%-22s %8.1f MiB/s  %8lu reads  %.3f s\n", label, mib / secs, ios, secs);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <scratch image> [file size in MiB]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    unsigned int mib = (argc > 2) ? (unsigned int)atoi(argv[2]) : 32;
+
+    int fd = open(argv[1], O_RDWR);
+    if (fd < 0 || load_bpb_and_init_state(argv[1], fd) != 0) {
+        fprintf(stderr, "Could not mount '%s'.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    unsigned int cluster_size = g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus;
+    unsigned int clusters = (unsigned int)(((unsigned long long)mib * 1024 * 1024 + cluster_size - 1) / cluster_size);
+    if (g_fs_state.free_map == NULL || clusters * 3 > g_fs_state.free_count) {
+        fprintf(stderr, "Need %u free clusters and a free cluster bitmap.\n", clusters * 3);
+        return EXIT_FAILURE;
+    }
+
+    // cap a single I/O at 1 MiB
+    unsigned int max_span = (1024 * 1024) / cluster_size;
+    if (max_span == 0) max_span = 1;
+    unsigned char *buf = (unsigned char *)malloc((size_t)max_span * cluster_size);
+    memset(buf, 0xA5, (size_t)max_span * cluster_size);
+
+    // extent allocated file
+    unsigned int runs = 0;
+    unsigned int extent_first = allocate_cluster_chain(clusters, 0, &runs);
+
+    // two files grown side by side, one cluster at a time
+    unsigned int a_first = 0, b_first = 0, a_tail = 0, b_tail = 0;
+    for (unsigned int i = 0; i < clusters; i++) {
+        a_tail = append_one(&a_first, a_tail);
+        b_tail = append_one(&b_first, b_tail);
+    }
+
+    walk_chain(extent_first, buf, max_span, 1);
+    walk_chain(a_first, buf, max_span, 1);
+
+    printf("%u MiB file, %u byte clusters, extent file in %u run(s)\n", mib, cluster_size, runs);
+    report("extent allocation", extent_first, buf, max_span, mib);
+    report("single-cluster alloc", a_first, buf, max_span, mib);
+
+    free(buf);
+    free_fat_table();
+    free_free_map();
+    bcache_destroy();
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,76 @@
+// lexer_bench: lines parsed per second, the old way (get_tokens copies every token,
+// then a strcmp chain finds the command) against tokenize_in_place and find_command.
+//
+// usage: bin/lexer_bench [million lines]
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "lexer.h"
+#include "commands.h"
+
+// a mix of the lines batch scripts are made of
+static const char *g_lines[] = {
+    "ls",
+    "cd /SUBDIR/DEEP",
+    "open /logs/2026/10/app.log -rw",
+    "read APP.LOG 4096",
+    "lseek APP.LOG 0",
+    "write APP.LOG \"one line of log output, with spaces\"",
+    "close APP.LOG",
+    "iostat",
+};
+#define NUM_LINES (sizeof(g_lines) / sizeof(g_lines[0]))
+
+// command names in the order the old if/else chain tested them
+static const char *g_chain[] = {
+    "exit", "info", "ls", "cd", "creat", "mkdir", "lsof", "close", "open",
+    "lseek", "read", "write", "cache", "dcache", "dirindex", "iostat",
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int chain_lookup(const char *name) {
+    for (unsigned int i = 0; i < sizeof(g_chain) / sizeof(g_chain[0]); i++) {
+        if (strcmp(g_chain[i], name) == 0) return (int)i;
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[]) {
+    unsigned long lines = (argc > 1) ? strtoul(argv[1], NULL, 10) * 1000000UL : 2000000UL;
+    if (lines == 0) lines = 1000000;
+
+    char line[256];
+    unsigned long checksum = 0; // keeps the work from being optimized away
+
+    // copying the line in each loop keeps both sides doing the same setup work
+    double start = now_seconds();
+    for (unsigned long i = 0; i < lines; i++) {
+        strcpy(line, g_lines[i % NUM_LINES]);
+        tokenlist *tokens = get_tokens(line);
+        checksum += (unsigned long)chain_lookup(tokens->items[0]) + tokens->size;
+        free_tokens(tokens);
+    }
+    double old_secs = now_seconds() - start;
+
+    tokenlist tokens = { NULL, 0, 0, -1 };
+    start = now_seconds();
+    for (unsigned long i = 0; i < lines; i++) {
+        strcpy(line, g_lines[i % NUM_LINES]);
+        tokenize_in_place(&tokens, line);
+        checksum += (unsigned long)find_command(tokens.items[0]) + tokens.size;
+    }
+    double new_secs = now_seconds() - start;
+    free(tokens.items);
+
+    printf("%lu lines (checksum %lu)\n", lines, checksum);
+    printf("get_tokens + strcmp chain:        %10.0f lines/s\n", lines / old_secs);
+    printf("tokenize_in_place + find_command: %10.0f lines/s (%.1fx)\n", lines / new_secs, old_secs / new_secs);
+    return EXIT_SUCCESS;
+}
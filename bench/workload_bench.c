@@ -0,0 +1,413 @@
+// workload_bench: end-to-end benchmark. builds sparse FAT32 images of several sizes and
+// shapes, replays a command workload on each through start_program_shell (batch mode,
+// with -t logging every command's latency) and reports per-command p50/p99 latency and
+// throughput. the results file is tab separated and sorted the same way on every run,
+// so two builds can be compared with diff.
+//
+// usage: bin/workload_bench [-o results.tsv] [-i iterations] [-d scratch dir] [-s shape] [-m] [-k]
+//   -m uses the mmap backend, -k keeps the images and scripts in the scratch dir
+//
+// shapes: vol-1g, vol-32g (general workload on a small and a large volume), flat-10k
+// (one directory of 10000 files), deep-tree (40 nested directories) and fragmented
+// (files whose clusters are interleaved at random). images are sparse, so the 32 GiB
+// one only takes the space of its metadata.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "structs.h"
+#include "commands.h"
+#include "image_builder.h"
+
+#define MAX_COMMANDS 32
+
+static void die(const char *what) {
+    fprintf(stderr, "Error: %s\n", what);
+    exit(EXIT_FAILURE);
+}
+
+// xorshift, so every run replays the same commands
+static unsigned int next_random(unsigned int *state) {
+    unsigned int x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *state = x;
+}
+
+// SHAPES -----------------------------------------
+
+// DOCS with 200 small files, SRC with 8 subdirectories, a 64 MiB BIG.DAT and an empty SCRATCH.
+// directories don't grow, so SCRATCH gets room for everything the workload creates
+static void populate_general(IMAGE_BUILDER *b, BUILDER_DIR *root, unsigned int spare) {
+    BUILDER_DIR docs, src, sub, scratch;
+    char name[16];
+
+    builder_add_subdir(b, root, &docs, "DOCS", 200);
+    for (unsigned int i = 0; i < 200; i++) {
+        snprintf(name, sizeof(name), "D%04u.TXT", i);
+        builder_add_file(b, &docs, name, 1024 + builder_random(b) % (64 * 1024));
+    }
+    builder_close_dir(b, &docs);
+
+    builder_add_subdir(b, root, &src, "SRC", 8);
+    for (unsigned int m = 0; m < 8; m++) {
+        snprintf(name, sizeof(name), "M%u", m);
+        builder_add_subdir(b, &src, &sub, name, 20);
+        for (unsigned int i = 0; i < 20; i++) {
+            snprintf(name, sizeof(name), "S%02u.C", i);
+            builder_add_file(b, &sub, name, 512 + builder_random(b) % (16 * 1024));
+        }
+        builder_close_dir(b, &sub);
+    }
+    builder_close_dir(b, &src);
+
+    builder_add_file(b, root, "BIG.DAT", 64u * 1024 * 1024);
+    builder_add_subdir(b, root, &scratch, "SCRATCH", 2 * spare);
+    builder_close_dir(b, &scratch);
+}
+
+static void workload_general(FILE *s, unsigned int i, unsigned int *rng) {
+    unsigned int doc = next_random(rng) % 200;
+    unsigned int big = (next_random(rng) % 1024) * 65536;
+    fprintf(s, "ls /DOCS\ncd /DOCS\n");
+    fprintf(s, "open D%04u.TXT -r\nread D%04u.TXT 4096\nclose D%04u.TXT\n", doc, doc, doc);
+    fprintf(s, "cd /SRC/M%u\nls\ncd /\n", i % 8);
+    fprintf(s, "open /BIG.DAT -r\nlseek BIG.DAT %u\nread BIG.DAT 65536\nclose BIG.DAT\n", big);
+    fprintf(s, "creat /SCRATCH/W%07u\nopen /SCRATCH/W%07u -rw\n", i, i);
+    fprintf(s, "write W%07u \"workload bench payload %u\"\nclose W%07u\n", i, i, i);
+    fprintf(s, "mkdir /SCRATCH/D%07u\n", i);
+}
+
+// 10000 files of 4 KiB in one directory, plus free slots for creat
+static void populate_flat(IMAGE_BUILDER *b, BUILDER_DIR *root, unsigned int spare) {
+    BUILDER_DIR flat;
+    char name[16];
+    builder_add_subdir(b, root, &flat, "FLAT", 10000 + spare);
+    for (unsigned int i = 0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "N%07u.DAT", i);
+        builder_add_file(b, &flat, name, 4096);
+    }
+    builder_close_dir(b, &flat);
+}
+
+static void workload_flat(FILE *s, unsigned int i, unsigned int *rng) {
+    unsigned int n = next_random(rng) % 10000;
+    if (i % 10 == 0) fprintf(s, "ls /FLAT\n");
+    fprintf(s, "open /FLAT/N%07u.DAT -r\nread N%07u.DAT 512\nclose N%07u.DAT\n", n, n, n);
+    fprintf(s, "cd /FLAT\ncd /\n");
+    fprintf(s, "creat /FLAT/C%07u\n", i);
+}
+
+#define DEEP_LEVELS 40
+
+static void deep_path(char *out, size_t size, unsigned int levels) {
+    size_t len = 0;
+    out[0] = '\0';
+    for (unsigned int l = 0; l < levels && len < size; l++) {
+        len += (size_t)snprintf(out + len, size - len, "/L%02u", l);
+    }
+}
+
+// L00/L01/.../L39 with 4 files at every level, and room for creat at the bottom
+static void populate_deep(IMAGE_BUILDER *b, BUILDER_DIR *root, unsigned int spare) {
+    BUILDER_DIR level[DEEP_LEVELS];
+    char name[16];
+    for (unsigned int l = 0; l < DEEP_LEVELS; l++) {
+        snprintf(name, sizeof(name), "L%02u", l);
+        builder_add_subdir(b, l == 0 ? root : &level[l - 1], &level[l], name, l == DEEP_LEVELS - 1 ? 4 + spare : 5);
+        for (unsigned int f = 0; f < 4; f++) {
+            snprintf(name, sizeof(name), "F%u.TXT", f);
+            builder_add_file(b, &level[l], name, 2048);
+        }
+    }
+    for (unsigned int l = DEEP_LEVELS; l > 0; l--) builder_close_dir(b, &level[l - 1]);
+}
+
+static void workload_deep(FILE *s, unsigned int i, unsigned int *rng) {
+    char bottom[256], middle[256];
+    deep_path(bottom, sizeof(bottom), DEEP_LEVELS);
+    deep_path(middle, sizeof(middle), 1 + next_random(rng) % DEEP_LEVELS);
+    unsigned int f = i % 4;
+    fprintf(s, "cd %s\nls\ncd ..\ncd /\n", bottom);
+    fprintf(s, "open %s/F%u.TXT -r\nread F%u.TXT 2048\nclose F%u.TXT\n", middle, f, f, f);
+    fprintf(s, "ls %s\n", middle);
+    fprintf(s, "creat %s/C%07u\n", bottom, i);
+}
+
+// 8 files of 16 MiB whose clusters are interleaved at random, so nearly every cluster is its own run
+static void populate_fragmented(IMAGE_BUILDER *b, BUILDER_DIR *root, unsigned int spare) {
+    BUILDER_DIR frag;
+    (void)spare;
+    builder_add_subdir(b, root, &frag, "FRAG", 8);
+    unsigned int sizes[8], first[8];
+    char name[16];
+    for (unsigned int i = 0; i < 8; i++) sizes[i] = 16u * 1024 * 1024;
+    builder_alloc_files(b, sizes, 8, 1, first);
+    for (unsigned int i = 0; i < 8; i++) {
+        snprintf(name, sizeof(name), "S%u.DAT", i);
+        builder_add_entry(b, &frag, name, ATTR_ARCHIVE, first[i], sizes[i]);
+    }
+    builder_close_dir(b, &frag);
+}
+
+static void workload_fragmented(FILE *s, unsigned int i, unsigned int *rng) {
+    unsigned int k = next_random(rng) % 8;
+    unsigned int offset = (next_random(rng) % 4096) * 4096;
+    (void)i;
+    fprintf(s, "open /FRAG/S%u.DAT -r\nlseek S%u.DAT %u\nread S%u.DAT 65536\n", k, k, offset, k);
+    fprintf(s, "lseek S%u.DAT 0\nread S%u.DAT 1048576\nclose S%u.DAT\n", k, k, k);
+}
+
+typedef struct {
+    const char *name;
+    unsigned long long bytes;
+    unsigned int sec_per_clus;
+    void (*populate)(IMAGE_BUILDER *b, BUILDER_DIR *root, unsigned int spare);
+    void (*workload)(FILE *script, unsigned int iteration, unsigned int *rng);
+} SHAPE;
+
+static const SHAPE g_shapes[] = {
+    { "vol-1g", 1ull << 30, 8, populate_general, workload_general },
+    { "vol-32g", 32ull << 30, 64, populate_general, workload_general },
+    { "flat-10k", 1ull << 30, 8, populate_flat, workload_flat },
+    { "deep-tree", 1ull << 30, 8, populate_deep, workload_deep },
+    { "fragmented", 1ull << 30, 8, populate_fragmented, workload_fragmented },
+};
+
+static void build_image(const SHAPE *shape, const char *path, unsigned int iterations) {
+    IMAGE_SPEC spec;
+    IMAGE_BUILDER b;
+    BUILDER_DIR root;
+    image_spec_defaults(&spec);
+    spec.image_bytes = shape->bytes;
+    spec.sectors_per_cluster = shape->sec_per_clus;
+    spec.label = "WLBENCH";
+    builder_start(&b, path, &spec);
+    builder_open_dir(&b, &root, 0, 16);
+    shape->populate(&b, &root, iterations);
+    builder_close_dir(&b, &root);
+    if (builder_finish(&b, NULL) != 0) die("Could not build the image.");
+}
+
+// RUNNING AND REPORTING -----------------------------------------
+
+typedef struct {
+    char name[16];
+    double *ns;
+    unsigned long count;
+    unsigned long capacity;
+    unsigned long failed;
+} COMMAND_TIMES;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// runs the script in a child through start_program_shell, its output thrown away
+static int run_shell(const char *image, const char *script, const char *timing, int use_mmap) {
+    // the child exits through exit(), which would flush our buffers a second time
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) return 1;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        dup2(null_fd, STDOUT_FILENO);
+        dup2(null_fd, STDERR_FILENO);
+        char *argv[8];
+        int argc = 0;
+        argv[argc++] = "filesys";
+        if (use_mmap) argv[argc++] = "-m";
+        argv[argc++] = "-t";
+        argv[argc++] = (char *)timing;
+        argv[argc++] = "-f";
+        argv[argc++] = (char *)script;
+        argv[argc++] = (char *)image;
+        argv[argc] = NULL;
+        start_program_shell(argc, argv);
+        _exit(127);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    // a failed command only sets the exit status to 1, the log shows which
+    return !WIFEXITED(status) || WEXITSTATUS(status) > 1;
+}
+
+static COMMAND_TIMES *times_for(COMMAND_TIMES *cmds, unsigned int *ncmds, const char *name) {
+    for (unsigned int i = 0; i < *ncmds; i++) {
+        if (strcmp(cmds[i].name, name) == 0) return &cmds[i];
+    }
+    if (*ncmds == MAX_COMMANDS) return NULL;
+    COMMAND_TIMES *c = &cmds[(*ncmds)++];
+    memset(c, 0, sizeof(*c));
+    snprintf(c->name, sizeof(c->name), "%s", name);
+    return c;
+}
+
+static void add_time(COMMAND_TIMES *c, double ns, int failed) {
+    if (c->count == c->capacity) {
+        c->capacity = c->capacity ? c->capacity * 2 : 256;
+        c->ns = (double *)realloc(c->ns, c->capacity * sizeof(double));
+        if (!c->ns) die("Memory allocation failed.");
+    }
+    c->ns[c->count++] = ns;
+    if (failed) c->failed++;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(((const COMMAND_TIMES *)a)->name, ((const COMMAND_TIMES *)b)->name);
+}
+
+// nearest rank, on sorted samples
+static double percentile(const double *sorted, unsigned long n, double q) {
+    unsigned long rank = (unsigned long)(q * n);
+    if (rank < q * n) rank++;
+    return sorted[rank > 0 ? rank - 1 : 0];
+}
+
+static void report(FILE *out, const char *shape, COMMAND_TIMES *c) {
+    qsort(c->ns, c->count, sizeof(double), compare_doubles);
+    double sum = 0;
+    for (unsigned long i = 0; i < c->count; i++) sum += c->ns[i];
+    double p50 = percentile(c->ns, c->count, 0.50) / 1e3;
+    double p99 = percentile(c->ns, c->count, 0.99) / 1e3;
+    double mean = sum / c->count / 1e3;
+    double ops = sum > 0 ? c->count / (sum / 1e9) : 0.0;
+    fprintf(out, "%s\t%s\t%lu\t%lu\t%.1f\t%.1f\t%.1f\t%.0f\n", shape, c->name, c->count, c->failed, p50, p99, mean, ops);
+    printf("  %-8s %7lu %6lu %11.1f %11.1f %11.1f %11.0f\n", c->name, c->count, c->failed, p50, p99, mean, ops);
+}
+
+// reads the -t log back and writes one row per command plus an "all" row
+static int summarize(FILE *out, const char *shape, const char *timing) {
+    FILE *log = fopen(timing, "r");
+    if (!log) return 1;
+
+    COMMAND_TIMES cmds[MAX_COMMANDS];
+    COMMAND_TIMES all;
+    unsigned int ncmds = 0;
+    memset(&all, 0, sizeof(all));
+    snprintf(all.name, sizeof(all.name), "all");
+
+    char line[512], name[16];
+    while (fgets(line, sizeof(line), log) != NULL) {
+        double ns;
+        int status;
+        if (sscanf(line, "%lf\t%d\t%15s", &ns, &status, name) != 3) continue;
+        COMMAND_TIMES *c = times_for(cmds, &ncmds, name);
+        if (c) add_time(c, ns, status != 0);
+        add_time(&all, ns, status != 0);
+    }
+    fclose(log);
+    if (all.count == 0) return 1;
+
+    printf("  %-8s %7s %6s %11s %11s %11s %11s\n", "command", "count", "failed", "p50 us", "p99 us", "mean us", "ops/s");
+    qsort(cmds, ncmds, sizeof(COMMAND_TIMES), compare_names);
+    for (unsigned int i = 0; i < ncmds; i++) {
+        report(out, shape, &cmds[i]);
+        free(cmds[i].ns);
+    }
+    report(out, shape, &all);
+    free(all.ns);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-o results.tsv] [-i iterations] [-d scratch dir] [-s shape] [-m] [-k]\n", prog);
+    fprintf(stderr, "shapes:");
+    for (size_t i = 0; i < sizeof(g_shapes) / sizeof(g_shapes[0]); i++) fprintf(stderr, " %s", g_shapes[i].name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    const char *results_path = "bench_results.tsv";
+    const char *scratch = "/tmp";
+    const char *only = NULL;
+    unsigned int iterations = 200;
+    int use_mmap = 0, keep = 0, opt;
+
+    while ((opt = getopt(argc, argv, "o:i:d:s:mk")) != -1) {
+        switch (opt) {
+        case 'o': results_path = optarg; break;
+        case 'i': iterations = (unsigned int)strtoul(optarg, NULL, 10); break;
+        case 'd': scratch = optarg; break;
+        case 's': only = optarg; break;
+        case 'm': use_mmap = 1; break;
+        case 'k': keep = 1; break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    // every iteration creates entries in directories that can't grow past 65536 entries
+    if (optind != argc || iterations == 0 || iterations > 20000) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    FILE *out = fopen(results_path, "w");
+    if (!out) {
+        fprintf(stderr, "Error: Could not open '%s'.\n", results_path);
+        return EXIT_FAILURE;
+    }
+    fprintf(out, "# workload_bench backend=%s iterations=%u\n", use_mmap ? "mmap" : "pread", iterations);
+    fprintf(out, "shape\tcommand\tcount\tfailed\tp50_us\tp99_us\tmean_us\tops_per_s\n");
+
+    int failed = 0, ran = 0;
+    for (size_t s = 0; s < sizeof(g_shapes) / sizeof(g_shapes[0]); s++) {
+        const SHAPE *shape = &g_shapes[s];
+        if (only && strcmp(only, shape->name) != 0) continue;
+        ran++;
+
+        char image[1024], script[1024], timing[1024], journal[1100];
+        snprintf(image, sizeof(image), "%s/wl_%s.img", scratch, shape->name);
+        snprintf(script, sizeof(script), "%s/wl_%s.script", scratch, shape->name);
+        snprintf(timing, sizeof(timing), "%s/wl_%s.times", scratch, shape->name);
+        snprintf(journal, sizeof(journal), "%s.journal", image);
+
+        double start = now_seconds();
+        build_image(shape, image, iterations);
+        double built = now_seconds() - start;
+
+        FILE *f = fopen(script, "w");
+        if (!f) die("Could not write the script.");
+        unsigned int rng = 0x2545F491;
+        for (unsigned int i = 0; i < iterations; i++) shape->workload(f, i, &rng);
+        if (fclose(f) != 0) die("Could not write the script.");
+
+        printf("%s: %llu MiB image built in %.3f s\n", shape->name, shape->bytes >> 20, built);
+        start = now_seconds();
+        int bad = run_shell(image, script, timing, use_mmap);
+        double elapsed = now_seconds() - start;
+        if (bad || summarize(out, shape->name, timing) != 0) {
+            fprintf(stderr, "%s: the shell didn't run the workload\n", shape->name);
+            failed = 1;
+        } else {
+            printf("  replayed in %.3f s, mount and exit included\n", elapsed);
+        }
+
+        if (!keep) {
+            unlink(image);
+            unlink(journal);
+            unlink(script);
+            unlink(timing);
+        }
+    }
+
+    if (fclose(out) != 0) failed = 1;
+    if (ran == 0) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+    printf("results in %s\n", results_path);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,52 @@
+#ifndef BLOCK_CACHE_H
+#define BLOCK_CACHE_H
+
+#include <stddef.h>
+
+// default memory budget for cached sectors
+#define BCACHE_DEFAULT_BYTES (4u * 1024u * 1024u)
+// never go below this many blocks, whatever the budget says
+#define BCACHE_MIN_BLOCKS 16
+
+// cache counters, readable from the shell with the cache command
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long writebacks; // dirty blocks written back to the image
+    unsigned long bypassed;   // sectors moved straight to/from disk (too big to cache)
+    unsigned int blocks;      // blocks currently cached
+    unsigned int max_blocks;  // blocks the budget allows
+    unsigned int pinned;      // blocks currently pinned
+    unsigned int dirty;       // blocks waiting to be written back
+    size_t block_size;
+} BCACHE_STATS;
+
+// sets up the cache, block size is one sector
+void bcache_init(size_t block_size, size_t budget_bytes);
+// changes the memory budget, evicting blocks if it shrank
+void bcache_set_budget(size_t budget_bytes);
+// writes back dirty blocks and releases everything
+void bcache_destroy();
+
+// with the mmap backend nothing is cached: bcache_get hands out pointers into the
+// mapping and the byte range calls go straight to the image
+
+// returns the cached sector, pinned until bcache_put (NULL on I/O error)
+unsigned char *bcache_get(unsigned int sector);
+// unpins a block from bcache_get, dirty = 1 if it was modified
+void bcache_put(unsigned char *block, int dirty);
+
+// byte range I/O through the cache
+int bcache_read(long long offset, void *buf, size_t len);
+int bcache_write(long long offset, const void *buf, size_t len);
+
+// writes every dirty block back to the image
+int bcache_flush();
+// writes back and drops any cached copies of the given sectors
+void bcache_invalidate(unsigned int sector, unsigned int count);
+
+void bcache_get_stats(BCACHE_STATS *stats);
+void bcache_reset_stats();
+
+#endif // BLOCK_CACHE_H
@@ -6,43 +6,94 @@
 
 // PART ONE: 
 // funct to read BPB from disk image
-unsigned int load_bpb_and_init_state(const char* image_name, FILE *fp);
-void exit_shell();
+unsigned int load_bpb_and_init_state(const char* image_name, int fd);
+void exit_shell(int status);
 void cmd_info();
 // helpers for calcs 
 long get_sector_offset(unsigned int sector_num); 
 unsigned int get_first_data_sector();
 unsigned int get_total_clusters();
+// block layer, positional I/O on the image fd (returns 0 on success)
+int image_mmap(int fd);
+void image_munmap();
+void image_sync();
+unsigned char *image_map_range(long long offset, size_t len);
+void image_prefetch(long long offset, size_t len);
+int image_read(long long offset, void *buf, size_t len);
+int image_pread(long long offset, void *buf, size_t len);
+int image_write(long long offset, const void *buf, size_t len);
+int image_readv(IO_SEGMENT *segs, int nsegs);
+int image_writev(IO_SEGMENT *segs, int nsegs);
+long long image_sendfile(int out_fd, long long offset, size_t len);
+long long image_copy_out(int host_fd, long long offset, size_t len);
+long long image_copy_in(int host_fd, long long offset, size_t len);
+// resident FAT
+void load_fat_table();
+int flush_fat_table();
+void log_fat_changes();
+void free_fat_table();
+// FAT copies (BPB_ExtFlags)
+int fat_mirrored();
+unsigned int active_fat();
+int defer_fat_mirrors();
+void resync_fat_mirrors();
+// free cluster bitmap + FSInfo
+void load_free_map();
+void write_fsinfo();
+void free_free_map();
 
 // PART TWO:
+void get_formatted_name(unsigned char *raw_name, char *out_name);
 unsigned int get_cluster_sector(unsigned int cluster_num);
 unsigned int read_fat_entry(unsigned int cluster_num);
-void ls_command();
-void cd_command( char *dirname);
+int ls_command(char *path);
+int cd_command( char *dirname);
 
 // PART THREE:
 unsigned int get_free_cluster(); // helper for creat
 void write_fat_entry(unsigned int cluster_num, unsigned int value); // helper for creat
-void creat_command(char *filename);
+unsigned int allocate_cluster_chain(unsigned int count, unsigned int prev_cluster, unsigned int *num_runs); // helper for write
+void free_cluster_chain(unsigned int start_cluster);
+int creat_command(char *filename);
 
 // PART FOUR:
-void lsof_command();
-void open_command(char *filename, char *flags);
-void close_command(char *filename);
+int lsof_command();
+int open_command(char *filename, char *flags);
+int close_command(char *filename);
 void size_command(char *filename);
 unsigned int find_cluster_from_offset(unsigned int starting_cluster, long offset); // helper for read
-void read_command(char *filename, char *size_str);
-void lseek_command(char *filename, char *offset_str);
+int extend_extent_map(OPEN_FILE *of, unsigned int file_cluster);
+unsigned int lookup_file_cluster(OPEN_FILE *of, unsigned int file_cluster, unsigned int *run_left);
+void reset_extent_map(OPEN_FILE *of);
+int read_command(char *filename, char *size_str, char *mode);
+int lseek_command(char *filename, char *offset_str);
 
 //program loop
 int start_program_shell(int argc, char *argv[]);
+int run_command(char *line);
+int find_command(const char *name);
+void print_usage(const char *prog);
 
 // PART FIVE:
-void write_command(char *filename, char *size_str);
+int write_command(char *filename, char *data);
 void mv_command(char *source, char *dest);
 
 // PART SIX:
 void rm_command(char *filename);
 void rmdir_command(char *dirname);
 
+// EXTRA:
+int cache_command(char *arg);
+int dcache_command(char *arg);
+int dirindex_command(char *arg);
+int iostat_command(char *arg);
+int sync_command();
+int readahead_command(char *arg);
+int journal_command(char *arg);
+int check_command(char *arg);
+int find_files_command(char *pattern);
+int du_command(char *path);
+int get_command(char *image_file, char *host_path);
+int put_command(char *host_path, char *image_file);
+
 #endif // COMMANDS_H
@@ -0,0 +1,40 @@
+#ifndef DENTRY_H
+#define DENTRY_H
+
+#include "structs.h"
+
+// default number of (directory, name) lookups remembered
+#define DENTRY_DEFAULT_MAX 4096
+
+// one remembered lookup, found = 0 records that the name isn't there
+typedef struct DENTRY {
+    unsigned int parent;     // first cluster of the directory searched
+    char name[13];           // name as looked up, an 8.3 name in any case
+    int found;
+    DIR_ENTRY entry;         // copy of the entry when found
+    long offset;             // its byte offset in the image
+    struct DENTRY *lru_prev, *lru_next;
+    struct DENTRY *hash_next;
+} DENTRY;
+
+// counters for the dcache command
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long invalidations;
+    unsigned int cached;
+    unsigned int max_entries;
+} DENTRY_STATS;
+
+// looks name (8.3 or long, any case) up in the directory at parent (0 means the root), through
+// the cache. returns 1 and fills entry/offset when found (either may be NULL), 0 if not there,
+// -1 on a read error
+int dentry_lookup(unsigned int parent, const char *name, DIR_ENTRY *entry, long *offset);
+// forgets what is known about name in parent, call when that entry is created or changed
+void dentry_invalidate(unsigned int parent, const char *name);
+void dentry_clear();
+void dentry_set_max(unsigned int max_entries);
+void dentry_get_stats(DENTRY_STATS *stats);
+
+#endif // DENTRY_H
@@ -0,0 +1,77 @@
+#ifndef DIR_INDEX_H
+#define DIR_INDEX_H
+
+#include "structs.h"
+
+// default number of directories kept indexed at once
+#define DIR_INDEX_DEFAULT_MAX 64
+
+// one live entry in an indexed directory. it is in the hash table under its 8.3 name and,
+// if it has one, its long name too. bucket chains hold entry * 2 + 1 for a long name link
+typedef struct {
+    char name[13];   // formatted 8.3 name (what get_formatted_name gives)
+    int long_name;   // offset of the long name in the directory's name pool, -1 = none
+    long offset;     // byte offset of the DIR_ENTRY in the image
+    DIR_ENTRY entry; // copy of the entry
+    int next;        // next link in the 8.3 name's bucket, -1 = end
+    int long_next;   // next link in the long name's bucket
+} DIR_INDEX_ENTRY;
+
+// name index of one directory, built on first use. lookups ignore ASCII case
+typedef struct DIR_INDEX {
+    unsigned int cluster;    // first cluster of the directory
+
+    DIR_INDEX_ENTRY *entries;
+    unsigned int count;
+    unsigned int capacity;
+    int *buckets;            // hash of name -> first link, -1 = empty
+    unsigned int num_buckets; // power of two
+    unsigned int links;      // names in the table, 8.3 and long
+
+    char *names;             // long names decoded when the directory was read, NUL separated
+    unsigned int names_len;
+    unsigned int names_capacity;
+
+    long *deleted_slots;     // offsets of 0xE5 entries that can be reused
+    unsigned int deleted_count;
+    unsigned int deleted_capacity;
+    unsigned int end_cluster; // cluster holding the 0x00 end marker (0 = directory is full)
+    unsigned int end_index;   // entry number of the end marker within that cluster
+
+    struct DIR_INDEX *lru_prev, *lru_next;
+    struct DIR_INDEX *hash_next;
+} DIR_INDEX;
+
+// counters for the dirindex command
+typedef struct {
+    unsigned long lookups;
+    unsigned long builds;    // directories scanned from disk
+    unsigned long evictions;
+    unsigned int cached;     // directories currently indexed
+    unsigned int max_dirs;
+} DIR_INDEX_STATS;
+
+// returns the index of the directory starting at cluster, building it if needed (NULL on error)
+DIR_INDEX *dir_index_get(unsigned int cluster);
+// finds an 8.3 or long name, whatever its case. copies the entry and its offset out when
+// found (either may be NULL)
+int dir_index_lookup(DIR_INDEX *idx, const char *name, DIR_ENTRY *entry, long *offset);
+// offset where a new entry can go (deleted slot first, then the end marker), -1 if full
+long dir_index_free_slot(DIR_INDEX *idx);
+// records an entry just written at offset (normally the one from dir_index_free_slot)
+void dir_index_add(DIR_INDEX *idx, const DIR_ENTRY *entry, long offset);
+// refreshes the copy of an entry that changed on disk, if its directory is indexed
+void dir_index_update(unsigned int cluster, const DIR_ENTRY *entry, long offset);
+
+// drops one directory's index (or all of them) so it's rebuilt on next use
+void dir_index_invalidate(unsigned int cluster);
+void dir_index_clear();
+// bounds the number of indexed directories
+void dir_index_set_max(unsigned int max_dirs);
+void dir_index_get_stats(DIR_INDEX_STATS *stats);
+
+// how names are compared in a directory: ASCII letters match either case
+unsigned int dir_name_hash(const char *name);
+int dir_name_equal(const char *a, const char *b);
+
+#endif // DIR_INDEX_H
@@ -0,0 +1,52 @@
+#ifndef DIR_ITER_H
+#define DIR_ITER_H
+
+#include <stddef.h>
+#include "structs.h"
+
+// most bytes of a contiguous cluster run read with one call
+#define DIR_ITER_RUN_BYTES (64u * 1024u)
+
+// walks the raw 32 byte entries of a directory. clusters that follow each other on
+// disk are read together, and the cluster after each run is prefetched
+typedef struct {
+    unsigned int next_cluster;  // first cluster not read yet
+    unsigned char *buf;         // run buffer (not used with the mmap backend)
+    size_t buf_size;
+    const unsigned char *data;  // current run, in buf or in the mapping
+    long long run_offset;       // image offset of the current run
+    unsigned int run_cluster;   // first cluster of the current run
+    unsigned int run_entries;   // entries in the current run
+    unsigned int pos;           // next entry to hand out from the run
+    unsigned int visited;       // clusters read so far, stops looping chains
+    int at_end;                 // hit the 0x00 end marker
+    int error;                  // a read failed or the chain is broken
+
+    // where the entry returned last (or the end marker) lives
+    unsigned int cluster;
+    unsigned int index;         // entry number within that cluster
+    long offset;                // byte offset in the image
+
+    // LFN parts seen since the last 8.3 entry, put together as they go by
+    unsigned short lfn_chars[LFN_MAX_PARTS * LFN_PART_CHARS];
+    unsigned int lfn_parts;     // parts in the sequence, 0 = none going
+    unsigned int lfn_expect;    // part number the next one has to have, 0 = all of them seen
+    unsigned char lfn_checksum;
+    // long name of the 8.3 entry returned last, UTF-8. "" if it has none or its parts
+    // are out of order or don't match its checksum
+    char long_name[DIR_NAME_MAX];
+} DIR_ITER;
+
+// starts at the first cluster of a directory (0 means the root). returns 0 on success
+int dir_iter_open(DIR_ITER *it, unsigned int cluster);
+// next raw entry, deleted and LFN ones included. NULL at the end marker,
+// the end of the chain or on an error (check at_end / error). LFN parts are decoded on the
+// way, so once an 8.3 entry comes back it->long_name has its long name
+DIR_ENTRY *dir_iter_next(DIR_ITER *it);
+// same, skipping deleted, LFN and volume label entries
+DIR_ENTRY *dir_iter_next_live(DIR_ITER *it);
+// the checksum LFN parts carry of the 8.3 name they belong to
+unsigned char lfn_checksum(const unsigned char *short_name);
+void dir_iter_close(DIR_ITER *it);
+
+#endif // DIR_ITER_H
@@ -0,0 +1,43 @@
+#ifndef FSCK_H
+#define FSCK_H
+
+// most worker threads a check uses
+#define FSCK_MAX_THREADS 16
+// each thread reads its slice of the FAT copies in chunks of this size
+#define FSCK_CHUNK_BYTES (1024u * 1024u)
+// problems described one by one, the rest are only counted
+#define FSCK_MAX_MESSAGES 20
+#define FSCK_MESSAGE_LEN 160
+
+// what a check found, and how fast
+typedef struct {
+    int threads;
+    int bpb_ok;
+    int mirrors_compared;          // 0 when BPB_ExtFlags turned mirroring off
+    unsigned long mirror_sectors;  // FAT sectors where a copy differs from the active FAT
+    unsigned int clusters;         // data clusters in the image
+    unsigned int free_clusters;
+    unsigned int bad_clusters;
+    unsigned int used_clusters;
+    unsigned long invalid_entries; // FAT entries pointing outside the data area or at a free cluster
+    unsigned long cross_linked;    // clusters reached from more than one place
+    unsigned long lost_chains;     // allocated chains no directory entry leads to
+    unsigned long long lost_clusters;
+    unsigned long size_mismatches; // files whose chain length doesn't fit DIR_FileSize
+    unsigned long directories;
+    unsigned long long entries;    // directory entries looked at
+    unsigned long long fat_bytes;  // FAT bytes read, all copies
+    double fat_seconds;
+    double dir_seconds;
+    double total_seconds;
+    unsigned int messages;
+    char message[FSCK_MAX_MESSAGES][FSCK_MESSAGE_LEN];
+} FSCK_REPORT;
+
+// checks the image on disk: BPB, FAT copies, cross links, lost chains and file sizes.
+// threads <= 0 picks one per CPU. returns the number of problems, -1 if the check couldn't run
+long fsck_run(int threads, FSCK_REPORT *report);
+// prints a report the way the check command and the fsck tool show it
+void fsck_print(const FSCK_REPORT *report);
+
+#endif // FSCK_H
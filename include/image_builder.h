@@ -0,0 +1,112 @@
+#ifndef IMAGE_BUILDER_H
+#define IMAGE_BUILDER_H
+
+#include "structs.h"
+
+// files a generated tree allocates at the same time, in turns, when it fragments them
+#define BUILDER_WRITERS 8
+// file contents are gathered into writes this big
+#define BUILDER_FILL_BYTES (1024u * 1024u)
+// most entries one directory can hold (2 MiB of entries)
+#define BUILDER_MAX_DIR_ENTRIES 65536u
+
+// how file sizes are picked
+typedef enum {
+    SIZE_FIXED,    // size_min
+    SIZE_UNIFORM,  // evenly between size_min and size_max
+    SIZE_LOG       // a power of two range between size_min and size_max first, then evenly in it
+} SIZE_DIST;
+
+// what to build. image_spec_defaults fills in a 64 MiB image with an empty root
+typedef struct {
+    unsigned long long image_bytes;
+    unsigned int bytes_per_sector;    // 512, 1024, 2048 or 4096
+    unsigned int sectors_per_cluster; // 0 = pick from the image size like mkfs.fat does
+    unsigned int num_fats;
+    const char *label;                // up to 11 characters
+    unsigned int seed;                // same seed, same image
+    int fill;                         // write file contents too, otherwise the data area stays sparse
+
+    // the tree image_build generates
+    unsigned int dirs;                // directories besides the root, numbered breadth first
+    unsigned int fanout;              // subdirectories per directory, so the depth is about log(dirs)
+    unsigned long files;              // spread evenly over the root and every directory
+    SIZE_DIST size_dist;
+    unsigned long long size_min;
+    unsigned long long size_max;
+    unsigned int fragmentation;       // 0-100, the percent of a file's clusters that start a new run
+    unsigned int spare_entries;       // free entries left in every directory
+} IMAGE_SPEC;
+
+// an image being built: the FAT stays in memory and clusters are handed out in order.
+// errors are sticky, so callers can check only what builder_finish returns
+typedef struct {
+    int fd;
+    BPB bpb;
+    IMAGE_SPEC spec;
+    unsigned int *fat;
+    unsigned int fat_entries;   // entries that fit in one FAT copy
+    unsigned int clusters;      // data clusters
+    unsigned int next;          // next cluster the allocator hands out
+    unsigned int cluster_bytes;
+    long long data_offset;
+    unsigned long long rng;
+    unsigned char *pattern;     // fill data, BUILDER_FILL_BYTES + 26
+    unsigned char *stage;       // contents waiting to be written, stage_len bytes at stage_offset
+    size_t stage_len;
+    long long stage_offset;
+    struct BUILDER_DIR **dirs;  // closed directories waiting to be written
+    unsigned int dir_count;
+    unsigned int dir_capacity;
+    unsigned long files;
+    unsigned long long file_bytes;
+    unsigned long writes;       // pwrite/pwritev calls
+    int failed;
+} IMAGE_BUILDER;
+
+// a directory being filled, its whole run is written in one piece by builder_finish
+typedef struct BUILDER_DIR {
+    unsigned int cluster;
+    unsigned int clusters;
+    unsigned int capacity;
+    unsigned int count;
+    DIR_ENTRY *entries;        // the whole run, zeroed past count
+} BUILDER_DIR;
+
+typedef struct {
+    unsigned int clusters;
+    unsigned int cluster_bytes;
+    unsigned int used_clusters;
+    unsigned int directories;
+    unsigned long files;
+    unsigned long long file_bytes;
+    unsigned long writes;
+    double seconds;
+} IMAGE_BUILD_STATS;
+
+void image_spec_defaults(IMAGE_SPEC *spec);
+
+// lays out the BPB and an empty FAT in a new sparse file. returns 0 on success
+int builder_start(IMAGE_BUILDER *b, const char *path, const IMAGE_SPEC *spec);
+// the next number from the builder's generator
+unsigned int builder_random(IMAGE_BUILDER *b);
+// a contiguous chain of count clusters, 0 for count 0 or when the image is full
+unsigned int builder_alloc(IMAGE_BUILDER *b, unsigned int count);
+// parent 0 opens the root. capacity doesn't count . and ..
+int builder_open_dir(IMAGE_BUILDER *b, BUILDER_DIR *d, unsigned int parent, unsigned int capacity);
+int builder_add_entry(IMAGE_BUILDER *b, BUILDER_DIR *d, const char *name, unsigned char attr, unsigned int cluster, unsigned int size);
+int builder_add_subdir(IMAGE_BUILDER *b, BUILDER_DIR *parent, BUILDER_DIR *child, const char *name, unsigned int capacity);
+int builder_add_file(IMAGE_BUILDER *b, BUILDER_DIR *d, const char *name, unsigned int size);
+// allocates count files together, each taking run clusters in random turns (0 = one after
+// another, contiguous). first gets each file's first cluster, the entries are the caller's
+int builder_alloc_files(IMAGE_BUILDER *b, const unsigned int *sizes, unsigned int count, unsigned int run, unsigned int *first);
+// hands the directory to the builder, it's written with the others at the end
+int builder_close_dir(IMAGE_BUILDER *b, BUILDER_DIR *d);
+// writes the directories sorted and coalesced, every FAT copy, the boot sectors and FSInfo,
+// then closes the image. stats can be NULL. returns 0 if nothing along the way failed
+int builder_finish(IMAGE_BUILDER *b, IMAGE_BUILD_STATS *stats);
+
+// builds the tree the spec describes: directories D0000001.. and files F0000000.DAT..
+int image_build(const char *path, const IMAGE_SPEC *spec, IMAGE_BUILD_STATS *stats);
+
+#endif // IMAGE_BUILDER_H
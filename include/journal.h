@@ -0,0 +1,70 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+
+// the redo log lives next to the image, in "<image>.journal"
+#define JOURNAL_SUFFIX ".journal"
+#define JOURNAL_MAGIC 0x4C4E524A // "JRNL"
+// a group is committed once this many commands or bytes of records are waiting
+#define JOURNAL_GROUP_OPS 32
+#define JOURNAL_GROUP_BYTES (1024u * 1024u)
+// past this size the journal is checkpointed and starts over
+#define JOURNAL_MAX_BYTES (16u * 1024u * 1024u)
+
+// record types
+#define JREC_BYTES 1      // bytes at an image offset (directory entries, new directory clusters)
+#define JREC_FAT_SECTOR 2 // one FAT sector, written to the FAT copies the BPB says are in use
+
+// on disk: a header, then its records, each followed by its data
+typedef struct __attribute__((packed)) {
+    unsigned int magic;
+    unsigned int sequence;  // one more than the transaction before it
+    unsigned int records;
+    unsigned int bytes;     // bytes of records after the header
+    unsigned int checksum;  // FNV-1a of those bytes
+} JOURNAL_HEADER;
+
+typedef struct __attribute__((packed)) {
+    unsigned int type;
+    unsigned int length;    // data bytes after this record
+    unsigned long long where; // image byte offset, or FAT sector number
+} JOURNAL_RECORD;
+
+// counters for the journal command
+typedef struct {
+    int active;                   // 0 with the mmap backend or when the sidecar can't be opened
+    unsigned long transactions;   // groups committed
+    unsigned long records;
+    unsigned long long bytes;     // journal bytes written
+    unsigned long fsyncs;         // fdatasync calls on the journal
+    unsigned long checkpoints;
+    unsigned long replayed;       // transactions replayed at mount
+    unsigned int pending_ops;     // commands waiting in the current group
+    unsigned int pending_records;
+    size_t pending_bytes;
+    long long size;               // current journal file size
+} JOURNAL_STATS;
+
+// opens the sidecar for the image and replays whatever it holds. call after the BPB is loaded,
+// before anything reads the FAT or directories. returns 0 on success (also when journaling is off)
+int journal_open(const char *image_path);
+// checkpoints and closes the sidecar
+void journal_close();
+
+// metadata write: logs the bytes and puts them in the block cache. they reach the image
+// only after the group holding the record is committed
+int journal_write(long long offset, const void *buf, size_t len);
+// logs a FAT sector about to be written to the FAT copies
+void journal_log_fat_sector(unsigned int sector, const void *data, size_t len);
+// end of a command: commits the group once it is big enough
+void journal_end_op();
+// commits waiting records (one write + one fdatasync). the block cache and FAT flush call
+// this before anything goes to the image in place
+int journal_commit();
+// commits, writes everything back, syncs the image and empties the journal
+int journal_checkpoint();
+
+void journal_get_stats(JOURNAL_STATS *stats);
+
+#endif // JOURNAL_H
@@ -6,6 +6,8 @@
 typedef struct {
     char ** items;
     size_t size;
+    size_t capacity; // slots in items (tokenize_in_place reuses them)
+    int quoted;      // index of the token that was in double quotes, -1 if none
 } tokenlist;
 
 char * get_input(void);
@@ -13,3 +15,4 @@ tokenlist * get_tokens(char *input);
 tokenlist * new_tokenlist(void);
 void add_token(tokenlist *tokens, char *item);
 void free_tokens(tokenlist *tokens);
+void tokenize_in_place(tokenlist *tokens, char *line);
@@ -0,0 +1,23 @@
+#ifndef PATH_H
+#define PATH_H
+
+#include <stddef.h>
+
+// results of path resolution
+#define PATH_OK 0
+#define PATH_NOT_FOUND 1 // some component doesn't exist
+#define PATH_NOT_DIR 2   // a component that has to be a directory isn't one
+#define PATH_INVALID 3   // too long, or no name where one is needed
+#define PATH_IO_ERROR 4
+
+// turns a path (absolute, or relative to the current directory) into the "/A/B/" form
+// used for current_path, with "." and ".." folded away
+int path_normalize(const char *path, char *out, size_t out_size);
+// resolves a path that has to name a directory. canon (may be NULL) gets its normalized form
+int path_resolve_dir(const char *path, unsigned int *cluster, char *canon, size_t canon_size);
+// resolves everything but the last name. gives the parent directory's cluster and
+// normalized path, and the last name on its own
+int path_resolve_parent(const char *path, unsigned int *parent, char *parent_path, size_t parent_path_size,
+                        char *leaf, size_t leaf_size);
+
+#endif // PATH_H
@@ -0,0 +1,52 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include <stddef.h>
+#include "structs.h"
+
+// memory for prefetched clusters
+#define RA_POOL_BYTES (4u * 1024u * 1024u)
+// read-ahead window limits, rounded to whole clusters
+#define RA_MIN_WINDOW_BYTES (16u * 1024u)
+#define RA_MAX_WINDOW_BYTES (1024u * 1024u)
+// runs waiting for the thread, and the longest run one request carries
+#define RA_QUEUE_LEN 64
+#define RA_RUN_MAX 256
+
+// counters for the readahead command
+typedef struct {
+    unsigned long prefetch_reads;   // preadv calls made by the thread
+    unsigned long long prefetched;  // clusters it loaded
+    unsigned long hits;             // read spans served from the pool
+    unsigned long misses;           // spans of sequential reads that weren't there
+    unsigned long waits;            // times a read waited for the thread to finish a cluster
+    unsigned long wasted;           // prefetched clusters dropped before anyone read them
+    unsigned int slots;             // clusters the pool holds
+    int threaded;                   // 0 with the mmap backend, which only gets madvise hints
+    int enabled;
+} READAHEAD_STATS;
+
+// sets up the pool and starts the thread (pread backend only). call after the BPB is loaded
+void readahead_init(size_t cluster_size);
+// stops the thread and frees the pool
+void readahead_shutdown();
+void readahead_set_enabled(int enabled);
+
+// forgets a file's access history, call at open
+void readahead_reset(OPEN_FILE *of);
+// call before a read of len bytes at of->offset. tracks sequential access and queues the
+// clusters past the read, up to the file's window. returns 1 if the read should try the pool
+int readahead_begin(OPEN_FILE *of, long len);
+// call after the read, missed = 1 if some of it wasn't in the pool. grows or shrinks the window
+void readahead_end(OPEN_FILE *of, int missed);
+
+// copies len bytes at an image offset out of the pool, waiting for clusters still being read.
+// returns 0 if all of it was there, 1 if the caller has to read it itself
+int readahead_copy(long long offset, void *buf, size_t len);
+// anything prefetched before this is stale, the block layer calls it on every write
+void readahead_invalidate();
+
+void readahead_get_stats(READAHEAD_STATS *stats);
+void readahead_reset_stats();
+
+#endif // READAHEAD_H
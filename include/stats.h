@@ -0,0 +1,66 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stddef.h>
+
+// per-command cost counters and latency histograms, built in with `make INSTRUMENT=1`
+// (-DFS_INSTRUMENT). in other builds every STAT_ macro is empty, so nothing is counted.
+
+// latency buckets: <1 us, then 1-2, 2-4, ... and the last one everything above
+#define STATS_BUCKETS 24
+// distinct commands the histograms keep apart
+#define STATS_MAX_COMMANDS 48
+
+// what the file system did
+typedef struct {
+    unsigned long reads;             // image reads (what the block cache didn't have)
+    unsigned long writes;            // image writes
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long seeks;             // image accesses that didn't start where the last one ended
+    unsigned long fat_lookups;       // read_fat_entry calls
+    unsigned long fat_disk_lookups;  // ... that had to read the image
+    unsigned long fat_updates;       // write_fat_entry calls
+    unsigned long chain_steps;       // FAT links followed to find a file offset
+    unsigned long allocations;       // clusters allocated
+    unsigned long cache_hits;        // block cache, from its own counters
+    unsigned long cache_misses;
+} FS_COUNTERS;
+
+// one command's numbers since the shell started (or the last stats reset)
+typedef struct {
+    const char *name;
+    unsigned long count;
+    unsigned long long total_ns;
+    unsigned long long max_ns;
+    unsigned long buckets[STATS_BUCKETS];
+    FS_COUNTERS counters;
+} COMMAND_STATS;
+
+// where a command started, for the difference when it ends
+typedef struct {
+    FS_COUNTERS counters;
+    long long start_ns;
+} STATS_SAMPLE;
+
+#ifdef FS_INSTRUMENT
+extern FS_COUNTERS g_counters;
+#define STAT_ADD(field, n) (g_counters.field += (n))
+#define STAT_ACCESS(offset, len, write) stats_access((offset), (len), (write))
+#else
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_ACCESS(offset, len, write) ((void)0)
+#endif
+#define STAT_INC(field) STAT_ADD(field, 1)
+
+// counts one image access, and a seek if it doesn't continue the last one
+void stats_access(long long offset, size_t len, int write);
+void stats_begin(STATS_SAMPLE *sample);
+// adds the command to its histogram. delta (optional) gets what it cost, returns its latency in ns
+long long stats_end(const char *name, const STATS_SAMPLE *sample, FS_COUNTERS *delta);
+// the cost breakdown time prints
+void stats_print_cost(const char *name, long long ns, const FS_COUNTERS *delta);
+// stats: totals, per-command latency and histograms. "stats reset" zeroes them
+int stats_command(char *arg);
+
+#endif // STATS_H
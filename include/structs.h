@@ -42,6 +42,22 @@ typedef struct __attribute__((packed)) {
     unsigned short signature;           // 2 bytes (Offset 0x1FE)
 } BPB;
 
+// FSInfo sector struct (sector number is BPB_FSInfo)
+typedef struct __attribute__((packed)) {
+    unsigned int   FSI_LeadSig;        // 4 bytes - 0x41615252
+    unsigned char  FSI_Reserved1[480]; // 480 bytes
+    unsigned int   FSI_StrucSig;       // 4 bytes (Offset 0x1E4) - 0x61417272
+    unsigned int   FSI_Free_Count;     // 4 bytes - last known free cluster count
+    unsigned int   FSI_Nxt_Free;       // 4 bytes - hint for where to look for a free cluster
+    unsigned char  FSI_Reserved2[12];  // 12 bytes
+    unsigned int   FSI_TrailSig;       // 4 bytes (Offset 0x1FC) - 0xAA550000
+} FSINFO;
+
+#define FSI_LEAD_SIG  0x41615252
+#define FSI_STRUC_SIG 0x61417272
+#define FSI_TRAIL_SIG 0xAA550000
+#define FSI_UNKNOWN   0xFFFFFFFF
+
 // directory entry struct
 typedef struct __attribute__((packed)) {
     unsigned char DIR_Name[11];         // 11 bytes - file name
@@ -58,6 +74,26 @@ typedef struct __attribute__((packed)) {
     unsigned int   DIR_FileSize;       // 4 bytes - size of file in bytes
 } DIR_ENTRY;
 
+// long file name entry, a run of these (last part first) comes right before the 8.3 entry they name
+typedef struct __attribute__((packed)) {
+    unsigned char  LDIR_Ord;           // 1 byte - part number from 1, 0x40 set on the last part
+    unsigned short LDIR_Name1[5];      // 10 bytes - UTF-16 characters 1-5 of this part
+    unsigned char  LDIR_Attr;          // 1 byte - ATTR_LFN
+    unsigned char  LDIR_Type;          // 1 byte - 0
+    unsigned char  LDIR_Chksum;        // 1 byte - checksum of the 8.3 name
+    unsigned short LDIR_Name2[6];      // 12 bytes - characters 6-11
+    unsigned short LDIR_FstClusLO;     // 2 bytes - 0
+    unsigned short LDIR_Name3[2];      // 4 bytes - characters 12-13
+} LFN_ENTRY;
+
+#define LFN_LAST_ENTRY 0x40
+#define LFN_ORD_MASK   0x1F
+#define LFN_PART_CHARS 13
+#define LFN_MAX_PARTS  20  // 255 characters
+#define LFN_MAX_CHARS  255
+// longest name a directory can hold as UTF-8, with the NUL
+#define DIR_NAME_MAX   (LFN_MAX_CHARS * 3 + 1)
+
 //defines the allowed access modes
 typedef enum {
     MODE_READ,
@@ -66,27 +102,121 @@ typedef enum {
     MODE_WRITE_READ
 } FILE_ACCESS_MODE;
 
+// one run of a file's cluster chain that is contiguous on disk
+typedef struct {
+    unsigned int file_cluster; // index of the run's first cluster within the file
+    unsigned int start;        // physical cluster the run starts at
+    unsigned int length;       // number of clusters in the run
+} FILE_EXTENT;
+
+// sequential access tracking for one open file (read-ahead)
+typedef struct {
+    long next_offset;     // where the next read starts if the file is read sequentially
+    unsigned int window;  // clusters to keep prefetched past the reader, 0 = not sequential
+    unsigned int ahead;   // file cluster read-ahead has been queued up to
+} READAHEAD_STATE;
+
 // struct to hold state of open files
 typedef struct {
     int index; // index in the open file table
     int is_used; // flag to indicate if this entry is in use
-    char name[13]; // file name
+    char name[DIR_NAME_MAX]; // file name as opened (8.3 or long)
     char path[256]; //full path
     FILE_ACCESS_MODE mode; // access mode
     long offset; // read/write offset
     unsigned int starting_cluster;
     unsigned int file_size;
+    long dir_entry_offset; // byte offset of the file's DIR_ENTRY in the image
+    unsigned int dir_cluster; // first cluster of the directory holding it
+
+    // extent map of the cluster chain, built at open and extended as needed
+    FILE_EXTENT *extents;
+    unsigned int extent_count;
+    unsigned int extent_capacity;
+    unsigned int mapped_clusters; // clusters covered by the map so far
+    int map_complete; // map reaches the end of the chain
+
+    READAHEAD_STATE ra;
 } OPEN_FILE;
 
+// one piece of a vectored image request
+typedef struct {
+    unsigned int sector; // first sector
+    unsigned int count;  // number of sectors
+    void *buf;
+} IO_SEGMENT;
+
+// most buffers one preadv/pwritev takes (Linux UIO_MAXIOV)
+#define IO_MAX_IOV 1024
+
+// block layer counters
+typedef struct {
+    unsigned long read_calls;    // pread/preadv syscalls
+    unsigned long write_calls;   // pwrite/pwritev syscalls
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long segments_merged; // segments that shared a syscall with the one before
+    unsigned long commands;        // shell commands run
+    unsigned long fat_updates;     // FAT entries changed (each used to cost one write per FAT copy)
+    unsigned long fat_write_calls; // write syscalls FAT flushes actually made
+} IO_STATS;
+
+// a FAT sector waiting to be written back when the FAT isn't resident
+typedef struct {
+    unsigned int sector; // sector number within one FAT copy
+    unsigned char *data;
+    int logged;          // the journal has this version of it
+} FAT_SECTOR_BUF;
+
 // max number of open files
 #define MAX_OPEN_FILES 10 // for our prohect its 10
+// largest FAT we keep resident in memory, bigger FATs are read from disk per entry
+#define FAT_RESIDENT_MAX_BYTES (256u * 1024u * 1024u)
+// dirty FAT sectors buffered for a non-resident FAT before a forced flush
+#define FAT_DIRTY_MAX_BYTES (2u * 1024u * 1024u)
+// read streams through a buffer of about this size (whole clusters), whatever the read size
+#define READ_CHUNK_BYTES (64u * 1024u)
+// contiguous spans at least this long go to stdout with sendfile
+#define READ_SENDFILE_MIN (64u * 1024u)
+// get/put copy buffer, used only when the kernel can't copy between the files itself
+#define HOST_COPY_BYTES (1024u * 1024u)
 // global state struct
 typedef struct {
     BPB fs_bpb;
     unsigned int current_cluster;
     char current_path[256];
     char image_name[256];
-    FILE *image_fp;
+    int image_fd; // raw fd of the image, all I/O is positional (pread/pwrite)
+    IO_STATS io_stats;
+
+    // mmap backend (image_map is NULL when using pread/pwrite on image_fd)
+    unsigned char *image_map;
+    size_t image_size;
+
+    // resident copy of the FAT (NULL when the FAT is too large to keep in memory)
+    unsigned int *fat_table;
+    unsigned int fat_entries;   // number of entries in fat_table
+    unsigned char *fat_dirty;   // one flag per FAT sector waiting to be written back (2 = already journaled)
+    int fat_unlogged;           // the FAT changed since the journal last logged it
+
+    // non-resident FAT: changed sectors, found through an open addressing table of index + 1
+    FAT_SECTOR_BUF *fat_bufs;
+    unsigned int fat_buf_count;
+    unsigned int fat_buf_max;
+    unsigned int *fat_buf_slots;
+    unsigned int fat_buf_slot_count; // power of two, twice fat_buf_max or more
+
+    // -n mount option: mirroring is switched off on disk until unmount, then the copies are resynced
+    int fat_mirror_deferred;
+    int fat_mirror_stale;            // the active FAT changed since the copies were last equal
+    unsigned short saved_ext_flags;  // BPB_ExtFlags to put back at unmount
+
+    // free cluster bitmap, one bit per cluster (set = in use)
+    unsigned long long *free_map;
+    unsigned int free_count;    // number of free clusters
+    unsigned int next_free;     // next-fit allocator cursor
+    FSINFO fs_info;
+    int fs_info_valid;          // FSInfo signatures checked out
 
     OPEN_FILE open_file_table[MAX_OPEN_FILES]; // array to hold open file states
 } FS_STATE;
@@ -100,6 +230,10 @@ extern FS_STATE g_fs_state;
 #define ATTR_VOLUME_ID 0x08
 #define ATTR_DIRECTORY 0x10
 #define ATTR_ARCHIVE   0x20
-#define ATTR_LFN       0x0F // long file - skip entries
+#define ATTR_LFN       0x0F // long file name part (LFN_ENTRY)
+
+//BPB_ExtFlags bits
+#define EXT_FLAGS_ACTIVE_FAT 0x000F // FAT in use when mirroring is off
+#define EXT_FLAGS_NO_MIRROR  0x0080 // only the active FAT is kept up to date
 
 #endif // STRUCTS_H
\ No newline at end of file
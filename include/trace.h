@@ -0,0 +1,66 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+
+// records of the image I/O trace, a ring: once it's full the oldest are overwritten.
+// power of two, 32 bytes each (8 MiB)
+#define TRACE_RECORDS (1u << 18)
+// distinct origins a trace can name (the shell, read-ahead and the commands)
+#define TRACE_MAX_ORIGINS 64
+
+// what part of the image an access starts in
+typedef enum {
+    TRACE_BOOT,  // reserved sectors: boot sector, FSInfo, backup
+    TRACE_FAT,
+    TRACE_DIR,   // data clusters seen holding a directory
+    TRACE_DATA
+} TRACE_REGION;
+
+// one image access
+typedef struct {
+    unsigned long long ns;      // start, since tracing was turned on
+    unsigned long long offset;  // byte offset in the image
+    unsigned int len;
+    unsigned int dur_ns;
+    unsigned short origin;      // 0 = the shell between commands, 1 = read-ahead, then commands
+    unsigned char write;
+    unsigned char region;       // TRACE_REGION
+} TRACE_RECORD;
+
+// set while tracing, so the hooks below cost one test when it's off
+extern int g_trace_on;
+
+// the start time to hand to trace_io, 0 while tracing is off
+#define TRACE_CLOCK() (g_trace_on ? trace_clock() : 0)
+// records the access if tracing was on when it started and it moved anything
+#define TRACE_IO(start, offset, len, write) \
+    do { if ((start) != 0 && (len) != 0) trace_io((start), (offset), (len), (write), 0); } while (0)
+#define TRACE_NOTE_DIR(offset, len) \
+    do { if (g_trace_on) trace_note_dir((offset), (len)); } while (0)
+
+long long trace_clock();
+// records an access that started at start (from TRACE_CLOCK). background = 1 for the
+// read-ahead thread, otherwise it's the current command's. safe from any thread
+void trace_io(long long start, long long offset, size_t len, int write, int background);
+// the command accesses are charged to from now on, NULL between commands.
+// name has to outlive the trace (the command table's names do)
+void trace_set_command(const char *name);
+// the data clusters under len bytes at offset hold a directory
+void trace_note_dir(long long offset, size_t len);
+
+// starts a new trace (the ring is allocated the first time). returns 0 on success
+int trace_start();
+void trace_stop();
+// writes what the ring holds, oldest first: Chrome trace JSON if path ends in .json, else CSV.
+// returns 0 on success
+int trace_dump(const char *path);
+// path to dump to when the shell exits (-T)
+void trace_dump_at_exit(const char *path);
+// stops tracing, does the exit dump if there is one and frees the ring. call once the
+// read-ahead thread is stopped
+void trace_finish();
+// trace [on|off|dump FILE]
+int trace_command(char *arg, char *path);
+
+#endif // TRACE_H
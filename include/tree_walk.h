@@ -0,0 +1,43 @@
+#ifndef TREE_WALK_H
+#define TREE_WALK_H
+
+// most threads a walk uses
+#define WALK_MAX_THREADS 16
+#define WALK_PATH_MAX 512
+// starting size of each thread's deque, it grows as needed
+#define WALK_DEQUE_START 64
+
+// what to collect on the way
+typedef struct {
+    const char *pattern;  // find: entries whose name matches this glob (case-insensitive), NULL = none
+    int count_clusters;   // du: walk every file's chain
+    int threads;          // <= 0 = one per CPU
+} WALK_OPTIONS;
+
+// one directory the walk went through
+typedef struct {
+    char path[WALK_PATH_MAX];
+    unsigned long files;           // files directly in it
+    unsigned long long clusters;   // its own chain plus the files directly in it
+    unsigned long long total;      // clusters of everything under it, itself included
+} WALK_DIR;
+
+typedef struct {
+    WALK_DIR *dirs;          // sorted by path, the starting directory first
+    unsigned int dir_count;
+    char **matches;          // sorted paths, directories end in '/'
+    unsigned int match_count;
+    unsigned long files;
+    unsigned long long entries;
+    unsigned long steals;    // directories a thread took from another's deque
+    int threads;
+    double seconds;
+} WALK_RESULT;
+
+// walks everything under start_cluster (whose path is start_path) with a pool of threads, each
+// with its own deque of directories that idle threads steal from. results come back sorted, so
+// they don't depend on the thread count. returns 0 on success
+int tree_walk(unsigned int start_cluster, const char *start_path, const WALK_OPTIONS *opts, WALK_RESULT *result);
+void tree_walk_free(WALK_RESULT *result);
+
+#endif // TREE_WALK_H
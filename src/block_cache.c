@@ -0,0 +1,432 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "structs.h"
+#include "commands.h"
+#include "block_cache.h"
+#include "journal.h"
+
+// one cached sector, the data follows the header in the same allocation
+typedef struct BCACHE_BLOCK {
+    unsigned int sector;
+    int dirty;
+    int pins;
+    struct BCACHE_BLOCK *lru_prev; // towards most recently used
+    struct BCACHE_BLOCK *lru_next; // towards least recently used
+    struct BCACHE_BLOCK *hash_next;
+} BCACHE_BLOCK;
+
+#define BLOCK_DATA(blk) ((unsigned char *)((blk) + 1))
+#define DATA_BLOCK(data) (((BCACHE_BLOCK *)(data)) - 1)
+
+// cache state
+static size_t g_block_size = 0;
+static unsigned int g_max_blocks = 0;
+static unsigned int g_num_blocks = 0;
+static BCACHE_BLOCK **g_buckets = NULL;
+static unsigned int g_num_buckets = 0; // power of two
+static BCACHE_BLOCK *g_lru_head = NULL; // most recently used
+static BCACHE_BLOCK *g_lru_tail = NULL; // least recently used
+static BCACHE_STATS g_stats;
+
+// HELPERS -----------------------------------------
+
+static unsigned int hash_sector(unsigned int sector) {
+    return (sector * 2654435761u) & (g_num_buckets - 1);
+}
+
+static unsigned int budget_to_blocks(size_t budget_bytes) {
+    size_t blocks = budget_bytes / g_block_size;
+    if (blocks < BCACHE_MIN_BLOCKS) blocks = BCACHE_MIN_BLOCKS;
+    return (unsigned int)blocks;
+}
+
+static BCACHE_BLOCK *lookup(unsigned int sector) {
+    BCACHE_BLOCK *blk = g_buckets[hash_sector(sector)];
+    while (blk != NULL && blk->sector != sector) {
+        blk = blk->hash_next;
+    }
+    return blk;
+}
+
+static void lru_unlink(BCACHE_BLOCK *blk) {
+    if (blk->lru_prev) blk->lru_prev->lru_next = blk->lru_next;
+    else g_lru_head = blk->lru_next;
+    if (blk->lru_next) blk->lru_next->lru_prev = blk->lru_prev;
+    else g_lru_tail = blk->lru_prev;
+    blk->lru_prev = blk->lru_next = NULL;
+}
+
+static void lru_push_head(BCACHE_BLOCK *blk) {
+    blk->lru_prev = NULL;
+    blk->lru_next = g_lru_head;
+    if (g_lru_head) g_lru_head->lru_prev = blk;
+    g_lru_head = blk;
+    if (g_lru_tail == NULL) g_lru_tail = blk;
+}
+
+static void hash_insert(BCACHE_BLOCK *blk) {
+    unsigned int h = hash_sector(blk->sector);
+    blk->hash_next = g_buckets[h];
+    g_buckets[h] = blk;
+}
+
+static void hash_remove(BCACHE_BLOCK *blk) {
+    BCACHE_BLOCK **link = &g_buckets[hash_sector(blk->sector)];
+    while (*link != NULL && *link != blk) {
+        link = &(*link)->hash_next;
+    }
+    if (*link) *link = blk->hash_next;
+}
+
+// grows the hash table so chains stay short for the given number of blocks
+static void resize_buckets(unsigned int max_blocks) {
+    unsigned int wanted = 64;
+    while (wanted < max_blocks * 2) wanted *= 2;
+    if (wanted == g_num_buckets) return;
+
+    BCACHE_BLOCK **buckets = (BCACHE_BLOCK **)calloc(wanted, sizeof(BCACHE_BLOCK *));
+    if (!buckets) return; // keep the old table, chains just get longer
+
+    free(g_buckets);
+    g_buckets = buckets;
+    g_num_buckets = wanted;
+    for (BCACHE_BLOCK *blk = g_lru_head; blk != NULL; blk = blk->lru_next) {
+        hash_insert(blk);
+    }
+}
+
+static int write_back(BCACHE_BLOCK *blk) {
+    if (!blk->dirty) return 0;
+    // the block may hold metadata still waiting in the journal, the commit writes it back
+    if (journal_commit() != 0) return 1;
+    if (!blk->dirty) return 0;
+    if (image_write((long long)blk->sector * g_block_size, BLOCK_DATA(blk), g_block_size) != 0) {
+        fprintf(stderr, "Error: Failed to write back sector %u\n", blk->sector);
+        return 1;
+    }
+    blk->dirty = 0;
+    g_stats.dirty--;
+    g_stats.writebacks++;
+    return 0;
+}
+
+// removes a block from the cache and frees it
+static void drop_block(BCACHE_BLOCK *blk) {
+    hash_remove(blk);
+    lru_unlink(blk);
+    if (blk->dirty) g_stats.dirty--;
+    free(blk);
+    g_num_blocks--;
+}
+
+// evicts unpinned blocks from the LRU end until we're within max_blocks
+static void trim_to(unsigned int max_blocks) {
+    BCACHE_BLOCK *blk = g_lru_tail;
+    while (g_num_blocks > max_blocks && blk != NULL) {
+        BCACHE_BLOCK *prev = blk->lru_prev;
+        if (blk->pins == 0 && write_back(blk) == 0) {
+            drop_block(blk);
+            g_stats.evictions++;
+        }
+        blk = prev;
+    }
+}
+
+// gets a new block for sector (not read from disk), evicting if the cache is full
+static BCACHE_BLOCK *new_block(unsigned int sector) {
+    if (g_num_blocks >= g_max_blocks) {
+        trim_to(g_max_blocks - 1);
+    }
+
+    // if everything is pinned we go over budget until the pins are released
+    BCACHE_BLOCK *blk = (BCACHE_BLOCK *)malloc(sizeof(BCACHE_BLOCK) + g_block_size);
+    if (!blk) return NULL;
+
+    blk->sector = sector;
+    blk->dirty = 0;
+    blk->pins = 0;
+    blk->lru_prev = blk->lru_next = blk->hash_next = NULL;
+    hash_insert(blk);
+    lru_push_head(blk);
+    g_num_blocks++;
+    return blk;
+}
+
+// SETUP -----------------------------------------
+
+void bcache_init(size_t block_size, size_t budget_bytes) {
+    bcache_destroy();
+    memset(&g_stats, 0, sizeof(g_stats));
+    g_block_size = block_size;
+    g_max_blocks = budget_to_blocks(budget_bytes);
+    resize_buckets(g_max_blocks);
+}
+
+void bcache_set_budget(size_t budget_bytes) {
+    if (g_block_size == 0) return;
+    g_max_blocks = budget_to_blocks(budget_bytes);
+    trim_to(g_max_blocks);
+    resize_buckets(g_max_blocks);
+}
+
+void bcache_destroy() {
+    if (g_block_size == 0) return;
+    bcache_flush();
+    while (g_lru_head != NULL) {
+        drop_block(g_lru_head);
+    }
+    free(g_buckets);
+    g_buckets = NULL;
+    g_num_buckets = 0;
+    g_block_size = 0;
+}
+
+// BLOCK ACCESS -----------------------------------------
+
+unsigned char *bcache_get(unsigned int sector) {
+    // mmap backend: hand out the mapped sector itself, nothing to cache
+    if (g_fs_state.image_map != NULL) {
+        return image_map_range((long long)sector * g_block_size, g_block_size);
+    }
+
+    BCACHE_BLOCK *blk = lookup(sector);
+    if (blk != NULL) {
+        g_stats.hits++;
+        lru_unlink(blk);
+        lru_push_head(blk);
+    } else {
+        g_stats.misses++;
+        blk = new_block(sector);
+        if (!blk) return NULL;
+        if (image_read((long long)sector * g_block_size, BLOCK_DATA(blk), g_block_size) != 0) {
+            drop_block(blk);
+            return NULL;
+        }
+    }
+    if (blk->pins++ == 0) g_stats.pinned++;
+    return BLOCK_DATA(blk);
+}
+
+void bcache_put(unsigned char *block, int dirty) {
+    if (block == NULL || g_fs_state.image_map != NULL) return;
+    BCACHE_BLOCK *blk = DATA_BLOCK(block);
+    if (dirty && !blk->dirty) {
+        blk->dirty = 1;
+        g_stats.dirty++;
+    }
+    if (--blk->pins == 0) {
+        g_stats.pinned--;
+        if (g_num_blocks > g_max_blocks) trim_to(g_max_blocks);
+    }
+}
+
+// BYTE RANGE I/O -----------------------------------------
+
+int bcache_read(long long offset, void *buf, size_t len) {
+    if (len == 0) return 0;
+    if (g_fs_state.image_map != NULL) return image_read(offset, buf, len);
+
+    unsigned char *out = (unsigned char *)buf;
+    long long end = offset + (long long)len;
+    unsigned int first = (unsigned int)(offset / (long long)g_block_size);
+    unsigned int last = (unsigned int)((end - 1) / (long long)g_block_size);
+    // big reads would just flush everything else out, so they don't stay cached
+    int cache_it = (last - first + 1) <= g_max_blocks / 2;
+
+    unsigned int s = first;
+    while (s <= last) {
+        long long sec_start = (long long)s * g_block_size;
+        BCACHE_BLOCK *blk = lookup(s);
+
+        if (blk != NULL) {
+            long long from = offset > sec_start ? offset : sec_start;
+            long long to = end < sec_start + (long long)g_block_size ? end : sec_start + (long long)g_block_size;
+            memcpy(out + (from - offset), BLOCK_DATA(blk) + (from - sec_start), (size_t)(to - from));
+            lru_unlink(blk);
+            lru_push_head(blk);
+            g_stats.hits++;
+            s++;
+            continue;
+        }
+
+        // gather the run of missing sectors and read it with one I/O
+        unsigned int run_end = s;
+        while (run_end + 1 <= last && lookup(run_end + 1) == NULL) run_end++;
+        unsigned int run = run_end - s + 1;
+        long long run_start = sec_start;
+        long long run_stop = (long long)(run_end + 1) * g_block_size;
+
+        // read straight into the caller's buffer when the run is fully inside it
+        unsigned char *run_buf;
+        int direct = run_start >= offset && run_stop <= end;
+        if (direct) {
+            run_buf = out + (run_start - offset);
+        } else {
+            run_buf = (unsigned char *)malloc((size_t)run * g_block_size);
+            if (!run_buf) return 1;
+        }
+
+        if (image_read(run_start, run_buf, (size_t)run * g_block_size) != 0) {
+            if (!direct) free(run_buf);
+            return 1;
+        }
+
+        if (!direct) {
+            long long from = offset > run_start ? offset : run_start;
+            long long to = end < run_stop ? end : run_stop;
+            memcpy(out + (from - offset), run_buf + (from - run_start), (size_t)(to - from));
+        }
+
+        for (unsigned int i = 0; i < run; i++) {
+            if (cache_it) {
+                BCACHE_BLOCK *nb = new_block(s + i);
+                if (nb) memcpy(BLOCK_DATA(nb), run_buf + (size_t)i * g_block_size, g_block_size);
+                g_stats.misses++;
+            } else {
+                g_stats.bypassed++;
+            }
+        }
+
+        if (!direct) free(run_buf);
+        s = run_end + 1;
+    }
+    return 0;
+}
+
+int bcache_write(long long offset, const void *buf, size_t len) {
+    if (len == 0) return 0;
+    if (g_fs_state.image_map != NULL) return image_write(offset, buf, len);
+
+    const unsigned char *in = (const unsigned char *)buf;
+    long long end = offset + (long long)len;
+    unsigned int first = (unsigned int)(offset / (long long)g_block_size);
+    unsigned int last = (unsigned int)((end - 1) / (long long)g_block_size);
+    unsigned int count = last - first + 1;
+
+    // big writes go straight to disk, cached copies are written back and dropped first
+    if (count > g_max_blocks / 2) {
+        bcache_invalidate(first, count);
+        g_stats.bypassed += count;
+        return image_write(offset, buf, len);
+    }
+
+    for (unsigned int s = first; s <= last; s++) {
+        long long sec_start = (long long)s * g_block_size;
+        long long from = offset > sec_start ? offset : sec_start;
+        long long to = end < sec_start + (long long)g_block_size ? end : sec_start + (long long)g_block_size;
+        unsigned char *data;
+
+        if (to - from == (long long)g_block_size) {
+            // whole sector is overwritten, no need to read it first
+            BCACHE_BLOCK *blk = lookup(s);
+            if (blk == NULL) {
+                blk = new_block(s);
+                if (!blk) return 1;
+            }
+            if (blk->pins++ == 0) g_stats.pinned++;
+            data = BLOCK_DATA(blk);
+        } else {
+            data = bcache_get(s);
+            if (!data) return 1;
+        }
+
+        memcpy(data + (from - sec_start), in + (from - offset), (size_t)(to - from));
+        bcache_put(data, 1);
+    }
+    return 0;
+}
+
+int bcache_flush() {
+    if (g_stats.dirty == 0) return 0;
+    // nothing reaches the image before the journal has it (commit flushes on its own)
+    if (journal_commit() != 0) return 1;
+    if (g_stats.dirty == 0) return 0;
+
+    // collect the dirty blocks, the block layer sorts them by sector
+    BCACHE_BLOCK **dirty = (BCACHE_BLOCK **)malloc(g_stats.dirty * sizeof(BCACHE_BLOCK *));
+    if (!dirty) {
+        int failed = 0;
+        for (BCACHE_BLOCK *blk = g_lru_head; blk != NULL; blk = blk->lru_next) {
+            failed |= write_back(blk);
+        }
+        return failed;
+    }
+
+    unsigned int n = 0;
+    for (BCACHE_BLOCK *blk = g_lru_head; blk != NULL; blk = blk->lru_next) {
+        if (blk->dirty) dirty[n++] = blk;
+    }
+
+    // one segment per block, the block layer merges back to back sectors into one pwritev
+    IO_SEGMENT *segs = (IO_SEGMENT *)malloc(n * sizeof(IO_SEGMENT));
+    int failed = 0;
+    if (segs != NULL) {
+        for (unsigned int i = 0; i < n; i++) {
+            segs[i].sector = dirty[i]->sector;
+            segs[i].count = 1;
+            segs[i].buf = BLOCK_DATA(dirty[i]);
+        }
+        if (image_writev(segs, (int)n) != 0) {
+            fprintf(stderr, "Error: Failed to write back dirty sectors\n");
+            failed = 1;
+        } else {
+            for (unsigned int i = 0; i < n; i++) {
+                dirty[i]->dirty = 0;
+                g_stats.writebacks++;
+            }
+            g_stats.dirty -= n;
+        }
+        free(segs);
+    } else {
+        for (unsigned int i = 0; i < n; i++) {
+            failed |= write_back(dirty[i]);
+        }
+    }
+
+    free(dirty);
+    return failed;
+}
+
+void bcache_invalidate(unsigned int sector, unsigned int count) {
+    if (g_block_size == 0) return;
+
+    // big ranges: cheaper to walk what's cached than to probe every sector
+    if (count > g_num_blocks) {
+        BCACHE_BLOCK *blk = g_lru_head;
+        while (blk != NULL) {
+            BCACHE_BLOCK *next = blk->lru_next;
+            if (blk->sector >= sector && blk->sector - sector < count &&
+                blk->pins == 0 && write_back(blk) == 0) {
+                drop_block(blk);
+            }
+            blk = next;
+        }
+        return;
+    }
+
+    for (unsigned int s = sector; s < sector + count; s++) {
+        BCACHE_BLOCK *blk = lookup(s);
+        // pinned blocks are still in use, they stay (callers only pin for one command)
+        if (blk != NULL && blk->pins == 0 && write_back(blk) == 0) {
+            drop_block(blk);
+        }
+    }
+}
+
+// STATS -----------------------------------------
+
+void bcache_get_stats(BCACHE_STATS *stats) {
+    *stats = g_stats;
+    stats->blocks = g_num_blocks;
+    stats->max_blocks = g_max_blocks;
+    stats->block_size = g_block_size;
+}
+
+void bcache_reset_stats() {
+    g_stats.hits = 0;
+    g_stats.misses = 0;
+    g_stats.evictions = 0;
+    g_stats.writebacks = 0;
+    g_stats.bypassed = 0;
+}
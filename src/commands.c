@@ -1,14 +1,31 @@
+#define _POSIX_C_SOURCE 200809L // open, close
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h> 
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <sys/stat.h>
 #include "structs.h" 
 #include "commands.h"
 #include "lexer.h" 
+#include "block_cache.h"
+#include "dir_index.h"
+#include "dir_iter.h"
+#include "dentry.h"
+#include "path.h"
+#include "readahead.h"
+#include "journal.h"
+#include "fsck.h"
+#include "tree_walk.h"
+#include "stats.h"
+#include "trace.h"
 
 // external declarations
 extern FS_STATE g_fs_state; 
-extern unsigned int load_bpb_and_init_state(const char *image_name, FILE *fp);
+extern unsigned int load_bpb_and_init_state(const char *image_name, int fd);
 extern unsigned int get_total_clusters(); 
 extern unsigned int get_cluster_sector(unsigned int cluster_num); 
 extern unsigned int read_fat_entry(unsigned int cluster_num);    
@@ -16,9 +33,6 @@ extern unsigned int find_cluster_from_offset(unsigned int starting_cluster, long
 extern void write_fat_entry(unsigned int cluster_num, unsigned int value);
 extern unsigned int get_free_cluster();
 
-extern tokenlist *get_tokens(char *line); 
-extern void free_tokens(tokenlist *tokens);
-
 
 // trims leading and trailing whitespace from a string
 void trim_whitespace(char *str) {
@@ -38,114 +52,50 @@ void trim_whitespace(char *str) {
     }
 }
 
-//get formatted name for ls
-void get_formatted_name(unsigned char *raw_name, char *out_name) {
-    char name[9];
-    char ext[4];
-    
-    // clean name
-    strncpy(name, (char*)raw_name, 8);
-    name[8] = '\0';
-    for(int i=7; i>=0; i--) {
-        if(name[i] == ' ') name[i] = '\0';
-        else break;
+//searches a directory (through its name index) for a name.
+//if it isn't there and slot_offset is given, slot_offset gets a free slot for a new entry (-1 = full)
+int search_directory(unsigned int dir_cluster, char *name, DIR_ENTRY *search_dir_entry, long *slot_offset)
+{
+    DIR_INDEX *idx = dir_index_get(dir_cluster);
+    if (idx == NULL) {
+        printf("Error: Failed to read the directory.\n");
+        return 0;
     }
-    
-    // clean extension
-    strncpy(ext, (char*)raw_name + 8, 3);
-    ext[3] = '\0';
-    for(int i=2; i>=0; i--) {
-        if(ext[i] == ' ') ext[i] = '\0';
-        else break;
+
+    if (dir_index_lookup(idx, name, search_dir_entry, NULL)) {
+        return 1;
     }
-    
-    //format output
-    if (strlen(ext) > 0) {
-        sprintf(out_name, "%s.%s", name, ext);
-    } else {
-        strcpy(out_name, name);
+
+    if (slot_offset != NULL) {
+        *slot_offset = dir_index_free_slot(idx);
     }
+    return 0;
 }
 
-//searches to see if there is already an open file with the same name and path
-int search_current_directory(char *name, DIR_ENTRY *search_dir_entry, long *slot_offset)
+//records a new entry in its directory's index. if the index can't be had (read error, no
+//memory) the directory is dropped instead and rebuilt from disk on the next lookup
+static void add_to_index(unsigned int dir_cluster, const DIR_ENTRY *entry, long offset)
 {
-    unsigned int current_cluster = g_fs_state.current_cluster;
-    unsigned int sector_size = g_fs_state.fs_bpb.BPB_BytsPerSec;
-    unsigned int sectors_per_cluster = g_fs_state.fs_bpb.BPB_SecPerClus;
-    
-    unsigned char *buffer = (unsigned char *)malloc(sector_size);
-    if (!buffer) {
-        printf("Error: Memory allocation failed during directory search.\n");
-        return 0; 
+    DIR_INDEX *idx = dir_index_get(dir_cluster);
+    if (idx != NULL) {
+        dir_index_add(idx, entry, offset);
+    } else {
+        dir_index_invalidate(dir_cluster);
     }
+}
 
-    int found = 0;
-    
-    while (current_cluster < 0x0FFFFFF8) {
-        unsigned int start_sector = get_cluster_sector(current_cluster);
-        
-        for (unsigned int i = 0; i < sectors_per_cluster; i++) {
-            unsigned int sector_to_read = start_sector + i;
-            long offset = (long)sector_to_read * sector_size;
-            
-            //seek/read sector
-            if (fseek(g_fs_state.image_fp, offset, SEEK_SET) != 0 ||
-                fread(buffer, sector_size, 1, g_fs_state.image_fp) != 1) {
-                goto search_end; 
-            }
-            
-            for (unsigned int j = 0; j < sector_size; j += 32) {
-                DIR_ENTRY *entry = (DIR_ENTRY *)(buffer + j);
-                
-                //calc byte offset
-                long entry_abs_offset = offset + j;
-
-                // end of directory
-                if (entry->DIR_Name[0] == 0x00) {
-                    if (slot_offset != NULL) {
-                        *slot_offset = entry_abs_offset;
-                        found = 0; // slot found, but file not found
-                    }
-                    goto search_end; // stop searching if 0x00 is encountered
-                }
-                
-                // deleted entry - treat as potential slot for new file
-                if (entry->DIR_Name[0] == 0xE5 && slot_offset != NULL && *slot_offset == -1) {
-                    *slot_offset = entry_abs_offset; // Found a deleted entry slot
-                }
-                
-                // LFN = skip
-                if ((entry->DIR_Attr & ATTR_LFN) == ATTR_LFN) continue;
-                if (entry->DIR_Attr & ATTR_VOLUME_ID) continue;
-
-                char entry_name[13];
-                get_formatted_name(entry->DIR_Name, entry_name);
-
-                //check for same nae
-                if (strcmp(entry_name, name) == 0) {
-                    found = 1;
-                    if (search_dir_entry != NULL) {
-                        memcpy(search_dir_entry, entry, sizeof(DIR_ENTRY));
-                    }
-                    goto search_end;
-                }
-            }
-        }
-        
-        //move to next cluster in chain
-        current_cluster = read_fat_entry(current_cluster);
-    }
-    
-search_end:
-    free(buffer);
-    return found;
+//drops any remembered lookup of an entry that was just created or changed in dir_cluster
+static void forget_lookup(unsigned int dir_cluster, DIR_ENTRY *entry)
+{
+    char name[13];
+    get_formatted_name(entry->DIR_Name, name);
+    dentry_invalidate(dir_cluster, name);
 }
 
 // PART ONE COMMANDS -----------------------------------------
 
 // info command
-void info_command() {
+int info_command() {
     unsigned int bytes_per_sector = g_fs_state.fs_bpb.BPB_BytsPerSec;
     unsigned int sectors_per_cluster = g_fs_state.fs_bpb.BPB_SecPerClus;
     unsigned int root_cluster = g_fs_state.fs_bpb.BPB_RootClus;
@@ -161,238 +111,171 @@ void info_command() {
     printf("Size of Image (bytes): %ld\n", size_of_image);
     printf("Root Cluster: %u\n", root_cluster);
 
+    if (g_fs_state.free_map != NULL) {
+        printf("Free Clusters: %u (next free hint %u)\n", g_fs_state.free_count, g_fs_state.next_free);
+    }
+
+    // which FAT copies get written
+    if (g_fs_state.fat_mirror_deferred) {
+        unsigned int mirrors = g_fs_state.fs_bpb.BPB_NumFATs - 1;
+        printf("FAT Mirroring: deferred, writing FAT %u only, %u mirror%s resynced at exit\n",
+               active_fat(), mirrors, mirrors == 1 ? "" : "s");
+    } else if (fat_mirrored()) {
+        printf("FAT Mirroring: on, %u copies\n", g_fs_state.fs_bpb.BPB_NumFATs);
+    } else {
+        printf("FAT Mirroring: off, active FAT %u\n", active_fat());
+    }
 
+    // memory used by the resident FAT
+    unsigned long fat_kib = ((unsigned long)g_fs_state.fs_bpb.BPB_FATSz32 * bytes_per_sector) / 1024;
+    if (g_fs_state.fat_table != NULL) {
+        unsigned long dirty_kib = (g_fs_state.fs_bpb.BPB_FATSz32 + 1023) / 1024;
+        printf("FAT Cache: resident, %lu KiB (+%lu KiB dirty map)\n", fat_kib, dirty_kib);
+    } else {
+        printf("FAT Cache: disabled, FAT is %lu KiB (limit %u KiB), reading from disk\n",
+               fat_kib, FAT_RESIDENT_MAX_BYTES / 1024);
+    }
+    return 0;
 }
 
-// exit command
-void exit_shell() {
-    if (g_fs_state.image_fp != NULL) {
-        if (fclose(g_fs_state.image_fp) == EOF) {
+// exit command, status is the process exit status
+void exit_shell(int status) {
+    readahead_shutdown();
+    trace_set_command(NULL);
+    if (journal_checkpoint() != 0 && status == 0) status = 1;
+    dentry_clear();
+    dir_index_clear();
+    bcache_destroy();
+    if (flush_fat_table() != 0 && status == 0) status = 1;
+    resync_fat_mirrors();
+    write_fsinfo();
+    trace_finish();
+    journal_close();
+    free_fat_table();
+    free_free_map();
+    image_munmap();
+    if (g_fs_state.image_fd >= 0) {
+        if (close(g_fs_state.image_fd) != 0) {
             perror("Error closing file image");
         }
-        g_fs_state.image_fp = NULL;
+        g_fs_state.image_fd = -1;
     }
     printf("Safely closing program.\n");
-    exit(EXIT_SUCCESS); 
+    exit(status); 
 }
 
 // PART TWO COMMANDS -----------------------------------------
 
-//ls command
-void ls_command() {
-    unsigned int current_cluster = g_fs_state.current_cluster;
-    unsigned int sector_size = g_fs_state.fs_bpb.BPB_BytsPerSec;
-    unsigned int sectors_per_cluster = g_fs_state.fs_bpb.BPB_SecPerClus;
-    
-    // buffer to hold one sector
-    unsigned char *buffer = (unsigned char *)malloc(sector_size);
-    if (!buffer) {
-        printf("Error: Memory allocation failed for ls.\n");
-        return;
+//ls command, lists the current directory or the one path names
+int ls_command(char *path) {
+    DIR_ITER it;
+    DIR_ENTRY *entry;
+    unsigned int dir_cluster = g_fs_state.current_cluster;
+
+    if (path != NULL) {
+        int err = path_resolve_dir(path, &dir_cluster, NULL, 0);
+        if (err == PATH_NOT_DIR) {
+            printf("Error: '%s' is not a directory.\n", path);
+            return 1;
+        } else if (err != PATH_OK) {
+            printf("Error: Directory '%s' not found.\n", path);
+            return 1;
+        }
     }
 
-    // iterate through the cluster list
-    while (current_cluster < 0x0FFFFFF8) {
-        unsigned int start_sector = get_cluster_sector(current_cluster);
-        
-        // iterate through sectors in this cluster
-        for (unsigned int i = 0; i < sectors_per_cluster; i++) {
-            unsigned int sector_to_read = start_sector + i;
-            
-            // read sector
-            long offset = (long)sector_to_read * sector_size;
-            if (fseek(g_fs_state.image_fp, offset, SEEK_SET) != 0) {
-                printf("Error: Failed to seek to sector %u\n", sector_to_read);
-                free(buffer);
-                return;
-            }
-            if (fread(buffer, sector_size, 1, g_fs_state.image_fp) != 1) {
-                printf("Error: Failed to read sector %u\n", sector_to_read);
-                free(buffer);
-                return;
-            }
-            
-            //iterate through directory entries in this sector
-            for (unsigned int j = 0; j < sector_size; j += 32) {
-                DIR_ENTRY *entry = (DIR_ENTRY *)(buffer + j);
-                
-                // end of directory entries
-                if (entry->DIR_Name[0] == 0x00) {
-                    free(buffer);
-                    printf("\n");
-                    return; // Stop listing
-                }
-                
-                // delted entry = skip
-                if (entry->DIR_Name[0] == 0xE5) continue;
-                
-                // long file or hidden =  kip
-                if ((entry->DIR_Attr & ATTR_LFN) == ATTR_LFN) continue;
-                if (entry->DIR_Attr & (ATTR_HIDDEN | ATTR_SYSTEM | ATTR_VOLUME_ID)) continue;
-
-                // Print Entry
-                char name[13]; 
-                get_formatted_name(entry->DIR_Name, name);
-                printf("%s  ", name);
-                
-            }
+    if (dir_iter_open(&it, dir_cluster) != 0) {
+        printf("Error: Failed to read the directory.\n");
+        return 1;
+    }
+
+    // deleted, long file name and volume entries are already skipped
+    while ((entry = dir_iter_next_live(&it)) != NULL) {
+        // hidden = skip
+        if (entry->DIR_Attr & (ATTR_HIDDEN | ATTR_SYSTEM)) continue;
+
+        // Print Entry, by its long name if it has one
+        if (it.long_name[0] != '\0') {
+            printf("%s  ", it.long_name);
+            continue;
         }
-        
-        // move to the next cluster
-        current_cluster = read_fat_entry(current_cluster);
+        char name[13]; 
+        get_formatted_name(entry->DIR_Name, name);
+        printf("%s  ", name);
     }
     
     printf("\n"); 
-    free(buffer);
+    int status = 0;
+    if (it.error) {
+        printf("Error: Failed to read the whole directory.\n");
+        status = 1;
+    }
+    dir_iter_close(&it);
+    return status;
 }
 
-// cd command
-void cd_command(char *dirname) {
+// cd command, takes a relative or absolute path
+int cd_command(char *dirname) {
     if (dirname == NULL) {
         printf("Error: Directory name not provided.\n");
-        return;
+        return 1;
     }
 
-    unsigned int sector_size = g_fs_state.fs_bpb.BPB_BytsPerSec;
-    unsigned int sectors_per_cluster = g_fs_state.fs_bpb.BPB_SecPerClus;
     unsigned int new_cluster = 0;
-    
-    unsigned char *buffer = (unsigned char *)malloc(sector_size);
-    if (!buffer) {
-        printf("Error: Memory allocation failed for cd.\n");
-        return;
-    }
-
-    //search for the directory entry in the current cluster chain
-    unsigned int search_cluster = g_fs_state.current_cluster;
-    int found = 0;
-
-    while (search_cluster < 0x0FFFFFF8) {
-        unsigned int start_sector = get_cluster_sector(search_cluster);
-        
-        for (unsigned int i = 0; i < sectors_per_cluster; i++) {
-            unsigned int sector_to_read = start_sector + i;
-            
-            long offset = (long)sector_to_read * sector_size;
-            if (fseek(g_fs_state.image_fp, offset, SEEK_SET) != 0 ||
-                fread(buffer, sector_size, 1, g_fs_state.image_fp) != 1) {
-                break; 
-            }
-            
-            for (unsigned int j = 0; j < sector_size; j += 32) {
-                DIR_ENTRY *entry = (DIR_ENTRY *)(buffer + j);
-                
-                if (entry->DIR_Name[0] == 0x00) goto search_end; 
-                if (entry->DIR_Name[0] == 0xE5) continue; 
-                if ((entry->DIR_Attr & ATTR_LFN) == ATTR_LFN) continue;
-                if (entry->DIR_Attr & ATTR_VOLUME_ID) continue; 
-
-                char entry_name[13];
-                get_formatted_name(entry->DIR_Name, entry_name);
-
-                if (strcmp(entry_name, dirname) == 0) {
-                    if (!(entry->DIR_Attr & ATTR_DIRECTORY)) {
-                        printf("Error: '%s' is not a directory.\n", dirname);
-                        free(buffer);
-                        return;
-                    }
-                    
-                    // combine high and low words of the cluster number
-                    new_cluster = entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
-                    found = 1;
-                    goto search_end;
-                }
-            }
-        }
-        
-        search_cluster = read_fat_entry(search_cluster);
-    }
-
-search_end:
-    free(buffer);
+    char new_path[sizeof(g_fs_state.current_path)];
 
-    if (!found) {
+    //walk the path, "." and ".." are folded into new_path first
+    int err = path_resolve_dir(dirname, &new_cluster, new_path, sizeof(new_path));
+    if (err == PATH_NOT_DIR) {
+        printf("Error: '%s' is not a directory.\n", dirname);
+        return 1;
+    } else if (err == PATH_INVALID) {
+        printf("Error: Path '%s' is too long.\n", dirname);
+        return 1;
+    } else if (err != PATH_OK) {
         printf("Error: Directory '%s' not found.\n", dirname);
-        return;
-    }
-
-    //update global state
-
-    // temp buffer to build the new path string safely
-    char new_path[sizeof(g_fs_state.current_path)];
-    
-    // going to parent directory ("..")
-    if (strcmp(dirname, "..") == 0) {
-        // if the current cluster is the root cluster, attempting to go back should stay at root
-        if (g_fs_state.current_cluster == g_fs_state.fs_bpb.BPB_RootClus) {
-            strcpy(new_path, "/");
-            new_cluster = g_fs_state.current_cluster; // Cluster remains root
-        } 
-        else 
-        {
-            //check if path ends with a slash 
-            size_t len = strlen(g_fs_state.current_path);
-            if (len > 1 && g_fs_state.current_path[len - 1] == '/') {
-                g_fs_state.current_path[len - 1] = '\0'; 
-            }
-            
-            //find the last remaining slash (marks the start of the current directory name)
-            char *last_slash = strrchr(g_fs_state.current_path, '/');
-            
-            if (last_slash != NULL) {
-                // null-terminate immediately after the slash to chop off the current directory name
-                last_slash[1] = '\0'; 
-                strcpy(new_path, g_fs_state.current_path);
-            } else {
-                strcpy(new_path, "/");
-            }
-        }
-    } 
-    // going to current directory no change
-    else if (strcmp(dirname, ".") == 0) {
-        return;
-    }
-    // reg subdirectory move
-    else {
-        if (strcmp(g_fs_state.current_path, "/") == 0) {
-            snprintf(new_path, sizeof(new_path), "/%s/", dirname);
-        } else {
-            // append to existing path
-            snprintf(new_path, sizeof(new_path), "%s%s", g_fs_state.current_path, dirname);
-        }
+        return 1;
     }
 
     //update of the global state variables
     strcpy(g_fs_state.current_path, new_path);
     g_fs_state.current_cluster = new_cluster;
+    return 0;
 }
 
 // PART THREE COMMANDS -----------------------------------------
 
-void mkdir_command(char *dirname) {
+int mkdir_command(char *dirname) {
     if (dirname == NULL) {
         printf("Error: Directory name not provided.\n");
-        return;
+        return 1;
+    }
+
+    // Find the directory it goes in
+    unsigned int parent_cluster;
+    char leaf[256];
+    if (path_resolve_parent(dirname, &parent_cluster, NULL, 0, leaf, sizeof(leaf)) != PATH_OK) {
+        printf("Error: Invalid path '%s'.\n", dirname);
+        return 1;
     }
 
     long free_slot_offset = -1;
     // Check if directory already exists or find a free slot
-    if (search_current_directory(dirname, NULL, &free_slot_offset)) {
+    if (search_directory(parent_cluster, leaf, NULL, &free_slot_offset)) {
         printf("Error: Directory '%s' already exists.\n", dirname);
-        return;
+        return 1;
     }
 
     // Check if found a free slot
     if (free_slot_offset == -1) {
         printf("Error: No free directory entry available to create '%s'.\n", dirname);
-        return;
+        return 1;
     }
 
     // Find a free cluster for the new directory
     unsigned int new_cluster = get_free_cluster();
     if (new_cluster == 0 || new_cluster >= 0x0FFFFFF8) {
         printf("Error: No free clusters available to create directory.\n");
-        return;
+        return 1;
     }
 
     // Mark the cluster as EOF in FAT
@@ -408,8 +291,8 @@ void mkdir_command(char *dirname) {
     name_buf[11] = '\0';
 
     // Copy name into buffer (uppercase)
-    for (int i = 0; i < 11 && dirname[i] != '\0'; i++) {
-        name_buf[i] = toupper((unsigned char)dirname[i]);
+    for (int i = 0; i < 11 && leaf[i] != '\0'; i++) {
+        name_buf[i] = toupper((unsigned char)leaf[i]);
     }
     memcpy(new_entry.DIR_Name, name_buf, 11);
 
@@ -422,21 +305,19 @@ void mkdir_command(char *dirname) {
     new_entry.DIR_WrtTime = 0;
 
     // Write the entry to the parent directory
-    if (fseek(g_fs_state.image_fp, free_slot_offset, SEEK_SET) != 0) {
-        printf("Error: Failed to seek to free directory slot.\n");
-        return;
-    }
-    if (fwrite(&new_entry, sizeof(DIR_ENTRY), 1, g_fs_state.image_fp) != 1) {
+    if (journal_write(free_slot_offset, &new_entry, sizeof(DIR_ENTRY)) != 0) {
         printf("Error: Failed to write directory entry to disk.\n");
-        return;
+        return 1;
     }
+    add_to_index(parent_cluster, &new_entry, free_slot_offset);
+    forget_lookup(parent_cluster, &new_entry);
 
     // Initialize the new directory with "." and ".." entries
     unsigned int cluster_size = g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus;
     unsigned char *cluster_buffer = (unsigned char *)malloc(cluster_size);
     if (!cluster_buffer) {
         printf("Error: Memory allocation failed for new directory cluster.\n");
-        return;
+        return 1;
     }
     memset(cluster_buffer, 0, cluster_size);
 
@@ -457,7 +338,6 @@ void mkdir_command(char *dirname) {
     dotdot_entry->DIR_Attr = ATTR_DIRECTORY;
     
     // Parent cluster handling - if we're in root, ".." should point to root
-    unsigned int parent_cluster = g_fs_state.current_cluster;
     if (parent_cluster == g_fs_state.fs_bpb.BPB_RootClus) {
         // For root directory, ".." typically points to cluster 0
         dotdot_entry->DIR_FstClusHI = 0;
@@ -472,40 +352,45 @@ void mkdir_command(char *dirname) {
     unsigned int cluster_start_sector = get_cluster_sector(new_cluster);
     long cluster_offset = (long)cluster_start_sector * g_fs_state.fs_bpb.BPB_BytsPerSec;
     
-    if (fseek(g_fs_state.image_fp, cluster_offset, SEEK_SET) != 0) {
-        printf("Error: Failed to seek to new directory cluster.\n");
-        free(cluster_buffer);
-        return;
-    }
-    if (fwrite(cluster_buffer, cluster_size, 1, g_fs_state.image_fp) != 1) {
+    if (journal_write(cluster_offset, cluster_buffer, cluster_size) != 0) {
         printf("Error: Failed to write new directory cluster to disk.\n");
         free(cluster_buffer);
-        return;
+        return 1;
     }
 
     free(cluster_buffer);
+    image_sync();
     //printf("Directory '%s' created successfully.\n", dirname);
+    return 0;
 }
 
 
 
-void creat_command(char *filename){
+int creat_command(char *filename){
     if (filename == NULL){
         printf("Error: Filename not provided.\n");
-        return;
+        return 1;
+    }
+
+    // find the directory it goes in
+    unsigned int parent_cluster;
+    char leaf[256];
+    if (path_resolve_parent(filename, &parent_cluster, NULL, 0, leaf, sizeof(leaf)) != PATH_OK) {
+        printf("Error: Invalid path '%s'.\n", filename);
+        return 1;
     }
 
     long free_slot_offset = -1;
     // check if file exists or find a free slot
-    if (search_current_directory(filename, NULL, &free_slot_offset)) {
+    if (search_directory(parent_cluster, leaf, NULL, &free_slot_offset)) {
         printf("Error: File '%s' already exists.\n", filename);
-        return;
+        return 1;
     }
 
     // check if found a free slot
     if (free_slot_offset == -1) {
         printf("Error: No free directory entry available to create '%s'.\n", filename);
-        return;
+        return 1;
     }
 
     //make new directory entry
@@ -518,8 +403,8 @@ void creat_command(char *filename){
     name_buf[11] = '\0';
 
     //copy into buffer
-    for (int i = 0; i < 11 && filename[i] != '\0'; i++) {
-        name_buf[i] = toupper((unsigned char)filename[i]);
+    for (int i = 0; i < 11 && leaf[i] != '\0'; i++) {
+        name_buf[i] = toupper((unsigned char)leaf[i]);
     }
     memcpy(new_entry.DIR_Name, name_buf, 11);
 
@@ -532,24 +417,24 @@ void creat_command(char *filename){
     new_entry.DIR_WrtTime = 0;
     
     // write the entry to the disk
-    if (fseek(g_fs_state.image_fp, free_slot_offset, SEEK_SET) != 0) {
-        printf("Error: Failed to seek to free directory slot.\n");
-        return;
-    }
-    if (fwrite(&new_entry, sizeof(DIR_ENTRY), 1, g_fs_state.image_fp) != 1) {
+    if (journal_write(free_slot_offset, &new_entry, sizeof(DIR_ENTRY)) != 0) {
         printf("Error: Failed to write directory entry to disk.\n");
-        return;
+        return 1;
     }
+    add_to_index(parent_cluster, &new_entry, free_slot_offset);
+    forget_lookup(parent_cluster, &new_entry);
+    image_sync();
+    return 0;
 }
 
 // PART FOUR COMMANDS -----------------------------------------
 
 // open command
-void open_command(char *filename, char *flags) {
+int open_command(char *filename, char *flags) {
     //validate input
     if (filename == NULL || flags == NULL) {
         printf("Error: Missing filename or flags.\n");
-        return;
+        return 1;
     }
     
     // find flags
@@ -564,72 +449,24 @@ void open_command(char *filename, char *flags) {
         mode = MODE_READ_WRITE;
     } else {
         printf("Error: Invalid flag used. Must be -r, -w, -rw, or -wr.\n");
-        return;
+        return 1;
     }
 
-    // search for the file in the current directory
-    unsigned int sector_size = g_fs_state.fs_bpb.BPB_BytsPerSec;
-    unsigned int sectors_per_cluster = g_fs_state.fs_bpb.BPB_SecPerClus;
-    
-    unsigned char *buffer = (unsigned char *)malloc(sector_size);
-    if (!buffer) {
-        printf("Error: Memory allocation failed for open.\n");
-        return;
-    }
-
-    // variables to hold found file info
+    // walk to the directory holding the file, then look the file up there
+    unsigned int dir_cluster;
+    char dir_path[sizeof(g_fs_state.current_path)];
+    char leaf[DIR_NAME_MAX];
     DIR_ENTRY found_entry;
-    int file_found = 0;
-    
-    unsigned int search_cluster = g_fs_state.current_cluster;
+    long found_entry_offset = -1;
 
-    // same for loop as ls and cd to find the file
-    while (search_cluster < 0x0FFFFFF8) {
-        unsigned int start_sector = get_cluster_sector(search_cluster);
-        
-        for (unsigned int i = 0; i < sectors_per_cluster; i++) {
-            unsigned int sector_to_read = start_sector + i;
-            
-            long offset = (long)sector_to_read * sector_size;
-            if (fseek(g_fs_state.image_fp, offset, SEEK_SET) != 0 ||
-                fread(buffer, sector_size, 1, g_fs_state.image_fp) != 1) {
-                goto search_end; 
-            }
-            
-            for (unsigned int j = 0; j < sector_size; j += 32) {
-                DIR_ENTRY *entry = (DIR_ENTRY *)(buffer + j);
-                
-                if (entry->DIR_Name[0] == 0x00) goto search_end; 
-                if (entry->DIR_Name[0] == 0xE5) continue; 
-                if ((entry->DIR_Attr & ATTR_LFN) == ATTR_LFN) continue;
-                if (entry->DIR_Attr & ATTR_VOLUME_ID) continue; 
-
-                char entry_name[13];
-                get_formatted_name(entry->DIR_Name, entry_name);
-
-                if (strcmp(entry_name, filename) == 0) {
-                    if (entry->DIR_Attr & ATTR_DIRECTORY) {
-                        printf("Error: Cannot open '%s' - it is a directory.\n", filename);
-                        free(buffer);
-                        return;
-                    }
-                    
-                    memcpy(&found_entry, entry, sizeof(DIR_ENTRY));
-                    file_found = 1;
-                    goto search_end;
-                }
-            }
-        }
-        
-        search_cluster = read_fat_entry(search_cluster);
-    }
-
-search_end:
-    free(buffer);
-
-    if (!file_found) {
+    if (path_resolve_parent(filename, &dir_cluster, dir_path, sizeof(dir_path), leaf, sizeof(leaf)) != PATH_OK ||
+        dentry_lookup(dir_cluster, leaf, &found_entry, &found_entry_offset) != 1) {
         printf("Error: File '%s' not found.\n", filename);
-        return;
+        return 1;
+    }
+    if (found_entry.DIR_Attr & ATTR_DIRECTORY) {
+        printf("Error: Cannot open '%s' - it is a directory.\n", filename);
+        return 1;
     }
     
     //check the open file table
@@ -639,10 +476,10 @@ search_end:
         OPEN_FILE *of = &g_fs_state.open_file_table[i];
         
         if (of->is_used) {
-            // check if file is already open
-            if (strcmp(of->name, filename) == 0 && strcmp(of->path, g_fs_state.current_path) == 0) {
+            // check if file is already open, under this name or its other one
+            if (of->dir_entry_offset == found_entry_offset) {
                 printf("Error: File '%s' is already open.\n", filename);
-                return;
+                return 1;
             }
         } else if (free_slot == -1) {
             free_slot = i;
@@ -651,7 +488,7 @@ search_end:
     
     if (free_slot == -1) {
         printf("Error: Maximum number of open files reached (%d).\n", MAX_OPEN_FILES);
-        return;
+        return 1;
     }
     
     //commit the file to the oft
@@ -666,16 +503,25 @@ search_end:
     new_file->offset = 0; // initialize offset at 0
     new_file->file_size = found_entry.DIR_FileSize;
     new_file->starting_cluster = starting_cluster;
+    new_file->dir_entry_offset = found_entry_offset;
+    new_file->dir_cluster = dir_cluster;
+
+    // map the first run of the chain now, the rest is mapped as reads reach it
+    new_file->extents = NULL;
+    reset_extent_map(new_file);
+    extend_extent_map(new_file, 0);
+    readahead_reset(new_file);
     
     // copy the name and path
-    strncpy(new_file->name, filename, sizeof(new_file->name) - 1);
-    strncpy(new_file->path, g_fs_state.current_path, sizeof(new_file->path) - 1);
+    strncpy(new_file->name, leaf, sizeof(new_file->name) - 1);
+    strncpy(new_file->path, dir_path, sizeof(new_file->path) - 1);
     
-    printf("opened %s\n", filename);
+    printf("opened %s\n", leaf);
+    return 0;
 }
 
 // lsof command - fix path display
-void lsof_command() {
+int lsof_command() {
     int count = 0;
     printf("INDEX  NAME          MODE    OFFSET     PATH\n");
    
@@ -696,104 +542,210 @@ void lsof_command() {
     }
     if (count == 0) {
         printf("No files currently open\n"); }
+    return 0;
 }
 
 
-// close command
-void close_command(char *filename) {
-    if (filename == NULL) {
-        printf("Error: Missing file name for 'close'.\n");
-        return;
+//finds the open file a read/write/lseek/close argument names. the path is resolved and matched
+//against the entry each slot was opened from, then the bare name as it was opened as a fallback
+static OPEN_FILE *find_open_file(const char *filename) {
+    unsigned int dir_cluster;
+    char leaf[DIR_NAME_MAX];
+    long entry_offset = -1;
+    if (path_resolve_parent(filename, &dir_cluster, NULL, 0, leaf, sizeof(leaf)) == PATH_OK &&
+        dentry_lookup(dir_cluster, leaf, NULL, &entry_offset) == 1) {
+        for (int i = 0; i < MAX_OPEN_FILES; i++) {
+            OPEN_FILE *of = &g_fs_state.open_file_table[i];
+            if (of->is_used && of->dir_entry_offset == entry_offset) return of;
+        }
     }
 
-    int found = 0;
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
         OPEN_FILE *of = &g_fs_state.open_file_table[i];
-        if (of->is_used && strcmp(of->name, filename) == 0) {
-            of->is_used = 0; // Mark the slot as free
-            printf("closed %s\n", filename);
-            found = 1;
-            break;
-        }
+        if (of->is_used && strcmp(of->name, filename) == 0) return of;
+    }
+    return NULL;
+}
+
+// close command
+int close_command(char *filename) {
+    if (filename == NULL) {
+        printf("Error: Missing file name for 'close'.\n");
+        return 1;
     }
 
-    if (!found) {
+    OPEN_FILE *of = find_open_file(filename);
+    if (of == NULL) {
         printf("Error: File '%s' is not currently open or does not exist.\n", filename);
+        return 1;
     }
+
+    of->is_used = 0; // Mark the slot as free
+    reset_extent_map(of);
+    // whatever writes to it changed in the FAT
+    if (flush_fat_table() != 0) {
+        printf("Error: '%s' closed, but its FAT changes could not be written back.\n", filename);
+        return 1;
+    }
+    printf("closed %s\n", filename);
+    return 0;
 }
 
 // lseek command
-void lseek_command(char *filename, char *offset_str) {
+int lseek_command(char *filename, char *offset_str) {
     if (filename == NULL || offset_str == NULL) {
         printf("Error: Missing filename or offset.\n");
-        return;
+        return 1;
     }
     
     //get offset
     long new_offset = atol(offset_str);
 
     //find file 
-    OPEN_FILE *of = NULL;
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (g_fs_state.open_file_table[i].is_used && strcmp(g_fs_state.open_file_table[i].name, filename) == 0) {
-            of = &g_fs_state.open_file_table[i];
-            break;
-        }
-    }
+    OPEN_FILE *of = find_open_file(filename);
     if (of == NULL) {
         printf("Error: File '%s' is not open.\n", filename);
-        return;
+        return 1;
     }
 
     //check bounds
     if (new_offset < 0 || new_offset > of->file_size) {
         printf("Error: Offset %ld is outside the file size boundaries (0 to %u).\n", new_offset, of->file_size);
-        return;
+        return 1;
+    }
+
+    //make sure the chain actually reaches the new offset
+    unsigned int cluster_size = g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus;
+    if (new_offset < of->file_size &&
+        lookup_file_cluster(of, (unsigned int)(new_offset / cluster_size), NULL) >= 0x0FFFFFF8) {
+        printf("Error: Cluster chain of '%s' ends before offset %ld.\n", filename, new_offset);
+        return 1;
     }
 
     //update offset
     of->offset = new_offset;
-    
+    return 0;
+}
+
+// hex dump output for read -x, lines of 16 bytes like hexdump -C
+typedef struct {
+    unsigned char line[16];
+    int fill;           // bytes waiting in line
+    long offset;        // file offset of line[0]
+} HEX_DUMP;
+
+static void hex_dump_line(HEX_DUMP *hex) {
+    char out[80];
+    int n = sprintf(out, "%08lx  ", hex->offset);
+    for (int i = 0; i < 16; i++) {
+        if (i < hex->fill) n += sprintf(out + n, "%02x ", hex->line[i]);
+        else n += sprintf(out + n, "   ");
+        if (i == 7) out[n++] = ' ';
+    }
+    out[n++] = ' ';
+    out[n++] = '|';
+    for (int i = 0; i < hex->fill; i++) {
+        out[n++] = isprint(hex->line[i]) ? (char)hex->line[i] : '.';
+    }
+    out[n++] = '|';
+    out[n++] = '\n';
+    fwrite(out, 1, (size_t)n, stdout);
+
+    hex->offset += hex->fill;
+    hex->fill = 0;
+}
+
+static void hex_dump_feed(HEX_DUMP *hex, const unsigned char *data, size_t len) {
+    while (len > 0) {
+        size_t take = 16 - (size_t)hex->fill;
+        if (take > len) take = len;
+        memcpy(hex->line + hex->fill, data, take);
+        hex->fill += (int)take;
+        data += take;
+        len -= take;
+        if (hex->fill == 16) hex_dump_line(hex);
+    }
 }
 
-// read command
-void read_command(char *filename, char *size_str) {
+// read output: raw bytes to stdout, or into the hex dump
+static void emit_bytes(HEX_DUMP *hex, const unsigned char *data, size_t len) {
+    if (hex) hex_dump_feed(hex, data, len);
+    else fwrite(data, 1, len, stdout);
+}
+
+// sends len bytes of the image at offset to stdout (or the hex dump) a bounded chunk at a time.
+// chunk is a buffer of chunk_size bytes, only touched when data has to be copied
+static int stream_span(long long offset, size_t len, HEX_DUMP *hex, unsigned char *chunk, size_t chunk_size) {
+    // mmap: straight out of the mapping
+    if (g_fs_state.image_map != NULL) {
+        const unsigned char *src = image_map_range(offset, len);
+        if (src == NULL) return 1;
+        emit_bytes(hex, src, len);
+        return 0;
+    }
+
+    // big contiguous span: let the kernel copy it from the image file to stdout
+    if (hex == NULL && len >= READ_SENDFILE_MIN) {
+        bcache_flush(); // the image file has to be current
+        fflush(stdout);
+        long long sent = image_sendfile(STDOUT_FILENO, offset, len);
+        if (sent < 0) return 1;
+        offset += sent;
+        len -= (size_t)sent;
+    }
+
+    // spans bigger than a chunk skip the cache so a huge read doesn't flush everything out of it
+    int through_cache = len <= chunk_size;
+    if (!through_cache) bcache_flush();
+
+    while (len > 0) {
+        size_t n = len < chunk_size ? len : chunk_size;
+        if ((through_cache ? bcache_read(offset, chunk, n) : image_read(offset, chunk, n)) != 0) {
+            return 1;
+        }
+        emit_bytes(hex, chunk, n);
+        offset += (long long)n;
+        len -= n;
+    }
+    return 0;
+}
+
+// read command, "-x" as the mode prints a hex dump instead of the raw bytes
+int read_command(char *filename, char *size_str, char *mode) {
     if (filename == NULL || size_str == NULL) {
         printf("Error: Missing filename or size.\n");
-        return;
+        return 1;
+    }
+    if (mode != NULL && strcmp(mode, "-x") != 0) {
+        printf("Error: Unknown read mode '%s' (only -x).\n", mode);
+        return 1;
     }
 
     //get read size
     long bytes_to_read = atol(size_str);
     if (bytes_to_read <= 0) {
         printf("Error: Read size must be positive.\n");
-        return;
+        return 1;
     }
 
     //find file
-    OPEN_FILE *of = NULL;
-    for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (g_fs_state.open_file_table[i].is_used && strcmp(g_fs_state.open_file_table[i].name, filename) == 0) {
-            of = &g_fs_state.open_file_table[i];
-            break;
-        }
-    }
+    OPEN_FILE *of = find_open_file(filename);
     if (of == NULL) {
         printf("Error: File '%s' is not open.\n", filename);
-        return;
+        return 1;
     }
 
     //make sure its open for reading
     if (of->mode == MODE_WRITE) {
         printf("Error: File '%s' is not open for reading (-r or -rw).\n", filename);
-        return;
+        return 1;
     }
 
     //find read length
     long remaining_bytes_in_file = (long)of->file_size - of->offset;
     if (remaining_bytes_in_file <= 0) {
         printf("End of file reached. Read 0 bytes.\n");
-        return;
+        return 0;
     }
     
     //adjust read size if it exceeds the file boundary
@@ -802,198 +754,1188 @@ void read_command(char *filename, char *size_str) {
         printf("Warning: Reading only %ld bytes until EOF.\n", bytes_to_read);
     }
     
-    //set up cluster/sector variables
     unsigned int cluster_size = g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus;
-    unsigned int current_cluster = of->starting_cluster;
-    
-    // find the cluster that = the starting offset
-    current_cluster = find_cluster_from_offset(of->starting_cluster, of->offset);
-    if (current_cluster >= 0x0FFFFFF8) {
-        printf("Error: error while locating starting cluster.\n");
-        return;
-    }
     
     // calc the byte offset in the starting cluster
     long offset_in_cluster = of->offset % cluster_size;
+    unsigned int file_cluster = (unsigned int)(of->offset / cluster_size);
     
     long bytes_read_total = 0;
+    int status = 0;
     
-    // allocate a buffer large enough for the entire read AND a NULL terminator for printing
-    char *read_buffer = (char *)malloc(bytes_to_read + 1);
-    if (!read_buffer) {
-        printf("Error: Memory allocation failed for read buffer.\n");
-        return;
+    // memory stays bounded: one chunk of whole clusters, whatever the read size
+    size_t chunk_size = (READ_CHUNK_BYTES / cluster_size) * cluster_size;
+    if (chunk_size == 0) chunk_size = cluster_size;
+    unsigned char *chunk = NULL;
+    if (g_fs_state.image_map == NULL) {
+        chunk = (unsigned char *)malloc(chunk_size);
+        if (!chunk) {
+            printf("Error: Memory allocation failed for read buffer.\n");
+            return 1;
+        }
     }
-    read_buffer[bytes_to_read] = '\0'; // Null-terminate 
 
-    while (bytes_read_total < bytes_to_read && current_cluster < 0x0FFFFFF8) {
-        // calc the physical starting sector and offset for the read
-        unsigned int cluster_start_sector = get_cluster_sector(current_cluster);
+    HEX_DUMP hex_state = { {0}, 0, of->offset };
+    HEX_DUMP *hex = mode != NULL ? &hex_state : NULL;
+
+    // sequential reads get the clusters after this one queued for the read-ahead thread
+    // the pool reads the image file, so it's only current when the cache has nothing dirty
+    BCACHE_STATS cache_stats;
+    bcache_get_stats(&cache_stats);
+    int use_pool = readahead_begin(of, bytes_to_read) && chunk != NULL && cache_stats.dirty == 0;
+    int missed = 0;
+
+    while (bytes_read_total < bytes_to_read) {
+        // find the physical cluster through the extent map
+        unsigned int run_left = 0;
+        unsigned int current_cluster = lookup_file_cluster(of, file_cluster, &run_left);
+        if (current_cluster >= 0x0FFFFFF8) {
+            if (bytes_read_total == 0) {
+                printf("Error: error while locating starting cluster.\n");
+                free(chunk);
+                return 1;
+            }
+            break; // chain ended early
+        }
         
-        // calcu space remaining in the current cluster
-        long space_in_cluster = cluster_size - offset_in_cluster;
+        // the rest of this extent is one contiguous span on disk
+        long space_in_extent = (long)run_left * cluster_size - offset_in_cluster;
         
-        //find the actual chunk size to read (min of bytes_to_read and cluster space)
-        long chunk_size = bytes_to_read - bytes_read_total;
-        if (chunk_size > space_in_cluster) {
-            chunk_size = space_in_cluster;
+        //find the actual span to read (min of bytes left and extent space)
+        long span = bytes_to_read - bytes_read_total;
+        if (span > space_in_extent) {
+            span = space_in_extent;
         }
 
-        // calc final physical file offset for fseek
-        long file_offset = (long)cluster_start_sector * g_fs_state.fs_bpb.BPB_BytsPerSec + offset_in_cluster;
+        // calc final physical file offset
+        long file_offset = (long)get_cluster_sector(current_cluster) * g_fs_state.fs_bpb.BPB_BytsPerSec + offset_in_cluster;
         
-        //then seek and read
-        if (fseek(g_fs_state.image_fp, file_offset, SEEK_SET) != 0) {
-            printf("Error: Failed to seek to data cluster %u.\n", current_cluster);
-            free(read_buffer);
-            return;
+        // small spans try the prefetched clusters first
+        int from_pool = 0;
+        if (use_pool && (size_t)span <= chunk_size) {
+            from_pool = readahead_copy(file_offset, chunk, (size_t)span) == 0;
+            if (from_pool) emit_bytes(hex, chunk, (size_t)span);
+            else missed = 1;
         }
-
-        long actual_read = fread(read_buffer + bytes_read_total, 1, chunk_size, g_fs_state.image_fp);
-        
-        if (actual_read <= 0) {
-            //reached end of cluster chain or read error
-            current_cluster = 0x0FFFFFFF; 
+        if (!from_pool && stream_span(file_offset, (size_t)span, hex, chunk, chunk_size) != 0) {
+            printf("\nError: Failed to read data cluster %u.\n", current_cluster);
+            status = 1;
             break;
         }
 
-        bytes_read_total += actual_read;
+        bytes_read_total += span;
         
-        // if we haven't read enough, move to the next cluster
-        if (bytes_read_total < bytes_to_read) {
-            current_cluster = read_fat_entry(current_cluster);
-            offset_in_cluster = 0;
-        }
+        // move on past the extent we just read
+        long consumed = offset_in_cluster + span;
+        file_cluster += (unsigned int)(consumed / cluster_size);
+        offset_in_cluster = consumed % cluster_size;
     }
 
-    //print and update
-    read_buffer[bytes_read_total] = '\0';
-    printf("%s\n", read_buffer);
- 
+    // finish the output: last partial hex line, or the newline after the data
+    if (hex) {
+        if (hex->fill > 0) hex_dump_line(hex);
+    } else {
+        printf("\n");
+    }
 
     of->offset += bytes_read_total;
+    readahead_end(of, missed);
 
-    free(read_buffer);
+    free(chunk);
+    return status;
 }
 
 // PART FIVE COMMANDS -----------------------------------------
+
+// write command
+int write_command(char *filename, char *data) {
+    if (filename == NULL || data == NULL) {
+        printf("Error: Missing filename or string.\n");
+        return 1;
+    }
+
+    //find file
+    OPEN_FILE *of = find_open_file(filename);
+    if (of == NULL) {
+        printf("Error: File '%s' is not open.\n", filename);
+        return 1;
+    }
+
+    //make sure its open for writing
+    if (of->mode == MODE_READ) {
+        printf("Error: File '%s' is not open for writing (-w, -rw or -wr).\n", filename);
+        return 1;
+    }
+
+    long bytes_to_write = (long)strlen(data);
+    if (bytes_to_write == 0) {
+        return 0;
+    }
+
+    long new_end = of->offset + bytes_to_write;
+    if (new_end > 0xFFFFFFFFL) {
+        printf("Error: Write would grow '%s' past the 4 GB FAT32 limit.\n", filename);
+        return 1;
+    }
+
+    unsigned int cluster_size = g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus;
+
+    //map the whole chain to count the clusters the file already has. no file reaches cluster
+    //0xFFFFFFFF, so it returns 0 either way: map_complete is what says the walk got to the end
+    if (!extend_extent_map(of, 0xFFFFFFFF) && !of->map_complete) {
+        //growing from the middle of the chain would cut off the rest of the file
+        printf("Error: Could not map the cluster chain of '%s'.\n", filename);
+        return 1;
+    }
+    unsigned int clusters_have = of->mapped_clusters;
+    unsigned int last_cluster = 0;
+    if (of->extent_count > 0) {
+        FILE_EXTENT *last = &of->extents[of->extent_count - 1];
+        last_cluster = last->start + last->length - 1;
+    }
+
+    //grow the chain in one go so the new clusters come out contiguous
+    unsigned int clusters_needed = (unsigned int)((new_end + cluster_size - 1) / cluster_size);
+    if (clusters_needed > clusters_have) {
+        unsigned int first_new = allocate_cluster_chain(clusters_needed - clusters_have, last_cluster, NULL);
+        if (first_new >= 0x0FFFFFF8) {
+            printf("Error: Not enough free clusters to write to '%s'.\n", filename);
+            return 1;
+        }
+        if (of->starting_cluster < 2) {
+            of->starting_cluster = first_new;
+        }
+        of->map_complete = 0; // new clusters get mapped on the next lookup
+    }
+
+    //write the data, one I/O per extent
+    unsigned int file_cluster = (unsigned int)(of->offset / cluster_size);
+    long offset_in_cluster = of->offset % cluster_size;
+    long bytes_written = 0;
+    int status = 0;
+
+    while (bytes_written < bytes_to_write) {
+        unsigned int run_left = 0;
+        unsigned int current_cluster = lookup_file_cluster(of, file_cluster, &run_left);
+        if (current_cluster >= 0x0FFFFFF8) {
+            printf("Error: Cluster chain of '%s' ended early.\n", filename);
+            status = 1;
+            break;
+        }
+
+        long span_bytes = (long)run_left * cluster_size - offset_in_cluster;
+        if (span_bytes > bytes_to_write - bytes_written) {
+            span_bytes = bytes_to_write - bytes_written;
+        }
+
+        long file_offset = (long)get_cluster_sector(current_cluster) * g_fs_state.fs_bpb.BPB_BytsPerSec + offset_in_cluster;
+        if (bcache_write(file_offset, data + bytes_written, span_bytes) != 0) {
+            printf("Error: Failed to write data cluster %u.\n", current_cluster);
+            status = 1;
+            break;
+        }
+
+        bytes_written += span_bytes;
+        long consumed = offset_in_cluster + span_bytes;
+        file_cluster += (unsigned int)(consumed / cluster_size);
+        offset_in_cluster = consumed % cluster_size;
+    }
+
+    //update offset and size, then the directory entry
+    of->offset += bytes_written;
+    if (of->offset > of->file_size) {
+        of->file_size = (unsigned int)of->offset;
+    }
+
+    DIR_ENTRY entry;
+    if (of->dir_entry_offset >= 0 &&
+        bcache_read(of->dir_entry_offset, &entry, sizeof(DIR_ENTRY)) == 0) {
+        entry.DIR_FileSize = of->file_size;
+        entry.DIR_FstClusHI = (of->starting_cluster >> 16) & 0xFFFF;
+        entry.DIR_FstClusLO = of->starting_cluster & 0xFFFF;
+        if (journal_write(of->dir_entry_offset, &entry, sizeof(DIR_ENTRY)) != 0) {
+            printf("Error: Failed to update directory entry for '%s'.\n", filename);
+            status = 1;
+        } else {
+            dir_index_update(of->dir_cluster, &entry, of->dir_entry_offset);
+            forget_lookup(of->dir_cluster, &entry);
+        }
+    } else {
+        printf("Error: Failed to read directory entry for '%s'.\n", filename);
+        status = 1;
+    }
+
+    image_sync();
+    return status;
+}
+
 // PART SIX COMMANDS -----------------------------------------
 
+// EXTRA COMMANDS -----------------------------------------
+
+// cache command: prints the block cache counters, "cache <KiB>" sets the budget, "cache reset" zeroes counters
+int cache_command(char *arg) {
+    if (arg != NULL) {
+        if (strcmp(arg, "reset") == 0) {
+            bcache_reset_stats();
+            return 0;
+        }
+        long kib = atol(arg);
+        if (kib <= 0) {
+            printf("Error: Cache size must be a positive number of KiB.\n");
+            return 1;
+        }
+        bcache_set_budget((size_t)kib * 1024);
+    }
+
+    BCACHE_STATS stats;
+    bcache_get_stats(&stats);
+    unsigned long lookups = stats.hits + stats.misses;
+    printf("Blocks: %u / %u (%zu bytes each, %zu KiB budget)\n", stats.blocks, stats.max_blocks,
+           stats.block_size, (stats.max_blocks * stats.block_size) / 1024);
+    printf("Hits: %lu  Misses: %lu  Hit rate: %.1f%%\n", stats.hits, stats.misses,
+           lookups ? 100.0 * stats.hits / lookups : 0.0);
+    printf("Evictions: %lu  Write-backs: %lu  Bypassed: %lu\n", stats.evictions, stats.writebacks, stats.bypassed);
+    printf("Dirty: %u  Pinned: %u\n", stats.dirty, stats.pinned);
+    return 0;
+}
+
+// dirindex command: prints directory index counters, "dirindex <N>" caps the number of indexed directories
+int dirindex_command(char *arg) {
+    if (arg != NULL) {
+        long max_dirs = atol(arg);
+        if (max_dirs <= 0) {
+            printf("Error: Directory limit must be a positive number.\n");
+            return 1;
+        }
+        dir_index_set_max((unsigned int)max_dirs);
+    }
+
+    DIR_INDEX_STATS stats;
+    dir_index_get_stats(&stats);
+    printf("Indexed directories: %u / %u\n", stats.cached, stats.max_dirs);
+    printf("Lookups: %lu  Directory scans: %lu  Evictions: %lu\n", stats.lookups, stats.builds, stats.evictions);
+    return 0;
+}
+
+// dcache command: prints path lookup cache counters, "dcache <N>" caps the number of entries
+int dcache_command(char *arg) {
+    if (arg != NULL) {
+        long max_entries = atol(arg);
+        if (max_entries <= 0) {
+            printf("Error: Entry limit must be a positive number.\n");
+            return 1;
+        }
+        dentry_set_max((unsigned int)max_entries);
+    }
+
+    DENTRY_STATS stats;
+    dentry_get_stats(&stats);
+    printf("Cached lookups: %u / %u\n", stats.cached, stats.max_entries);
+    printf("Hits: %lu  Misses: %lu  Evictions: %lu  Invalidations: %lu\n",
+           stats.hits, stats.misses, stats.evictions, stats.invalidations);
+    return 0;
+}
+
+// iostat command: prints block layer syscall counters, "iostat reset" zeroes them
+int iostat_command(char *arg) {
+    if (arg != NULL && strcmp(arg, "reset") == 0) {
+        memset(&g_fs_state.io_stats, 0, sizeof(g_fs_state.io_stats));
+        return 0;
+    }
+
+    IO_STATS *st = &g_fs_state.io_stats;
+    printf("Backend: %s\n", g_fs_state.image_map != NULL ? "mmap" : "pread/pwrite");
+    printf("Read syscalls: %lu (%llu bytes)\n", st->read_calls, st->bytes_read);
+    printf("Write syscalls: %lu (%llu bytes)\n", st->write_calls, st->bytes_written);
+    printf("Segments merged into another syscall: %lu\n", st->segments_merged);
+
+    // every FAT entry change used to be its own write to each FAT copy
+    unsigned long long naive = (unsigned long long)st->fat_updates * g_fs_state.fs_bpb.BPB_NumFATs;
+    long long saved = (long long)naive - (long long)st->fat_write_calls;
+    printf("FAT: %lu entry updates, %lu write syscalls, %lld saved (%.1f per command over %lu commands)\n",
+           st->fat_updates, st->fat_write_calls, saved,
+           st->commands ? (double)saved / st->commands : 0.0, st->commands);
+
+    // whole process, so it also counts reading commands and printing output
+    FILE *proc_io = fopen("/proc/self/io", "r");
+    if (proc_io != NULL) {
+        char line[128];
+        while (fgets(line, sizeof(line), proc_io) != NULL) {
+            if (strncmp(line, "syscr:", 6) == 0 || strncmp(line, "syscw:", 6) == 0) {
+                printf("Process %s", line);
+            }
+        }
+        fclose(proc_io);
+    }
+    return 0;
+}
+
+// sync command: commits the journal, writes back dirty sectors, the FAT and FSInfo, and syncs the image to disk
+int sync_command() {
+    int status = 0;
+    if (journal_checkpoint() != 0) status = 1;
+    write_fsinfo();
+    image_sync();
+    if (g_fs_state.image_map == NULL && g_fs_state.image_fd >= 0 && fsync(g_fs_state.image_fd) != 0) {
+        printf("Error: Failed to sync the image: %s.\n", strerror(errno));
+        status = 1;
+    }
+    return status;
+}
+
+// readahead command: prints read-ahead counters and the open files' windows,
+// "readahead on|off" switches it, "readahead reset" zeroes the counters
+int readahead_command(char *arg) {
+    if (arg != NULL) {
+        if (strcmp(arg, "on") == 0) readahead_set_enabled(1);
+        else if (strcmp(arg, "off") == 0) readahead_set_enabled(0);
+        else if (strcmp(arg, "reset") == 0) readahead_reset_stats();
+        else {
+            printf("Error: Unknown readahead option '%s' (on, off or reset).\n", arg);
+            return 1;
+        }
+        return 0;
+    }
+
+    READAHEAD_STATS stats;
+    readahead_get_stats(&stats);
+    unsigned int cluster_size = g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus;
+    if (stats.threaded) {
+        printf("Read-ahead: %s, background thread, pool %u clusters (%u KiB)\n", stats.enabled ? "on" : "off",
+               stats.slots, (unsigned int)(((unsigned long long)stats.slots * cluster_size) / 1024));
+        printf("Prefetch reads: %lu (%llu clusters)\n", stats.prefetch_reads, stats.prefetched);
+        printf("Hits: %lu  Misses: %lu  Waits: %lu  Wasted: %lu\n", stats.hits, stats.misses, stats.waits, stats.wasted);
+    } else {
+        printf("Read-ahead: %s, madvise hints (mmap backend)\n", stats.enabled ? "on" : "off");
+    }
+
+    for (int i = 0; i < MAX_OPEN_FILES; i++) {
+        OPEN_FILE *of = &g_fs_state.open_file_table[i];
+        if (of->is_used) {
+            printf("%-12s  window %u clusters%s\n", of->name, of->ra.window, of->ra.window ? "" : " (not sequential)");
+        }
+    }
+    return 0;
+}
+
+// journal command: prints journal counters, "journal commit" commits the waiting group,
+// "journal checkpoint" also writes everything in place and empties the journal
+int journal_command(char *arg) {
+    if (arg != NULL) {
+        if (strcmp(arg, "commit") == 0) return journal_commit();
+        if (strcmp(arg, "checkpoint") == 0) return journal_checkpoint();
+        printf("Error: Unknown journal option '%s' (commit or checkpoint).\n", arg);
+        return 1;
+    }
+
+    JOURNAL_STATS stats;
+    journal_get_stats(&stats);
+    if (!stats.active) {
+        printf("Journal: off (%s), metadata is written in place after every command\n",
+               g_fs_state.image_map != NULL ? "mmap backend" : "no sidecar file");
+        return 0;
+    }
+    printf("Journal: %s%s, %lld bytes, group of %d commands or %u KiB\n", g_fs_state.image_name, JOURNAL_SUFFIX,
+           stats.size, JOURNAL_GROUP_OPS, JOURNAL_GROUP_BYTES / 1024);
+    printf("Transactions: %lu  Records: %lu  Bytes: %llu  Fsyncs: %lu\n",
+           stats.transactions, stats.records, stats.bytes, stats.fsyncs);
+    printf("Checkpoints: %lu  Replayed at mount: %lu\n", stats.checkpoints, stats.replayed);
+    printf("Waiting: %u commands, %u records, %zu bytes\n", stats.pending_ops, stats.pending_records, stats.pending_bytes);
+    return 0;
+}
+
+// check command: verifies the image on disk (BPB, FAT copies, cross links, lost chains, file sizes),
+// "check <threads>" sets the number of worker threads. fails if anything is wrong
+int check_command(char *arg) {
+    int threads = 0;
+    if (arg != NULL) {
+        threads = atoi(arg);
+        if (threads <= 0) {
+            printf("Error: Thread count must be a positive number.\n");
+            return 1;
+        }
+    }
+
+    // the check reads the image file, so everything cached goes out first
+    if (bcache_flush() != 0 || flush_fat_table() != 0) {
+        printf("Error: Could not write back cached changes before the check.\n");
+        return 1;
+    }
+
+    FSCK_REPORT *report = (FSCK_REPORT *)malloc(sizeof(FSCK_REPORT));
+    if (!report) {
+        printf("Error: Memory allocation failed for the check.\n");
+        return 1;
+    }
+    long problems = fsck_run(threads, report);
+    if (problems < 0) {
+        printf("Error: The check could not finish.\n");
+        free(report);
+        return 1;
+    }
+    fsck_print(report);
+    free(report);
+    return problems > 0;
+}
+
+// find command (find_command is the command table lookup): prints every path under the root whose name matches a glob (case-insensitive)
+int find_files_command(char *pattern) {
+    // the walk reads the image file, so everything cached goes out first
+    if (bcache_flush() != 0 || flush_fat_table() != 0) {
+        printf("Error: Could not write back cached changes before the walk.\n");
+        return 1;
+    }
+
+    WALK_OPTIONS opts = { pattern, 0, 0 };
+    WALK_RESULT result;
+    if (tree_walk(g_fs_state.fs_bpb.BPB_RootClus, "/", &opts, &result) != 0) {
+        printf("Error: Failed to walk the directory tree.\n");
+        return 1;
+    }
+    for (unsigned int i = 0; i < result.match_count; i++) {
+        printf("%s\n", result.matches[i]);
+    }
+    printf("%u match(es) in %u directories, %llu entries (%.3f s, %d threads, %lu steals)\n",
+           result.match_count, result.dir_count, result.entries, result.seconds, result.threads, result.steals);
+    tree_walk_free(&result);
+    return 0;
+}
+
+// du command: space used by every directory under a path (the root by default), from the file chains in the FAT
+int du_command(char *path) {
+    unsigned int dir_cluster = g_fs_state.fs_bpb.BPB_RootClus;
+    char canon[256] = "/";
+    if (path != NULL) {
+        int err = path_resolve_dir(path, &dir_cluster, canon, sizeof(canon));
+        if (err == PATH_NOT_DIR) {
+            printf("Error: '%s' is not a directory.\n", path);
+            return 1;
+        } else if (err != PATH_OK) {
+            printf("Error: Directory '%s' not found.\n", path);
+            return 1;
+        }
+        // "/A/B/" -> "/A/B"
+        size_t len = strlen(canon);
+        if (len > 1 && canon[len - 1] == '/') canon[len - 1] = '\0';
+    }
+
+    if (bcache_flush() != 0 || flush_fat_table() != 0) {
+        printf("Error: Could not write back cached changes before the walk.\n");
+        return 1;
+    }
+
+    WALK_OPTIONS opts = { NULL, 1, 0 };
+    WALK_RESULT result;
+    if (tree_walk(dir_cluster, canon, &opts, &result) != 0) {
+        printf("Error: Failed to walk the directory tree.\n");
+        return 1;
+    }
+
+    // like du: subdirectories first, the starting directory with the grand total last
+    unsigned long long cluster_size = (unsigned long long)g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus;
+    for (unsigned int i = 1; i < result.dir_count; i++) {
+        printf("%llu\t%s\n", result.dirs[i].total * cluster_size / 1024, result.dirs[i].path);
+    }
+    unsigned long long total = result.dir_count ? result.dirs[0].total : 0;
+    printf("%llu\t%s\n", total * cluster_size / 1024, canon);
+    printf("%lu files, %u directories, %llu clusters (%.3f s, %d threads, %lu steals)\n",
+           result.files, result.dir_count, total, result.seconds, result.threads, result.steals);
+    tree_walk_free(&result);
+    return 0;
+}
+
+// HOST TRANSFER (get/put) -----------------------------------------
+
+// write() until all of it is out. returns 0 on success
+static int write_all(int fd, const unsigned char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// read() until len bytes came in. returns 0 on success, 1 on error or early EOF
+static int read_full(int fd, unsigned char *p, size_t len) {
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return 1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// copies one contiguous span between the image and host_fd by hand, for when the kernel can't.
+// mmap goes straight from/to the mapping, otherwise through *buf (HOST_COPY_BYTES, allocated on first use)
+static int copy_span_by_hand(long long offset, size_t len, int host_fd, int to_host, unsigned char **buf) {
+    if (g_fs_state.image_map != NULL) {
+        unsigned char *mapped = image_map_range(offset, len);
+        if (mapped == NULL) return 1;
+        return to_host ? write_all(host_fd, mapped, len) : read_full(host_fd, mapped, len);
+    }
+
+    if (*buf == NULL) {
+        *buf = (unsigned char *)malloc(HOST_COPY_BYTES);
+        if (*buf == NULL) return 1;
+    }
+    while (len > 0) {
+        size_t n = len < HOST_COPY_BYTES ? len : HOST_COPY_BYTES;
+        if (to_host) {
+            if (image_read(offset, *buf, n) != 0 || write_all(host_fd, *buf, n) != 0) return 1;
+        } else {
+            if (read_full(host_fd, *buf, n) != 0 || image_write(offset, *buf, n) != 0) return 1;
+        }
+        offset += (long long)n;
+        len -= n;
+    }
+    return 0;
+}
+
+// moves size bytes between host_fd and the file whose chain starts at start_cluster,
+// one I/O per contiguous run. to_host = 1 copies out of the image. runs gets the number of runs
+static int transfer_file(unsigned int start_cluster, unsigned int size, int host_fd, int to_host, unsigned int *runs) {
+    unsigned int cluster_size = g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus;
+    unsigned char *buf = NULL;
+    int status = 0;
+
+    // a throwaway open file, just for its extent map
+    OPEN_FILE walk;
+    memset(&walk, 0, sizeof(walk));
+    walk.starting_cluster = start_cluster;
+
+    *runs = 0;
+    unsigned int file_cluster = 0;
+    unsigned long long moved = 0;
+    while (moved < size) {
+        unsigned int run_left = 0;
+        unsigned int cluster = lookup_file_cluster(&walk, file_cluster, &run_left);
+        if (cluster >= 0x0FFFFFF8) {
+            status = 1; // chain shorter than the size says
+            break;
+        }
+
+        unsigned long long span = (unsigned long long)run_left * cluster_size;
+        if (span > size - moved) span = size - moved;
+        unsigned int first_sector = get_cluster_sector(cluster);
+        long long offset = (long long)first_sector * g_fs_state.fs_bpb.BPB_BytsPerSec;
+
+        // the kernel works on the image file, so the cache must not hold anything newer (get)
+        // or older (put) than what's on disk for this span
+        if (!to_host) bcache_invalidate(first_sector, run_left * g_fs_state.fs_bpb.BPB_SecPerClus);
+
+        long long done = to_host ? image_copy_out(host_fd, offset, (size_t)span)
+                                 : image_copy_in(host_fd, offset, (size_t)span);
+        if (done < 0 ||
+            ((unsigned long long)done < span &&
+             copy_span_by_hand(offset + done, (size_t)(span - (unsigned long long)done), host_fd, to_host, &buf) != 0)) {
+            status = 1;
+            break;
+        }
+
+        moved += span;
+        file_cluster += run_left;
+        (*runs)++;
+    }
+
+    reset_extent_map(&walk);
+    free(buf);
+    return status;
+}
+
+static void print_transfer(unsigned long long bytes, unsigned int runs, const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double secs = (double)(now.tv_sec - start->tv_sec) + (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+    printf("Copied %llu bytes in %u run%s (%.3f s, %.1f MB/s)\n", bytes, runs, runs == 1 ? "" : "s",
+           secs, secs > 0 ? (double)bytes / secs / 1e6 : 0.0);
+}
+
+// get command: copies a file out of the image to a host path
+int get_command(char *image_file, char *host_path) {
+    if (image_file == NULL || host_path == NULL) {
+        printf("Error: Missing image file or host path.\n");
+        return 1;
+    }
+
+    unsigned int dir_cluster;
+    char leaf[DIR_NAME_MAX];
+    DIR_ENTRY entry;
+    if (path_resolve_parent(image_file, &dir_cluster, NULL, 0, leaf, sizeof(leaf)) != PATH_OK ||
+        dentry_lookup(dir_cluster, leaf, &entry, NULL) != 1) {
+        printf("Error: File '%s' not found.\n", image_file);
+        return 1;
+    }
+    if (entry.DIR_Attr & ATTR_DIRECTORY) {
+        printf("Error: '%s' is a directory.\n", image_file);
+        return 1;
+    }
+
+    int host_fd = open(host_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (host_fd < 0) {
+        printf("Error: Cannot create '%s': %s.\n", host_path, strerror(errno));
+        return 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // the kernel copies from the image file, so everything written so far has to be in it
+    bcache_flush();
+
+    unsigned int runs = 0;
+    unsigned int starting_cluster = entry.DIR_FstClusHI << 16 | entry.DIR_FstClusLO;
+    int status = 0;
+    if (entry.DIR_FileSize > 0 && transfer_file(starting_cluster, entry.DIR_FileSize, host_fd, 1, &runs) != 0) {
+        printf("Error: Failed to copy '%s' to '%s'.\n", image_file, host_path);
+        status = 1;
+    }
+
+    if (close(host_fd) != 0 && status == 0) {
+        printf("Error: Failed to finish writing '%s': %s.\n", host_path, strerror(errno));
+        status = 1;
+    }
+    if (status == 0) print_transfer(entry.DIR_FileSize, runs, &start);
+    return status;
+}
+
+// put command: copies a host file into the image, replacing the file if it exists
+int put_command(char *host_path, char *image_file) {
+    if (host_path == NULL || image_file == NULL) {
+        printf("Error: Missing host path or image file.\n");
+        return 1;
+    }
+
+    int host_fd = open(host_path, O_RDONLY);
+    if (host_fd < 0) {
+        printf("Error: Cannot open '%s': %s.\n", host_path, strerror(errno));
+        return 1;
+    }
+    struct stat st;
+    if (fstat(host_fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        printf("Error: '%s' is not a regular file.\n", host_path);
+        close(host_fd);
+        return 1;
+    }
+    if ((unsigned long long)st.st_size > 0xFFFFFFFFULL) {
+        printf("Error: '%s' is bigger than the 4 GB FAT32 limit.\n", host_path);
+        close(host_fd);
+        return 1;
+    }
+    unsigned int size = (unsigned int)st.st_size;
+
+    unsigned int dir_cluster;
+    char leaf[DIR_NAME_MAX];
+    if (path_resolve_parent(image_file, &dir_cluster, NULL, 0, leaf, sizeof(leaf)) != PATH_OK) {
+        printf("Error: Invalid path '%s'.\n", image_file);
+        close(host_fd);
+        return 1;
+    }
+
+    DIR_ENTRY entry;
+    long entry_offset = -1;
+    int found = dentry_lookup(dir_cluster, leaf, &entry, &entry_offset);
+    if (found < 0) {
+        printf("Error: Failed to read the directory.\n");
+        close(host_fd);
+        return 1;
+    }
+
+    // can't swap the clusters out from under an open file, whichever name it was opened by
+    for (int i = 0; i < MAX_OPEN_FILES && found == 1; i++) {
+        OPEN_FILE *of = &g_fs_state.open_file_table[i];
+        if (of->is_used && of->dir_entry_offset == entry_offset) {
+            printf("Error: File '%s' is open, close it first.\n", image_file);
+            close(host_fd);
+            return 1;
+        }
+    }
+
+    // make the entry if the file isn't there yet, new entries only get 8.3 names
+    if (found == 0 && strlen(leaf) > 12) {
+        printf("Error: '%s' not found, and new files need an 8.3 name.\n", image_file);
+        close(host_fd);
+        return 1;
+    }
+    if (found == 0 && (creat_command(image_file) != 0 ||
+                       dentry_lookup(dir_cluster, leaf, &entry, &entry_offset) != 1)) {
+        close(host_fd);
+        return 1;
+    }
+    if (entry.DIR_Attr & ATTR_DIRECTORY) {
+        printf("Error: '%s' is a directory.\n", image_file);
+        close(host_fd);
+        return 1;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    // allocate the whole size up front so it comes out in as few runs as possible
+    unsigned int cluster_size = g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus;
+    unsigned int clusters = (unsigned int)(((unsigned long long)size + cluster_size - 1) / cluster_size);
+    unsigned int first_cluster = 0;
+    unsigned int runs = 0;
+    int status = 0;
+
+    if (clusters > 0) {
+        first_cluster = allocate_cluster_chain(clusters, 0, NULL);
+        if (first_cluster >= 0x0FFFFFF8) {
+            printf("Error: Not enough free clusters for '%s' (%u needed).\n", host_path, clusters);
+            status = 1;
+        } else {
+            posix_fadvise(host_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+            if (transfer_file(first_cluster, size, host_fd, 0, &runs) != 0) {
+                printf("Error: Failed to copy '%s' into '%s'.\n", host_path, image_file);
+                free_cluster_chain(first_cluster);
+                status = 1;
+            }
+        }
+    }
+    close(host_fd);
+
+    // the data is in, swap the entry over to the new chain and drop the old one
+    if (status == 0) {
+        unsigned int old_cluster = entry.DIR_FstClusHI << 16 | entry.DIR_FstClusLO;
+        entry.DIR_FileSize = size;
+        entry.DIR_FstClusHI = (first_cluster >> 16) & 0xFFFF;
+        entry.DIR_FstClusLO = first_cluster & 0xFFFF;
+        if (journal_write(entry_offset, &entry, sizeof(DIR_ENTRY)) != 0) {
+            printf("Error: Failed to update directory entry for '%s'.\n", image_file);
+            if (first_cluster >= 2) free_cluster_chain(first_cluster);
+            status = 1;
+        } else {
+            dir_index_update(dir_cluster, &entry, entry_offset);
+            forget_lookup(dir_cluster, &entry);
+            if (old_cluster >= 2) free_cluster_chain(old_cluster);
+        }
+    }
+
+    image_sync();
+    if (status == 0) print_transfer(size, runs, &start);
+    return status;
+}
+
 // MAIN PROGRAM LOOP -----------------------------------------
+
+// run_command result for "exit"
+#define SHELL_EXIT (-1)
+// stdout buffer in batch mode
+#define BATCH_OUTPUT_BUFFER (64 * 1024)
+
+// COMMAND TABLE -----------------------------------------
+
+// one shell command. min_tokens counts the command name itself
+typedef struct {
+    const char *name;
+    int (*run)(tokenlist *tokens);
+    size_t min_tokens;
+    const char *usage_error; // printed when the line has fewer tokens
+} SHELL_COMMAND;
+
+// optional first argument, NULL when missing
+#define ARG1(t) ((t)->size > 1 ? (t)->items[1] : NULL)
+
+static int run_exit(tokenlist *t) { return SHELL_EXIT; }
+static int run_info(tokenlist *t) { return info_command(); }
+static int run_ls(tokenlist *t) { return ls_command(ARG1(t)); }
+static int run_cd(tokenlist *t) { return cd_command(t->items[1]); }
+static int run_creat(tokenlist *t) { return creat_command(t->items[1]); }
+static int run_mkdir(tokenlist *t) { return mkdir_command(t->items[1]); }
+static int run_lsof(tokenlist *t) { return lsof_command(); }
+static int run_close(tokenlist *t) { return close_command(t->items[1]); }
+static int run_open(tokenlist *t) { return open_command(t->items[1], t->items[2]); }
+static int run_lseek(tokenlist *t) { return lseek_command(t->items[1], t->items[2]); }
+static int run_read(tokenlist *t) { return read_command(t->items[1], t->items[2], t->size > 3 ? t->items[3] : NULL); }
+static int run_cache(tokenlist *t) { return cache_command(ARG1(t)); }
+static int run_dcache(tokenlist *t) { return dcache_command(ARG1(t)); }
+static int run_dirindex(tokenlist *t) { return dirindex_command(ARG1(t)); }
+static int run_iostat(tokenlist *t) { return iostat_command(ARG1(t)); }
+static int run_sync(tokenlist *t) { return sync_command(); }
+static int run_readahead(tokenlist *t) { return readahead_command(ARG1(t)); }
+static int run_journal(tokenlist *t) { return journal_command(ARG1(t)); }
+static int run_check(tokenlist *t) { return check_command(ARG1(t)); }
+static int run_find(tokenlist *t) { return find_files_command(t->items[1]); }
+static int run_du(tokenlist *t) { return du_command(ARG1(t)); }
+static int run_stats(tokenlist *t) { return stats_command(ARG1(t)); }
+static int run_trace(tokenlist *t) { return trace_command(ARG1(t), t->size > 2 ? t->items[2] : NULL); }
+static int run_get(tokenlist *t) { return get_command(t->items[1], t->items[2]); }
+static int run_put(tokenlist *t) { return put_command(t->items[1], t->items[2]); }
+
+// the string is everything between the first and last quote on the line
+static int run_write(tokenlist *t) {
+    return write_command(t->items[1], t->quoted >= 0 ? t->items[t->quoted] : t->items[2]);
+}
+
+static const SHELL_COMMAND g_commands[] = {
+    // part one commands
+    { "exit", run_exit, 1, NULL },
+    { "info", run_info, 1, NULL },
+    // part two commands
+    { "ls", run_ls, 1, NULL },
+    { "cd", run_cd, 2, "Error: 'cd' command requires a directory name." },
+    // part three commands
+    { "creat", run_creat, 2, "Error: 'creat' command requires a file name." },
+    { "mkdir", run_mkdir, 2, "Error: 'mkdir' command requires a directory name." },
+    // part four commands
+    { "lsof", run_lsof, 1, NULL },
+    { "close", run_close, 2, "Error: Missing file name for 'close'." },
+    { "open", run_open, 3, "Error: 'open' command requires a file name and access mode." },
+    { "lseek", run_lseek, 3, "Error: 'lseek' command requires a file name and offset." },
+    { "read", run_read, 3, "Error: 'read' command requires a file name and size." },
+    // part five commands
+    { "write", run_write, 3, "Error: 'write' command requires a file name and a string." },
+    //part six commands (ill add under here)
+    // extra commands
+    { "cache", run_cache, 1, NULL },
+    { "dcache", run_dcache, 1, NULL },
+    { "dirindex", run_dirindex, 1, NULL },
+    { "iostat", run_iostat, 1, NULL },
+    { "sync", run_sync, 1, NULL },
+    { "readahead", run_readahead, 1, NULL },
+    { "journal", run_journal, 1, NULL },
+    { "check", run_check, 1, NULL },
+    { "find", run_find, 2, "Error: 'find' command requires a name pattern." },
+    { "du", run_du, 1, NULL },
+    { "stats", run_stats, 1, NULL },
+    { "trace", run_trace, 1, NULL },
+    { "get", run_get, 3, "Error: 'get' command requires an image file and a host path." },
+    { "put", run_put, 3, "Error: 'put' command requires a host path and an image file." },
+};
+#define NUM_COMMANDS (sizeof(g_commands) / sizeof(g_commands[0]))
+
+// open addressing table from name hash to command index + 1 (0 = empty)
+#define COMMAND_SLOTS 64 // power of two, well over NUM_COMMANDS
+static unsigned char g_command_slots[COMMAND_SLOTS];
+static int g_command_slots_ready = 0;
+
+// FNV-1a
+static unsigned int hash_command(const char *name) {
+    unsigned int h = 2166136261u;
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void build_command_slots() {
+    for (unsigned int i = 0; i < NUM_COMMANDS; i++) {
+        unsigned int slot = hash_command(g_commands[i].name) & (COMMAND_SLOTS - 1);
+        while (g_command_slots[slot] != 0) slot = (slot + 1) & (COMMAND_SLOTS - 1);
+        g_command_slots[slot] = (unsigned char)(i + 1);
+    }
+    g_command_slots_ready = 1;
+}
+
+// index of a command in the table, -1 if there is no such command
+int find_command(const char *name) {
+    if (!g_command_slots_ready) build_command_slots();
+
+    unsigned int slot = hash_command(name) & (COMMAND_SLOTS - 1);
+    while (g_command_slots[slot] != 0) {
+        int i = g_command_slots[slot] - 1;
+        if (strcmp(g_commands[i].name, name) == 0) return i;
+        slot = (slot + 1) & (COMMAND_SLOTS - 1);
+    }
+    return -1;
+}
+
+// tokens of the line being run, the item array is reused line after line
+static tokenlist g_tokens;
+
+#ifndef FS_INSTRUMENT
+// time without the counters: just the latency
+static void print_time_only(const char *name, const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double us = (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+    printf("time %s: %.1f us (build with 'make INSTRUMENT=1' for the cost breakdown)\n", name, us);
+}
+#endif
+
+// runs one command line. returns 0 on success, 1 if the command failed, SHELL_EXIT for exit
+int run_command(char *line) {
+    trim_whitespace(line); 
+    
+    tokenize_in_place(&g_tokens, line);
+    if (g_tokens.size == 0) {
+        return 0; 
+    }
+
+    // "time CMD": run CMD, then show what it cost. the tokens are a shifted view of g_tokens
+    tokenlist timed_tokens;
+    tokenlist *tokens = &g_tokens;
+    int timed = strcmp(g_tokens.items[0], "time") == 0;
+    if (timed) {
+        if (g_tokens.size < 2) {
+            printf("Error: 'time' command requires a command to run.\n");
+            return 1;
+        }
+        timed_tokens = g_tokens;
+        timed_tokens.items++;
+        timed_tokens.size--;
+        if (timed_tokens.quoted >= 0) timed_tokens.quoted--;
+        tokens = &timed_tokens;
+    }
+
+    char *command = tokens->items[0];
+    int id = find_command(command);
+    if (id < 0) {
+        printf("Error: Command '%s' not implemented or recognized.\n", command);
+        return 1;
+    }
+
+    const SHELL_COMMAND *cmd = &g_commands[id];
+    g_fs_state.io_stats.commands++;
+    if (tokens->size < cmd->min_tokens) {
+        printf("%s\n", cmd->usage_error);
+        return 1;
+    }
+    trace_set_command(cmd->name);
+#ifdef FS_INSTRUMENT
+    STATS_SAMPLE sample;
+    stats_begin(&sample);
+    int result = cmd->run(tokens);
+    FS_COUNTERS cost;
+    long long ns = stats_end(cmd->name, &sample, &cost);
+    if (timed) stats_print_cost(cmd->name, ns, &cost);
+#else
+    struct timespec start;
+    if (timed) clock_gettime(CLOCK_MONOTONIC, &start);
+    int result = cmd->run(tokens);
+    if (timed) print_time_only(cmd->name, &start);
+#endif
+    journal_end_op(); // commits once enough commands have piled up
+    trace_set_command(NULL);
+    return result;
+}
+
+// BATCH MODE -----------------------------------------
+
+// counters for the summary printed when a batch finishes
+static unsigned long g_batch_commands = 0;
+static unsigned long g_batch_failed = 0;
+static struct timespec g_batch_start;
+// -t: every command's latency goes here, one "nanoseconds<TAB>status<TAB>line" per command
+static FILE *g_batch_timing = NULL;
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// runs one batch line, failures are reported on stderr as source:line. returns 1 on exit
+static int run_batch_line(char *line, const char *source, unsigned long line_number) {
+    // blank lines and # comments aren't commands
+    char *p = line;
+    while (isspace((unsigned char)*p)) p++;
+    if (*p == '\0' || *p == '#') return 0;
+
+    // the lexer works in place, so keep a copy of the line to log
+    char logged[256];
+    struct timespec start;
+    if (g_batch_timing != NULL) {
+        snprintf(logged, sizeof(logged), "%s", p);
+        logged[strcspn(logged, "\r\n")] = '\0';
+        clock_gettime(CLOCK_MONOTONIC, &start);
+    }
+
+    int status = run_command(line);
+    if (g_batch_timing != NULL) {
+        fprintf(g_batch_timing, "%.0f\t%d\t%s\n", seconds_since(&start) * 1e9, status, logged);
+    }
+    if (status == SHELL_EXIT) return 1;
+
+    g_batch_commands++;
+    if (status != 0) {
+        g_batch_failed++;
+        // keep the report next to the command's own output
+        fflush(stdout);
+        fprintf(stderr, "%s:%lu: exit status %d\n", source, line_number, status);
+    }
+    return 0;
+}
+
+// prints the summary and leaves, exit status is 1 if any command failed
+static void finish_batch() {
+    double elapsed = seconds_since(&g_batch_start);
+    fflush(stdout);
+    fprintf(stderr, "Batch: %lu commands, %lu failed, %.3f s, %.0f commands/s\n",
+            g_batch_commands, g_batch_failed, elapsed, elapsed > 0 ? g_batch_commands / elapsed : 0.0);
+    if (g_batch_timing != NULL && fclose(g_batch_timing) != 0) {
+        fprintf(stderr, "Error: Could not write the timing log.\n");
+    }
+    g_batch_timing = NULL;
+    exit_shell(g_batch_failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+// -c: commands separated by ';' (a ';' inside double quotes doesn't split)
+static void run_command_string(char *commands) {
+    unsigned long number = 1;
+    int in_quotes = 0;
+    char *start = commands;
+
+    for (char *p = commands; ; p++) {
+        if (*p == '"') {
+            in_quotes = !in_quotes;
+        } else if ((*p == ';' && !in_quotes) || *p == '\0') {
+            int last = *p == '\0';
+            *p = '\0';
+            if (run_batch_line(start, "-c", number++) || last) break;
+            start = p + 1;
+        }
+    }
+    finish_batch();
+}
+
+// -f: one command per line, "-" reads stdin. lines can be any length
+static void run_script(const char *path) {
+    FILE *script = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (script == NULL) {
+        fprintf(stderr, "Error: Could not open script '%s'.\n", path);
+        exit_shell(EXIT_FAILURE);
+    }
+
+    char *line = NULL;
+    size_t capacity = 0;
+    unsigned long number = 0;
+    while (getline(&line, &capacity, script) != -1) {
+        if (run_batch_line(line, path, ++number)) break;
+    }
+
+    free(line);
+    if (script != stdin) fclose(script);
+    finish_batch();
+}
+
+// MAIN PROGRAM -----------------------------------------
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-m] [-n] [-T trace] [-c \"cmd; cmd\" | -f script [-t file]] [FAT32 ISO]\n", prog);
+    fprintf(stderr, "  -m          mmap the image instead of using pread/pwrite\n");
+    fprintf(stderr, "  -n          write only the active FAT, copy it to the mirrors at exit (bulk ingest)\n");
+    fprintf(stderr, "  -c \"cmds\"   run ';' separated commands without prompts, then exit\n");
+    fprintf(stderr, "  -f script   run a script (one command per line, - for stdin), then exit\n");
+    fprintf(stderr, "  -t file     with -c or -f, log each command's latency in ns to file\n");
+    fprintf(stderr, "  -T trace    trace image accesses, written to trace at exit (.json for Chrome trace, else CSV)\n");
+}
+
 int start_program_shell(int argc, char *argv[]) {
-    FILE *image_fp = NULL;
+    int image_fd = -1;
+
+    // options come before the image path
+    int use_mmap = 0;
+    int no_mirror = 0;
+    char *batch_commands = NULL;
+    const char *script_path = NULL;
+    const char *timing_path = NULL;
+    const char *trace_path = NULL;
+    int argi = 1;
+    while (argi < argc && argv[argi][0] == '-') {
+        if (strcmp(argv[argi], "-m") == 0) {
+            use_mmap = 1;
+        } else if (strcmp(argv[argi], "-n") == 0) {
+            no_mirror = 1;
+        } else if ((strcmp(argv[argi], "-c") == 0 || strcmp(argv[argi], "-f") == 0) && argi + 1 < argc) {
+            if (batch_commands != NULL || script_path != NULL) {
+                fprintf(stderr, "Error: Only one of -c and -f can be given.\n");
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+            if (argv[argi][1] == 'c') batch_commands = argv[argi + 1];
+            else script_path = argv[argi + 1];
+            argi++;
+        } else if (strcmp(argv[argi], "-t") == 0 && argi + 1 < argc) {
+            timing_path = argv[++argi];
+        } else if (strcmp(argv[argi], "-T") == 0 && argi + 1 < argc) {
+            trace_path = argv[++argi];
+        } else {
+            fprintf(stderr, "Error: Unknown option '%s'.\n", argv[argi]);
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        argi++;
+    }
 
-    if (argc != 2) {
+    if (argc - argi != 1) {
         fprintf(stderr, "Error: Incorrect number of arguments.\n");
-        fprintf(stderr, "Usage: %s [FAT32 ISO]\n", argv[0]);
+        print_usage(argv[0]);
         exit(EXIT_FAILURE);
     }
     
-    const char *image_path = argv[1];
-    image_fp = fopen(image_path, "r+");
+    if (timing_path != NULL) {
+        if (batch_commands == NULL && script_path == NULL) {
+            fprintf(stderr, "Error: -t only works with -c or -f.\n");
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        g_batch_timing = fopen(timing_path, "w");
+        if (g_batch_timing == NULL) {
+            fprintf(stderr, "Error: Could not open timing log '%s'.\n", timing_path);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    const char *image_path = argv[argi];
+    image_fd = open(image_path, O_RDWR);
 
-    if (image_fp == NULL) {
+    if (image_fd < 0) {
         fprintf(stderr, "Error: Could not open file image '%s'.\n", image_path);
         exit(EXIT_FAILURE); 
     }
 
-    if (load_bpb_and_init_state(image_path, image_fp) != 0) {
+    if (use_mmap && image_mmap(image_fd) != 0) {
+        fprintf(stderr, "Error: Could not mmap '%s'.\n", image_path);
+        close(image_fd);
+        exit(EXIT_FAILURE);
+    }
+
+    if (load_bpb_and_init_state(image_path, image_fd) != 0) {
         fprintf(stderr, "Initialization failed.\n");
-        exit_shell(); 
+        exit_shell(EXIT_FAILURE); 
+    }
+
+    if (no_mirror && defer_fat_mirrors() != 0) {
+        fprintf(stderr, "Error: Could not turn off FAT mirroring.\n");
+        exit_shell(EXIT_FAILURE);
+    }
+
+    if (trace_path != NULL) {
+        if (trace_start() != 0) {
+            fprintf(stderr, "Error: Not enough memory for the trace buffer.\n");
+            exit_shell(EXIT_FAILURE);
+        }
+        trace_dump_at_exit(trace_path);
+    }
+
+    // batch mode: no prompts and fully buffered output
+    if (batch_commands != NULL || script_path != NULL) {
+        setvbuf(stdout, NULL, _IOFBF, BATCH_OUTPUT_BUFFER);
+        clock_gettime(CLOCK_MONOTONIC, &g_batch_start);
+        if (batch_commands != NULL) run_command_string(batch_commands);
+        else run_script(script_path);
     }
     
     char line[1024];
     while (1) {
+        // waiting on the user, no point holding the group open
+        journal_commit();
         printf("%s%s>", g_fs_state.image_name, g_fs_state.current_path);
 
         if (fgets(line, sizeof(line), stdin) == NULL) {
-            exit_shell(); 
-        }
-        
-        trim_whitespace(line); 
-        
-        tokenlist *tokens_list = get_tokens(line); 
-        if (tokens_list == NULL || tokens_list->size == 0 || tokens_list->items[0] == NULL) {
-            if (tokens_list) free_tokens(tokens_list); 
-            continue; 
-        }
-
-        char *command = tokens_list->items[0];
-
-        // part one commands
-        if (strcmp(command, "exit") == 0) {
-             free_tokens(tokens_list); 
-             exit_shell(); 
-        } 
-        else if (strcmp(command, "info") == 0) {
-             info_command(); 
-        }
-        // part two commands
-        else if (strcmp(command, "ls") == 0) {
-             ls_command(); 
-        }
-        else if (strcmp(command, "cd") == 0) {
-            if (tokens_list->size < 2 || tokens_list->items[1] == NULL) {
-                printf("Error: 'cd' command requires a directory name.\n");
-            } else {
-                cd_command(tokens_list->items[1]);
-            }
-        }
-        // part three commands
-        else if (strcmp(command, "creat") == 0) {
-            if (tokens_list->size < 2 || tokens_list->items[1] == NULL) {
-                printf("Error: 'creat' command requires a file name.\n");
-            } else {
-                creat_command(tokens_list->items[1]);
-            }
-        }
-        else if (strcmp(command, "mkdir") == 0) {  
-            if (tokens_list->size < 2 || tokens_list->items[1] == NULL) {
-                printf("Error: 'mkdir' command requires a directory name.\n");
-            } else {
-                mkdir_command(tokens_list->items[1]);
-            }
-        }
-        // part four commands
-        else if (strcmp(command, "lsof") == 0) {
-             lsof_command(); 
-        }
-        else if (strcmp(command, "close") == 0) {
-            if (tokens_list->size < 2) {
-                printf("Error: Missing file name for 'close'.\n");
-            } else {
-                close_command(tokens_list->items[1]);
-            }
+            exit_shell(EXIT_SUCCESS); 
         }
-        else if (strcmp(command, "open") == 0) {
-            if (tokens_list->size < 3) {
-                printf("Error: 'open' command requires a file name and access mode.\n");
-            } else {
-                open_command(tokens_list->items[1], tokens_list->items[2]);
-            }
-        }
-        else if (strcmp(command, "lseek") == 0) {
-            if (tokens_list->size < 3) {
-                printf("Error: 'lseek' command requires a file name and offset.\n");
-            } else {
-                lseek_command(tokens_list->items[1], tokens_list->items[2]);
-            }
-        }
-        else if (strcmp(command, "read") == 0) {
-            if (tokens_list->size < 3) {
-                printf("Error: 'read' command requires a file name and size.\n");
-            } else {
-                read_command(tokens_list->items[1], tokens_list->items[2]);
-            }
-        }
-        // part five commands (ill add under here)
-        //part six commands (ill add under here)
-        // unrecognized command
-        else {
-            printf("Error: Command '%s' not implemented or recognized.\n", command);
+
+        if (run_command(line) == SHELL_EXIT) {
+            exit_shell(EXIT_SUCCESS);
         }
-        
-        free_tokens(tokens_list); 
     }
     
     return 0; 
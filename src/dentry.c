@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include "structs.h"
+#include "commands.h"
+#include "dir_index.h"
+#include "dentry.h"
+
+#define DENTRY_BUCKETS 4096 // power of two
+
+static DENTRY *g_buckets[DENTRY_BUCKETS];
+static DENTRY *g_lru_head = NULL; // most recently used
+static DENTRY *g_lru_tail = NULL;
+static unsigned int g_max_entries = DENTRY_DEFAULT_MAX;
+static DENTRY_STATS g_stats;
+
+// HELPERS -----------------------------------------
+
+static unsigned int normalize_cluster(unsigned int cluster) {
+    return cluster < 2 ? g_fs_state.fs_bpb.BPB_RootClus : cluster;
+}
+
+// FNV-1a over the parent cluster and the name, which matches whatever its case
+static unsigned int hash_key(unsigned int parent, const char *name) {
+    unsigned int h = 2166136261u;
+    for (int i = 0; i < 4; i++) {
+        h ^= (parent >> (i * 8)) & 0xFF;
+        h *= 16777619u;
+    }
+    while (*name) {
+        h ^= (unsigned char)toupper((unsigned char)*name++);
+        h *= 16777619u;
+    }
+    return h & (DENTRY_BUCKETS - 1);
+}
+
+static void lru_unlink(DENTRY *d) {
+    if (d->lru_prev) d->lru_prev->lru_next = d->lru_next;
+    else g_lru_head = d->lru_next;
+    if (d->lru_next) d->lru_next->lru_prev = d->lru_prev;
+    else g_lru_tail = d->lru_prev;
+    d->lru_prev = d->lru_next = NULL;
+}
+
+static void lru_push_head(DENTRY *d) {
+    d->lru_prev = NULL;
+    d->lru_next = g_lru_head;
+    if (g_lru_head) g_lru_head->lru_prev = d;
+    g_lru_head = d;
+    if (g_lru_tail == NULL) g_lru_tail = d;
+}
+
+static DENTRY *find(unsigned int parent, const char *name) {
+    DENTRY *d = g_buckets[hash_key(parent, name)];
+    while (d != NULL && (d->parent != parent || !dir_name_equal(d->name, name))) {
+        d = d->hash_next;
+    }
+    return d;
+}
+
+static void drop(DENTRY *d) {
+    DENTRY **link = &g_buckets[hash_key(d->parent, d->name)];
+    while (*link != NULL && *link != d) link = &(*link)->hash_next;
+    if (*link) *link = d->hash_next;
+
+    lru_unlink(d);
+    free(d);
+    g_stats.cached--;
+}
+
+static void trim_to(unsigned int max_entries) {
+    while (g_stats.cached > max_entries && g_lru_tail != NULL) {
+        drop(g_lru_tail);
+        g_stats.evictions++;
+    }
+}
+
+// CACHE API -----------------------------------------
+
+int dentry_lookup(unsigned int parent, const char *name, DIR_ENTRY *entry, long *offset) {
+    parent = normalize_cluster(parent);
+
+    // entries are forgotten by their 8.3 name, so only lookups by that name are kept here.
+    // anything longer can only be a long name, which the directory's index finds with one probe
+    if (strlen(name) > 12) {
+        DIR_INDEX *idx = dir_index_get(parent);
+        if (idx == NULL) return -1;
+        return dir_index_lookup(idx, name, entry, offset);
+    }
+
+    DENTRY *d = find(parent, name);
+    if (d != NULL) {
+        g_stats.hits++;
+        lru_unlink(d);
+        lru_push_head(d);
+    } else {
+        g_stats.misses++;
+        DIR_INDEX *idx = dir_index_get(parent);
+        if (idx == NULL) return -1;
+
+        DIR_ENTRY found_entry;
+        long found_offset;
+        int found = dir_index_lookup(idx, name, &found_entry, &found_offset);
+        char short_name[13];
+        if (found) get_formatted_name(found_entry.DIR_Name, short_name);
+
+        d = NULL;
+        if (!found || dir_name_equal(short_name, name)) d = (DENTRY *)calloc(1, sizeof(DENTRY));
+        if (!d) {
+            // found by its long name, or can't remember it: just answer
+            if (found && entry != NULL) memcpy(entry, &found_entry, sizeof(DIR_ENTRY));
+            if (found && offset != NULL) *offset = found_offset;
+            return found;
+        }
+        d->parent = parent;
+        strcpy(d->name, name);
+        d->found = found;
+        if (found) {
+            d->entry = found_entry;
+            d->offset = found_offset;
+        }
+
+        unsigned int b = hash_key(parent, name);
+        d->hash_next = g_buckets[b];
+        g_buckets[b] = d;
+        lru_push_head(d);
+        g_stats.cached++;
+        trim_to(g_max_entries);
+    }
+
+    if (!d->found) return 0;
+    if (entry != NULL) memcpy(entry, &d->entry, sizeof(DIR_ENTRY));
+    if (offset != NULL) *offset = d->offset;
+    return 1;
+}
+
+void dentry_invalidate(unsigned int parent, const char *name) {
+    DENTRY *d = find(normalize_cluster(parent), name);
+    if (d != NULL) {
+        drop(d);
+        g_stats.invalidations++;
+    }
+}
+
+void dentry_clear() {
+    while (g_lru_head != NULL) drop(g_lru_head);
+}
+
+void dentry_set_max(unsigned int max_entries) {
+    if (max_entries == 0) max_entries = 1;
+    g_max_entries = max_entries;
+    trim_to(g_max_entries);
+}
+
+void dentry_get_stats(DENTRY_STATS *stats) {
+    *stats = g_stats;
+    stats->max_entries = g_max_entries;
+}
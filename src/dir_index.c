@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "structs.h"
+#include "commands.h"
+#include "dir_index.h"
+#include "dir_iter.h"
+
+#define DIR_HASH_BUCKETS 256 // buckets for finding a directory by cluster
+
+// indexed directories, most recently used at the head
+static DIR_INDEX *g_lru_head = NULL;
+static DIR_INDEX *g_lru_tail = NULL;
+static DIR_INDEX *g_dir_buckets[DIR_HASH_BUCKETS];
+static unsigned int g_max_dirs = DIR_INDEX_DEFAULT_MAX;
+static DIR_INDEX_STATS g_stats;
+
+// HELPERS -----------------------------------------
+
+static unsigned char fold_case(unsigned char c) {
+    return (c >= 'a' && c <= 'z') ? (unsigned char)(c - 'a' + 'A') : c;
+}
+
+// FNV-1a over the upper cased name
+unsigned int dir_name_hash(const char *name) {
+    unsigned int h = 2166136261u;
+    while (*name) {
+        h ^= fold_case((unsigned char)*name++);
+        h *= 16777619u;
+    }
+    return h;
+}
+
+int dir_name_equal(const char *a, const char *b) {
+    while (*a && fold_case((unsigned char)*a) == fold_case((unsigned char)*b)) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+static unsigned int dir_bucket(unsigned int cluster) {
+    return (cluster * 2654435761u) % DIR_HASH_BUCKETS;
+}
+
+static unsigned int entries_per_cluster() {
+    return (g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus) / sizeof(DIR_ENTRY);
+}
+
+static long slot_offset(unsigned int cluster, unsigned int index) {
+    return get_sector_offset(get_cluster_sector(cluster)) + (long)index * sizeof(DIR_ENTRY);
+}
+
+static void lru_unlink(DIR_INDEX *idx) {
+    if (idx->lru_prev) idx->lru_prev->lru_next = idx->lru_next;
+    else g_lru_head = idx->lru_next;
+    if (idx->lru_next) idx->lru_next->lru_prev = idx->lru_prev;
+    else g_lru_tail = idx->lru_prev;
+    idx->lru_prev = idx->lru_next = NULL;
+}
+
+static void lru_push_head(DIR_INDEX *idx) {
+    idx->lru_prev = NULL;
+    idx->lru_next = g_lru_head;
+    if (g_lru_head) g_lru_head->lru_prev = idx;
+    g_lru_head = idx;
+    if (g_lru_tail == NULL) g_lru_tail = idx;
+}
+
+static void free_index(DIR_INDEX *idx) {
+    DIR_INDEX **link = &g_dir_buckets[dir_bucket(idx->cluster)];
+    while (*link != NULL && *link != idx) link = &(*link)->hash_next;
+    if (*link) *link = idx->hash_next;
+
+    lru_unlink(idx);
+    free(idx->entries);
+    free(idx->buckets);
+    free(idx->names);
+    free(idx->deleted_slots);
+    free(idx);
+    g_stats.cached--;
+}
+
+// a link is entry * 2 for the 8.3 name, entry * 2 + 1 for the long name
+static const char *link_name(DIR_INDEX *idx, int link) {
+    DIR_INDEX_ENTRY *e = &idx->entries[link >> 1];
+    return (link & 1) ? idx->names + e->long_name : e->name;
+}
+
+static int *link_next(DIR_INDEX *idx, int link) {
+    DIR_INDEX_ENTRY *e = &idx->entries[link >> 1];
+    return (link & 1) ? &e->long_next : &e->next;
+}
+
+static void add_link(DIR_INDEX *idx, int *buckets, unsigned int num_buckets, int link) {
+    unsigned int b = dir_name_hash(link_name(idx, link)) & (num_buckets - 1);
+    *link_next(idx, link) = buckets[b];
+    buckets[b] = link;
+}
+
+// doubles the bucket array and rehashes once the table is fuller than one name per bucket
+static int grow_buckets(DIR_INDEX *idx) {
+    unsigned int wanted = idx->num_buckets ? idx->num_buckets * 2 : 64;
+    int *buckets = (int *)malloc(wanted * sizeof(int));
+    if (!buckets) return 1;
+
+    for (unsigned int i = 0; i < wanted; i++) buckets[i] = -1;
+    for (unsigned int i = 0; i < idx->count; i++) {
+        add_link(idx, buckets, wanted, (int)i * 2);
+        if (idx->entries[i].long_name >= 0) add_link(idx, buckets, wanted, (int)i * 2 + 1);
+    }
+
+    free(idx->buckets);
+    idx->buckets = buckets;
+    idx->num_buckets = wanted;
+    return 0;
+}
+
+// copies a long name into the pool, returns its offset (-1 if out of memory)
+static int keep_long_name(DIR_INDEX *idx, const char *long_name) {
+    unsigned int len = (unsigned int)strlen(long_name) + 1;
+    if (idx->names_len + len > idx->names_capacity) {
+        unsigned int cap = idx->names_capacity ? idx->names_capacity : 1024;
+        while (cap < idx->names_len + len) cap *= 2;
+        char *grown = (char *)realloc(idx->names, cap);
+        if (!grown) return -1;
+        idx->names = grown;
+        idx->names_capacity = cap;
+    }
+    int offset = (int)idx->names_len;
+    memcpy(idx->names + offset, long_name, len);
+    idx->names_len += len;
+    return offset;
+}
+
+// long_name may be NULL or "". it's left out if it is the 8.3 name again
+static int insert_name(DIR_INDEX *idx, const DIR_ENTRY *entry, long offset, const char *long_name) {
+    if (idx->count == idx->capacity) {
+        unsigned int cap = idx->capacity ? idx->capacity * 2 : 32;
+        DIR_INDEX_ENTRY *grown = (DIR_INDEX_ENTRY *)realloc(idx->entries, cap * sizeof(DIR_INDEX_ENTRY));
+        if (!grown) return 1;
+        idx->entries = grown;
+        idx->capacity = cap;
+    }
+    if (idx->links + 2 > idx->num_buckets && grow_buckets(idx) != 0) {
+        return 1;
+    }
+
+    DIR_INDEX_ENTRY *e = &idx->entries[idx->count];
+    get_formatted_name((unsigned char *)entry->DIR_Name, e->name);
+    e->offset = offset;
+    e->long_name = -1;
+    memcpy(&e->entry, entry, sizeof(DIR_ENTRY));
+    if (long_name != NULL && long_name[0] != '\0' && !dir_name_equal(long_name, e->name)) {
+        e->long_name = keep_long_name(idx, long_name);
+        if (e->long_name < 0) return 1;
+    }
+
+    add_link(idx, idx->buckets, idx->num_buckets, (int)idx->count * 2);
+    idx->links++;
+    if (e->long_name >= 0) {
+        add_link(idx, idx->buckets, idx->num_buckets, (int)idx->count * 2 + 1);
+        idx->links++;
+    }
+    idx->count++;
+    return 0;
+}
+
+static int add_deleted_slot(DIR_INDEX *idx, long offset) {
+    if (idx->deleted_count == idx->deleted_capacity) {
+        unsigned int cap = idx->deleted_capacity ? idx->deleted_capacity * 2 : 16;
+        long *grown = (long *)realloc(idx->deleted_slots, cap * sizeof(long));
+        if (!grown) return 1;
+        idx->deleted_slots = grown;
+        idx->deleted_capacity = cap;
+    }
+    idx->deleted_slots[idx->deleted_count++] = offset;
+    return 0;
+}
+
+static DIR_INDEX_ENTRY *find_name(DIR_INDEX *idx, const char *name) {
+    if (idx->num_buckets == 0) return NULL;
+    int link = idx->buckets[dir_name_hash(name) & (idx->num_buckets - 1)];
+    while (link >= 0) {
+        if (dir_name_equal(link_name(idx, link), name)) return &idx->entries[link >> 1];
+        link = *link_next(idx, link);
+    }
+    return NULL;
+}
+
+// scans the whole directory once and fills in the index, long names included (the
+// iterator puts them together and checks them on the way)
+static int build_index(DIR_INDEX *idx) {
+    DIR_ITER it;
+    DIR_ENTRY *entry;
+
+    idx->end_cluster = 0;
+    if (grow_buckets(idx) != 0) return 1;
+    if (dir_iter_open(&it, idx->cluster) != 0) return 1;
+
+    while ((entry = dir_iter_next(&it)) != NULL) {
+        if (entry->DIR_Name[0] == 0xE5) {
+            add_deleted_slot(idx, it.offset);
+            continue;
+        }
+        if ((entry->DIR_Attr & ATTR_LFN) == ATTR_LFN) continue;
+        if (entry->DIR_Attr & ATTR_VOLUME_ID) continue;
+
+        // first entry wins if two format to the same name, a long name that's taken is dropped
+        char name[13];
+        get_formatted_name(entry->DIR_Name, name);
+        if (find_name(idx, name) != NULL) continue;
+        const char *long_name = it.long_name[0] != '\0' && find_name(idx, it.long_name) == NULL ? it.long_name : NULL;
+        if (insert_name(idx, entry, it.offset, long_name) != 0) {
+            dir_iter_close(&it);
+            return 1;
+        }
+    }
+
+    // everything from the end marker on is free too
+    if (it.at_end) {
+        idx->end_cluster = it.cluster;
+        idx->end_index = it.index;
+    }
+    int failed = it.error;
+    dir_iter_close(&it);
+    return failed;
+}
+
+static DIR_INDEX *find_index(unsigned int cluster) {
+    DIR_INDEX *idx = g_dir_buckets[dir_bucket(cluster)];
+    while (idx != NULL && idx->cluster != cluster) idx = idx->hash_next;
+    return idx;
+}
+
+// ".." entries of top level directories say 0, which means the root
+static unsigned int normalize_cluster(unsigned int cluster) {
+    return cluster < 2 ? g_fs_state.fs_bpb.BPB_RootClus : cluster;
+}
+
+// INDEX API -----------------------------------------
+
+DIR_INDEX *dir_index_get(unsigned int cluster) {
+    cluster = normalize_cluster(cluster);
+
+    DIR_INDEX *idx = find_index(cluster);
+    if (idx != NULL) {
+        lru_unlink(idx);
+        lru_push_head(idx);
+        return idx;
+    }
+
+    idx = (DIR_INDEX *)calloc(1, sizeof(DIR_INDEX));
+    if (!idx) return NULL;
+    idx->cluster = cluster;
+
+    if (build_index(idx) != 0) {
+        free(idx->entries);
+        free(idx->buckets);
+        free(idx->names);
+        free(idx->deleted_slots);
+        free(idx);
+        return NULL;
+    }
+    g_stats.builds++;
+
+    unsigned int b = dir_bucket(cluster);
+    idx->hash_next = g_dir_buckets[b];
+    g_dir_buckets[b] = idx;
+    lru_push_head(idx);
+    g_stats.cached++;
+
+    // stay under the cap, the one we just built is at the head so it survives
+    while (g_stats.cached > g_max_dirs && g_lru_tail != idx) {
+        free_index(g_lru_tail);
+        g_stats.evictions++;
+    }
+    return idx;
+}
+
+int dir_index_lookup(DIR_INDEX *idx, const char *name, DIR_ENTRY *entry, long *offset) {
+    g_stats.lookups++;
+    DIR_INDEX_ENTRY *e = find_name(idx, name);
+    if (e == NULL) return 0;
+    if (entry != NULL) memcpy(entry, &e->entry, sizeof(DIR_ENTRY));
+    if (offset != NULL) *offset = e->offset;
+    return 1;
+}
+
+long dir_index_free_slot(DIR_INDEX *idx) {
+    if (idx->deleted_count > 0) {
+        return idx->deleted_slots[idx->deleted_count - 1];
+    }
+    if (idx->end_cluster != 0) {
+        return slot_offset(idx->end_cluster, idx->end_index);
+    }
+    return -1;
+}
+
+void dir_index_add(DIR_INDEX *idx, const DIR_ENTRY *entry, long offset) {
+    // the slot isn't free anymore
+    int took_slot = 0;
+    for (unsigned int i = idx->deleted_count; i > 0; i--) {
+        if (idx->deleted_slots[i - 1] == offset) {
+            idx->deleted_slots[i - 1] = idx->deleted_slots[--idx->deleted_count];
+            took_slot = 1;
+            break;
+        }
+    }
+    if (!took_slot && idx->end_cluster != 0 && offset == slot_offset(idx->end_cluster, idx->end_index)) {
+        // end marker moves one entry along, possibly into the next cluster of the chain
+        if (idx->end_index + 1 < entries_per_cluster()) {
+            idx->end_index++;
+        } else {
+            unsigned int next = read_fat_entry(idx->end_cluster);
+            idx->end_cluster = (next >= 2 && next < 0x0FFFFFF8) ? next : 0;
+            idx->end_index = 0;
+        }
+    }
+
+    if (insert_name(idx, entry, offset, NULL) != 0) {
+        // out of memory: forget this directory, it gets rebuilt from disk next time
+        dir_index_invalidate(idx->cluster);
+    }
+}
+
+void dir_index_update(unsigned int cluster, const DIR_ENTRY *entry, long offset) {
+    DIR_INDEX *idx = find_index(normalize_cluster(cluster));
+    if (idx == NULL) return;
+
+    char name[13];
+    get_formatted_name((unsigned char *)entry->DIR_Name, name);
+    DIR_INDEX_ENTRY *e = find_name(idx, name);
+    if (e != NULL && e->offset == offset) {
+        memcpy(&e->entry, entry, sizeof(DIR_ENTRY));
+    }
+}
+
+void dir_index_invalidate(unsigned int cluster) {
+    DIR_INDEX *idx = find_index(normalize_cluster(cluster));
+    if (idx != NULL) free_index(idx);
+}
+
+void dir_index_clear() {
+    while (g_lru_head != NULL) free_index(g_lru_head);
+}
+
+void dir_index_set_max(unsigned int max_dirs) {
+    if (max_dirs == 0) max_dirs = 1;
+    g_max_dirs = max_dirs;
+    while (g_stats.cached > g_max_dirs) {
+        free_index(g_lru_tail);
+        g_stats.evictions++;
+    }
+}
+
+void dir_index_get_stats(DIR_INDEX_STATS *stats) {
+    *stats = g_stats;
+    stats->max_dirs = g_max_dirs;
+}
@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "structs.h"
+#include "commands.h"
+#include "block_cache.h"
+#include "dir_iter.h"
+#include "trace.h"
+
+static int valid_cluster(unsigned int cluster) {
+    return cluster >= 2 && cluster < 0x0FFFFFF8;
+}
+
+static unsigned int cluster_bytes() {
+    return g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus;
+}
+
+static long long cluster_offset(unsigned int cluster) {
+    return (long long)get_cluster_sector(cluster) * g_fs_state.fs_bpb.BPB_BytsPerSec;
+}
+
+// reads the next run of back to back clusters. returns 0 when there is nothing left
+static int load_run(DIR_ITER *it) {
+    if (!valid_cluster(it->next_cluster)) return 0;
+
+    unsigned int bytes = cluster_bytes();
+    unsigned int max_run = DIR_ITER_RUN_BYTES / bytes;
+    if (max_run == 0) max_run = 1;
+
+    // follow the chain while it stays contiguous (the FAT is in memory, this is cheap)
+    unsigned int start = it->next_cluster;
+    unsigned int last = start;
+    unsigned int count = 1;
+    unsigned int next = read_fat_entry(last);
+    while (count < max_run && next == last + 1) {
+        last = next;
+        count++;
+        next = read_fat_entry(last);
+    }
+
+    it->visited += count;
+    if (it->visited > get_total_clusters()) {
+        // more clusters than the volume has, the chain loops
+        it->error = 1;
+        return 0;
+    }
+
+    long long offset = cluster_offset(start);
+    size_t len = (size_t)count * bytes;
+    TRACE_NOTE_DIR(offset, len);
+    if (g_fs_state.image_map != NULL) {
+        it->data = image_map_range(offset, len);
+        if (it->data == NULL) {
+            it->error = 1;
+            return 0;
+        }
+    } else {
+        if (bcache_read(offset, it->buf, len) != 0) {
+            it->error = 1;
+            return 0;
+        }
+        it->data = it->buf;
+    }
+
+    // get the kernel going on the cluster we'll want next
+    if (valid_cluster(next)) {
+        image_prefetch(cluster_offset(next), bytes);
+    }
+
+    it->next_cluster = next;
+    it->run_offset = offset;
+    it->run_cluster = start;
+    it->run_entries = (unsigned int)(len / sizeof(DIR_ENTRY));
+    it->pos = 0;
+    return 1;
+}
+
+int dir_iter_open(DIR_ITER *it, unsigned int cluster) {
+    memset(it, 0, sizeof(DIR_ITER));
+    // ".." of a top level directory says 0, which means the root
+    it->next_cluster = cluster < 2 ? g_fs_state.fs_bpb.BPB_RootClus : cluster;
+
+    if (g_fs_state.image_map == NULL) {
+        unsigned int bytes = cluster_bytes();
+        it->buf_size = bytes > DIR_ITER_RUN_BYTES ? bytes : (DIR_ITER_RUN_BYTES / bytes) * bytes;
+        it->buf = (unsigned char *)malloc(it->buf_size);
+        if (!it->buf) return 1;
+    }
+    return 0;
+}
+
+// LONG NAMES -----------------------------------------
+
+unsigned char lfn_checksum(const unsigned char *short_name) {
+    unsigned char sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = (unsigned char)(((sum & 1) << 7) + (sum >> 1) + short_name[i]);
+    }
+    return sum;
+}
+
+// takes one LFN part. parts come last first, a part that doesn't continue the sequence drops it
+static void lfn_take(DIR_ITER *it, const LFN_ENTRY *part) {
+    unsigned int ord = part->LDIR_Ord & LFN_ORD_MASK;
+    if (part->LDIR_Ord & LFN_LAST_ENTRY) {
+        if (ord == 0 || ord > LFN_MAX_PARTS) {
+            it->lfn_parts = 0;
+            return;
+        }
+        it->lfn_parts = ord;
+        it->lfn_expect = ord;
+        it->lfn_checksum = part->LDIR_Chksum;
+    } else if (it->lfn_parts == 0 || ord != it->lfn_expect || part->LDIR_Chksum != it->lfn_checksum) {
+        it->lfn_parts = 0;
+        return;
+    }
+
+    unsigned short *chars = it->lfn_chars + (ord - 1) * LFN_PART_CHARS;
+    memcpy(chars, part->LDIR_Name1, sizeof(part->LDIR_Name1));
+    memcpy(chars + 5, part->LDIR_Name2, sizeof(part->LDIR_Name2));
+    memcpy(chars + 11, part->LDIR_Name3, sizeof(part->LDIR_Name3));
+    it->lfn_expect = ord - 1;
+}
+
+// UTF-16 up to the first 0 as UTF-8, unpaired surrogates become '?'
+static void utf16_to_utf8(const unsigned short *in, unsigned int count, char *out) {
+    unsigned char *o = (unsigned char *)out;
+    for (unsigned int i = 0; i < count && in[i] != 0; i++) {
+        unsigned int c = in[i];
+        if (c >= 0xD800 && c < 0xDC00 && i + 1 < count && in[i + 1] >= 0xDC00 && in[i + 1] < 0xE000) {
+            c = 0x10000 + ((c - 0xD800) << 10) + (in[++i] - 0xDC00);
+        } else if (c >= 0xD800 && c < 0xE000) {
+            c = '?';
+        }
+
+        if (c < 0x80) {
+            *o++ = (unsigned char)c;
+        } else if (c < 0x800) {
+            *o++ = (unsigned char)(0xC0 | (c >> 6));
+            *o++ = (unsigned char)(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            *o++ = (unsigned char)(0xE0 | (c >> 12));
+            *o++ = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+            *o++ = (unsigned char)(0x80 | (c & 0x3F));
+        } else {
+            *o++ = (unsigned char)(0xF0 | (c >> 18));
+            *o++ = (unsigned char)(0x80 | ((c >> 12) & 0x3F));
+            *o++ = (unsigned char)(0x80 | ((c >> 6) & 0x3F));
+            *o++ = (unsigned char)(0x80 | (c & 0x3F));
+        }
+    }
+    *o = '\0';
+}
+
+// an 8.3 entry ends the sequence in front of it, which names it if all of it is there
+// and the checksum matches
+static void lfn_finish(DIR_ITER *it, const DIR_ENTRY *entry) {
+    it->long_name[0] = '\0';
+    if (it->lfn_parts != 0 && it->lfn_expect == 0 && lfn_checksum(entry->DIR_Name) == it->lfn_checksum) {
+        unsigned int count = it->lfn_parts * LFN_PART_CHARS;
+        if (count > LFN_MAX_CHARS) count = LFN_MAX_CHARS;
+        utf16_to_utf8(it->lfn_chars, count, it->long_name);
+    }
+    it->lfn_parts = 0;
+}
+
+// ITERATOR -----------------------------------------
+
+DIR_ENTRY *dir_iter_next(DIR_ITER *it) {
+    if (it->at_end || it->error) return NULL;
+    if (it->pos >= it->run_entries && !load_run(it)) return NULL;
+
+    unsigned int per_cluster = cluster_bytes() / sizeof(DIR_ENTRY);
+    DIR_ENTRY *entry = (DIR_ENTRY *)(it->data + (size_t)it->pos * sizeof(DIR_ENTRY));
+    it->cluster = it->run_cluster + it->pos / per_cluster;
+    it->index = it->pos % per_cluster;
+    it->offset = (long)(it->run_offset + (long long)it->pos * sizeof(DIR_ENTRY));
+    it->pos++;
+
+    // end of directory, nothing after it is in use
+    if (entry->DIR_Name[0] == 0x00) {
+        it->at_end = 1;
+        return NULL;
+    }
+
+    if (entry->DIR_Name[0] == 0xE5) {
+        it->lfn_parts = 0; // a deleted entry breaks up any sequence
+    } else if ((entry->DIR_Attr & ATTR_LFN) == ATTR_LFN) {
+        lfn_take(it, (const LFN_ENTRY *)entry);
+    } else {
+        lfn_finish(it, entry);
+    }
+    return entry;
+}
+
+DIR_ENTRY *dir_iter_next_live(DIR_ITER *it) {
+    DIR_ENTRY *entry;
+    while ((entry = dir_iter_next(it)) != NULL) {
+        if (entry->DIR_Name[0] == 0xE5) continue;
+        if ((entry->DIR_Attr & ATTR_LFN) == ATTR_LFN) continue;
+        if (entry->DIR_Attr & ATTR_VOLUME_ID) continue;
+        return entry;
+    }
+    return NULL;
+}
+
+void dir_iter_close(DIR_ITER *it) {
+    free(it->buf);
+    it->buf = NULL;
+    it->data = NULL;
+}
@@ -1,17 +1,30 @@
+#define _GNU_SOURCE // pread/pwrite, preadv/pwritev, mmap
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
 #include "structs.h" 
 #include "commands.h" 
+#include "block_cache.h"
+#include "readahead.h"
+#include "journal.h"
+#include "stats.h"
+#include "trace.h"
 
 //global state variable
 FS_STATE g_fs_state; 
 
 //PART ONE:
 
-unsigned int load_bpb_and_init_state(const char *image_name, FILE *fp) {
+unsigned int load_bpb_and_init_state(const char *image_name, int fd) {
     //store initial state info
-    g_fs_state.image_fp = fp;
+    g_fs_state.image_fd = fd;
     strncpy(g_fs_state.image_name, image_name, sizeof(g_fs_state.image_name) - 1);
     
     //initialize current path to root
@@ -19,12 +32,7 @@ unsigned int load_bpb_and_init_state(const char *image_name, FILE *fp) {
     g_fs_state.current_path[1] = '\0'; 
 
     //read the BPB
-    if (fseek(fp, 0, SEEK_SET) != 0) {
-        fprintf(stderr, "Fatal Error: Failed to seek to start of image.\n");
-        return 1; // Error
-    }
-
-    if (fread(&g_fs_state.fs_bpb, sizeof(BPB), 1, fp) != 1) {
+    if (image_read(0, &g_fs_state.fs_bpb, sizeof(BPB)) != 0) {
         fprintf(stderr, "Error: Failed to read the entire BPB structure.\n");
         return 1;
     }
@@ -38,6 +46,23 @@ unsigned int load_bpb_and_init_state(const char *image_name, FILE *fp) {
     //init current cluster to root
     g_fs_state.current_cluster = g_fs_state.fs_bpb.BPB_RootClus; 
 
+    //finish whatever metadata the last session committed but never wrote in place
+    if (journal_open(image_name) != 0) {
+        return 1;
+    }
+
+    //sector cache that all directory and data I/O goes through
+    bcache_init(g_fs_state.fs_bpb.BPB_BytsPerSec, BCACHE_DEFAULT_BYTES);
+
+    //keep the FAT in memory if it fits (falls back to per-entry disk reads)
+    load_fat_table();
+
+    //build the free cluster bitmap, seeded from the FSInfo hint
+    load_free_map();
+
+    //background prefetch for files read sequentially
+    readahead_init((size_t)g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus);
+
     //init open file table
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
         g_fs_state.open_file_table[i].is_used = 0;
@@ -47,9 +72,786 @@ unsigned int load_bpb_and_init_state(const char *image_name, FILE *fp) {
     return 0;
 }
 
+//maps the whole image into memory so reads and writes become plain memory access.
+//call before load_bpb_and_init_state. returns 0 on success
+int image_mmap(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        return 1;
+    }
+
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return 1;
+    }
+
+    g_fs_state.image_map = (unsigned char *)map;
+    g_fs_state.image_size = (size_t)st.st_size;
+    return 0;
+}
+
+//syncs and removes the mapping
+void image_munmap() {
+    if (g_fs_state.image_map == NULL) return;
+    image_sync();
+    munmap(g_fs_state.image_map, g_fs_state.image_size);
+    g_fs_state.image_map = NULL;
+    g_fs_state.image_size = 0;
+}
+
+//pushes everything written so far out to the image file
+//(pwrite has nothing buffered in user space, only the mapping needs it)
+void image_sync() {
+    if (g_fs_state.image_map != NULL) {
+        if (msync(g_fs_state.image_map, g_fs_state.image_size, MS_SYNC) != 0) {
+            perror("Error syncing image mapping");
+        }
+    }
+}
+
+//pointer straight into the mapped image, NULL if not mapped or out of range
+unsigned char *image_map_range(long long offset, size_t len) {
+    if (g_fs_state.image_map == NULL || offset < 0 || (unsigned long long)offset + len > g_fs_state.image_size) {
+        return NULL;
+    }
+    return g_fs_state.image_map + offset;
+}
+
+//hints that a range of the image is about to be read so the kernel can start fetching it
+void image_prefetch(long long offset, size_t len) {
+    if (len == 0 || offset < 0) return;
+    if (g_fs_state.image_map != NULL) {
+        //madvise wants a page aligned start
+        long page = sysconf(_SC_PAGESIZE);
+        long long start = offset - offset % page;
+        if ((unsigned long long)offset + len > g_fs_state.image_size) return;
+        madvise(g_fs_state.image_map + start, (size_t)(offset - start) + len, MADV_WILLNEED);
+    } else if (g_fs_state.image_fd >= 0) {
+        posix_fadvise(g_fs_state.image_fd, offset, (off_t)len, POSIX_FADV_WILLNEED);
+    }
+}
+
+//finishes a positional transfer that the kernel only partly did (short read/write or EINTR).
+//iov[0..iovcnt) starting done bytes in. returns 0 once everything is transferred
+static int finish_transfer(struct iovec *iov, int iovcnt, long long offset, size_t done, int write) {
+    for (int i = 0; i < iovcnt; i++) {
+        if (done >= iov[i].iov_len) {
+            done -= iov[i].iov_len;
+            offset += (long long)iov[i].iov_len;
+            continue;
+        }
+
+        unsigned char *p = (unsigned char *)iov[i].iov_base + done;
+        size_t left = iov[i].iov_len - done;
+        offset += (long long)done;
+        done = 0;
+
+        while (left > 0) {
+            ssize_t n = write ? pwrite(g_fs_state.image_fd, p, left, offset)
+                              : pread(g_fs_state.image_fd, p, left, offset);
+            if (write) g_fs_state.io_stats.write_calls++;
+            else g_fs_state.io_stats.read_calls++;
+
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return 1; // error, or EOF in the middle of a read
+            if (write) g_fs_state.io_stats.bytes_written += (unsigned long long)n;
+            else g_fs_state.io_stats.bytes_read += (unsigned long long)n;
+            p += n;
+            left -= (size_t)n;
+            offset += n;
+        }
+    }
+    return 0;
+}
+
+//one positional syscall for a list of buffers that are back to back in the image
+static int transfer_iov_untraced(struct iovec *iov, int iovcnt, long long offset, int write) {
+    if (write) readahead_invalidate();
+#ifdef FS_INSTRUMENT
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+    STAT_ACCESS(offset, total, write);
+#endif
+
+    if (g_fs_state.image_map != NULL) {
+        for (int i = 0; i < iovcnt; i++) {
+            unsigned char *mapped = image_map_range(offset, iov[i].iov_len);
+            if (mapped == NULL) return 1;
+            if (write) memcpy(mapped, iov[i].iov_base, iov[i].iov_len);
+            else memcpy(iov[i].iov_base, mapped, iov[i].iov_len);
+            offset += (long long)iov[i].iov_len;
+        }
+        return 0;
+    }
+
+    ssize_t n;
+    if (iovcnt == 1) {
+        n = write ? pwrite(g_fs_state.image_fd, iov[0].iov_base, iov[0].iov_len, offset)
+                  : pread(g_fs_state.image_fd, iov[0].iov_base, iov[0].iov_len, offset);
+    } else {
+        n = write ? pwritev(g_fs_state.image_fd, iov, iovcnt, offset)
+                  : preadv(g_fs_state.image_fd, iov, iovcnt, offset);
+    }
+
+    if (write) g_fs_state.io_stats.write_calls++;
+    else g_fs_state.io_stats.read_calls++;
+
+    if (n < 0) {
+        if (errno != EINTR) return 1;
+        n = 0;
+    }
+    if (write) g_fs_state.io_stats.bytes_written += (unsigned long long)n;
+    else g_fs_state.io_stats.bytes_read += (unsigned long long)n;
+
+    return finish_transfer(iov, iovcnt, offset, (size_t)n, write);
+}
+
+static int transfer_iov(struct iovec *iov, int iovcnt, long long offset, int write) {
+    long long start = TRACE_CLOCK();
+    int result = transfer_iov_untraced(iov, iovcnt, offset, write);
+    if (start != 0) {
+        size_t total = 0;
+        for (int i = 0; i < iovcnt; i++) total += iov[i].iov_len;
+        trace_io(start, offset, total, write, 0);
+    }
+    return result;
+}
+
+//reads len bytes at a byte offset in the image. returns 0 on success
+int image_read(long long offset, void *buf, size_t len) {
+    struct iovec iov = { buf, len };
+    return transfer_iov(&iov, 1, offset, 0);
+}
+
+//same as image_read but without touching the I/O counters, so worker threads can call it.
+//returns 0 on success
+int image_pread(long long offset, void *buf, size_t len) {
+    if (g_fs_state.image_map != NULL) {
+        unsigned char *p = image_map_range(offset, len);
+        if (p == NULL) return 1;
+        memcpy(buf, p, len);
+        return 0;
+    }
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = pread(g_fs_state.image_fd, (unsigned char *)buf + done, len - done, offset + (long long)done);
+        if (n <= 0) return 1;
+        done += (size_t)n;
+    }
+    return 0;
+}
+
+//writes len bytes at a byte offset in the image. returns 0 on success
+int image_write(long long offset, const void *buf, size_t len) {
+    struct iovec iov = { (void *)buf, len };
+    return transfer_iov(&iov, 1, offset, 1);
+}
+
+//copies len bytes at offset in the image straight to out_fd inside the kernel.
+//returns the bytes sent, which is less than len (maybe 0) if out_fd can't take sendfile,
+//then the caller copies the rest itself. -1 on a real I/O error
+long long image_sendfile(int out_fd, long long offset, size_t len) {
+    if (g_fs_state.image_map != NULL || g_fs_state.image_fd < 0) return 0;
+    STAT_ACCESS(offset, len, 0);
+    long long start = TRACE_CLOCK();
+
+    off_t pos = (off_t)offset;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = sendfile(out_fd, g_fs_state.image_fd, &pos, len - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) break; // out_fd doesn't support it
+        if (n < 0) return -1;
+        g_fs_state.io_stats.read_calls++;
+        g_fs_state.io_stats.bytes_read += (unsigned long long)n;
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    TRACE_IO(start, offset, done, 0);
+    return (long long)done;
+}
+
+//copies len bytes of the image at offset to host_fd (at its file position) inside the kernel,
+//copy_file_range first, then sendfile if the two files can't do that.
+//returns the bytes copied, less than len if neither works (the caller copies the rest). -1 on I/O error
+long long image_copy_out(int host_fd, long long offset, size_t len) {
+    if (g_fs_state.image_map != NULL || g_fs_state.image_fd < 0) return 0;
+    STAT_ACCESS(offset, len, 0);
+    long long start = TRACE_CLOCK();
+
+    loff_t pos = (loff_t)offset;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = copy_file_range(g_fs_state.image_fd, &pos, host_fd, NULL, len - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) break;
+        if (n < 0) return -1;
+        g_fs_state.io_stats.read_calls++;
+        g_fs_state.io_stats.bytes_read += (unsigned long long)n;
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    // whatever sendfile copies of the rest it traces itself
+    TRACE_IO(start, offset, done, 0);
+    if (done == len) return (long long)done;
+
+    long long sent = image_sendfile(host_fd, offset + (long long)done, len - done);
+    if (sent < 0) return -1;
+    return (long long)done + sent;
+}
+
+//copies len bytes from host_fd (at its file position) into the image at offset with copy_file_range.
+//returns the bytes copied, less than len if the files can't do that or host_fd ran out. -1 on I/O error
+long long image_copy_in(int host_fd, long long offset, size_t len) {
+    if (g_fs_state.image_map != NULL || g_fs_state.image_fd < 0) return 0;
+    readahead_invalidate();
+    STAT_ACCESS(offset, len, 1);
+    long long start = TRACE_CLOCK();
+
+    loff_t pos = (loff_t)offset;
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = copy_file_range(host_fd, NULL, g_fs_state.image_fd, &pos, len - done, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)) break;
+        if (n < 0) return -1;
+        g_fs_state.io_stats.write_calls++;
+        g_fs_state.io_stats.bytes_written += (unsigned long long)n;
+        if (n == 0) break;
+        done += (size_t)n;
+    }
+    TRACE_IO(start, offset, done, 1);
+    return (long long)done;
+}
+
+static int compare_segments(const void *a, const void *b) {
+    unsigned int sa = ((const IO_SEGMENT *)a)->sector;
+    unsigned int sb = ((const IO_SEGMENT *)b)->sector;
+    return (sa > sb) - (sa < sb);
+}
+
+//sorts the segments by sector and does one preadv/pwritev per run of back to back segments
+static int transfer_segments(IO_SEGMENT *segs, int nsegs, int write) {
+    unsigned int bytes_per_sector = g_fs_state.fs_bpb.BPB_BytsPerSec;
+    struct iovec iov[IO_MAX_IOV];
+
+    qsort(segs, nsegs, sizeof(IO_SEGMENT), compare_segments);
+
+    int i = 0;
+    while (i < nsegs) {
+        int n = 0;
+        unsigned int next_sector = segs[i].sector;
+        long long offset = (long long)segs[i].sector * bytes_per_sector;
+
+        while (i < nsegs && n < IO_MAX_IOV && segs[i].sector == next_sector) {
+            iov[n].iov_base = segs[i].buf;
+            iov[n].iov_len = (size_t)segs[i].count * bytes_per_sector;
+            next_sector = segs[i].sector + segs[i].count;
+            n++;
+            i++;
+        }
+
+        g_fs_state.io_stats.segments_merged += (unsigned long)(n - 1);
+        if (transfer_iov(iov, n, offset, write) != 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+//vectored read: fills every (sector, count, buf) segment, merging back to back segments
+//into single syscalls. the array is sorted by sector. returns 0 on success
+int image_readv(IO_SEGMENT *segs, int nsegs) {
+    return transfer_segments(segs, nsegs, 0);
+}
+
+//vectored write, same rules as image_readv
+int image_writev(IO_SEGMENT *segs, int nsegs) {
+    return transfer_segments(segs, nsegs, 1);
+}
+
+//first sector of FAT copy n
+static unsigned int fat_copy_sector(unsigned int n) {
+    return g_fs_state.fs_bpb.BPB_RsvdSecCnt + n * g_fs_state.fs_bpb.BPB_FATSz32;
+}
+
+//1 when every FAT copy is kept up to date (BPB_ExtFlags bit 7 clear)
+int fat_mirrored() {
+    return !(g_fs_state.fs_bpb.BPB_ExtFlags & EXT_FLAGS_NO_MIRROR);
+}
+
+//the FAT reads come from: FAT 0 while mirrored, otherwise the one BPB_ExtFlags names
+unsigned int active_fat() {
+    if (fat_mirrored()) return 0;
+    unsigned int n = g_fs_state.fs_bpb.BPB_ExtFlags & EXT_FLAGS_ACTIVE_FAT;
+    return n < g_fs_state.fs_bpb.BPB_NumFATs ? n : 0;
+}
+
+//reads the whole FAT into one array so lookups don't have to touch the disk
+void load_fat_table() {
+    unsigned int bytes_per_sector = g_fs_state.fs_bpb.BPB_BytsPerSec;
+    unsigned int fat_sectors = g_fs_state.fs_bpb.BPB_FATSz32;
+    unsigned long long fat_bytes = (unsigned long long)fat_sectors * bytes_per_sector;
+
+    g_fs_state.fat_table = NULL;
+    g_fs_state.fat_dirty = NULL;
+    g_fs_state.fat_entries = 0;
+
+    if (fat_bytes == 0 || fat_bytes > FAT_RESIDENT_MAX_BYTES) {
+        return; // too big, use the disk path
+    }
+
+    unsigned int *table = (unsigned int *)malloc((size_t)fat_bytes);
+    unsigned char *dirty = (unsigned char *)calloc(fat_sectors, 1);
+    if (!table || !dirty) {
+        free(table);
+        free(dirty);
+        return;
+    }
+
+    long fat_offset = get_sector_offset(fat_copy_sector(active_fat()));
+    if (image_read(fat_offset, table, (size_t)fat_bytes) != 0) {
+        fprintf(stderr, "Warning: Failed to load FAT into memory, reading entries from disk.\n");
+        free(table);
+        free(dirty);
+        return;
+    }
+
+    g_fs_state.fat_table = table;
+    g_fs_state.fat_dirty = dirty;
+    g_fs_state.fat_entries = (unsigned int)(fat_bytes / 4);
+}
+
+//writes FAT sectors (numbered within one FAT copy) to every FAT copy in one pass, or only to
+//the active one when mirroring is off. the segments get sorted by sector, so back to back
+//sectors share a syscall. returns 0 on success
+static int write_fat_sectors(const unsigned int *sectors, unsigned char **bufs, unsigned int count) {
+    int mirrored = fat_mirrored();
+    unsigned int num_fats = mirrored ? g_fs_state.fs_bpb.BPB_NumFATs : 1;
+    if (!mirrored) g_fs_state.fat_mirror_stale = 1;
+
+    IO_SEGMENT *segs = (IO_SEGMENT *)malloc((size_t)count * num_fats * sizeof(IO_SEGMENT));
+    if (!segs) {
+        fprintf(stderr, "Error: Memory allocation failed while flushing the FAT\n");
+        return 1;
+    }
+
+    int n = 0;
+    for (unsigned int i = 0; i < num_fats; i++) {
+        for (unsigned int k = 0; k < count; k++) {
+            segs[n].sector = fat_copy_sector(mirrored ? i : active_fat()) + sectors[k];
+            segs[n].count = 1;
+            segs[n].buf = bufs[k];
+            n++;
+        }
+    }
+
+    unsigned long calls_before = g_fs_state.io_stats.write_calls;
+    int status = image_writev(segs, n);
+    g_fs_state.io_stats.fat_write_calls += g_fs_state.io_stats.write_calls - calls_before;
+    free(segs);
+    return status;
+}
+
+//forgets the buffered sectors of a non-resident FAT
+static void drop_fat_buffers() {
+    for (unsigned int i = 0; i < g_fs_state.fat_buf_count; i++) {
+        free(g_fs_state.fat_bufs[i].data);
+    }
+    g_fs_state.fat_buf_count = 0;
+    if (g_fs_state.fat_buf_slots != NULL) {
+        memset(g_fs_state.fat_buf_slots, 0, g_fs_state.fat_buf_slot_count * sizeof(unsigned int));
+    }
+}
+
+//writes every dirty FAT sector back to all FAT copies, sorted by sector.
+//returns 0 once nothing dirty is left, 1 if some of it is still only in memory
+int flush_fat_table() {
+    if (g_fs_state.image_fd < 0) {
+        return 0;
+    }
+
+    //the sectors go to the journal before they overwrite anything
+    if (journal_commit() != 0) {
+        fprintf(stderr, "Error: FAT not written, the journal commit failed\n");
+        return 1;
+    }
+
+    unsigned int bytes_per_sector = g_fs_state.fs_bpb.BPB_BytsPerSec;
+    unsigned int fat_sectors = g_fs_state.fs_bpb.BPB_FATSz32;
+
+    //non-resident: the buffered sectors
+    if (g_fs_state.fat_table == NULL) {
+        unsigned int count = g_fs_state.fat_buf_count;
+        if (count == 0) return 0;
+
+        unsigned int *sectors = (unsigned int *)malloc(count * sizeof(unsigned int));
+        unsigned char **bufs = (unsigned char **)malloc(count * sizeof(unsigned char *));
+        if (!sectors || !bufs) {
+            fprintf(stderr, "Error: Memory allocation failed while flushing the FAT\n");
+            free(sectors);
+            free(bufs);
+            return 1;
+        }
+        for (unsigned int k = 0; k < count; k++) {
+            sectors[k] = g_fs_state.fat_bufs[k].sector;
+            bufs[k] = g_fs_state.fat_bufs[k].data;
+        }
+
+        int status = write_fat_sectors(sectors, bufs, count);
+        if (status != 0) {
+            fprintf(stderr, "Error: Failed to write FAT sectors\n");
+        } else {
+            drop_fat_buffers();
+        }
+        free(sectors);
+        free(bufs);
+        return status;
+    }
+
+    unsigned char *fat_bytes = (unsigned char *)g_fs_state.fat_table;
+    unsigned int dirty_count = 0;
+    for (unsigned int s = 0; s < fat_sectors; s++) {
+        if (g_fs_state.fat_dirty[s]) dirty_count++;
+    }
+    if (dirty_count == 0) return 0;
+
+    unsigned int *sectors = (unsigned int *)malloc(dirty_count * sizeof(unsigned int));
+    unsigned char **bufs = (unsigned char **)malloc(dirty_count * sizeof(unsigned char *));
+    if (!sectors || !bufs) {
+        fprintf(stderr, "Error: Memory allocation failed while flushing the FAT\n");
+        free(sectors);
+        free(bufs);
+        return 1;
+    }
+
+    unsigned int k = 0;
+    for (unsigned int s = 0; s < fat_sectors; s++) {
+        if (!g_fs_state.fat_dirty[s]) continue;
+        sectors[k] = s;
+        bufs[k] = fat_bytes + (size_t)s * bytes_per_sector;
+        k++;
+    }
+
+    int status = write_fat_sectors(sectors, bufs, dirty_count);
+    if (status != 0) {
+        fprintf(stderr, "Error: Failed to write FAT sectors\n");
+    } else {
+        memset(g_fs_state.fat_dirty, 0, fat_sectors);
+    }
+    free(sectors);
+    free(bufs);
+    return status;
+}
+
+//hands the FAT sectors changed since the last call to the journal, ahead of a commit
+void log_fat_changes() {
+    if (!g_fs_state.fat_unlogged) return;
+    g_fs_state.fat_unlogged = 0;
+    unsigned int bytes_per_sector = g_fs_state.fs_bpb.BPB_BytsPerSec;
+
+    if (g_fs_state.fat_table == NULL) {
+        for (unsigned int k = 0; k < g_fs_state.fat_buf_count; k++) {
+            FAT_SECTOR_BUF *buf = &g_fs_state.fat_bufs[k];
+            if (buf->logged) continue;
+            journal_log_fat_sector(buf->sector, buf->data, bytes_per_sector);
+            buf->logged = 1;
+        }
+        return;
+    }
+
+    unsigned char *fat_bytes = (unsigned char *)g_fs_state.fat_table;
+    for (unsigned int s = 0; s < g_fs_state.fs_bpb.BPB_FATSz32; s++) {
+        if (g_fs_state.fat_dirty[s] != 1) continue;
+        journal_log_fat_sector(s, fat_bytes + (size_t)s * bytes_per_sector, bytes_per_sector);
+        g_fs_state.fat_dirty[s] = 2;
+    }
+}
+
+//buffered copy of a FAT sector for a non-resident FAT. load = 1 reads it in (from the first
+//FAT) if it isn't buffered yet, flushing first when the buffers are full. NULL if not buffered
+static FAT_SECTOR_BUF *fat_sector_buffer(unsigned int sector, int load) {
+    if (g_fs_state.fat_buf_slots == NULL) {
+        if (!load) return NULL;
+        unsigned int max = FAT_DIRTY_MAX_BYTES / g_fs_state.fs_bpb.BPB_BytsPerSec;
+        unsigned int slots = 64;
+        while (slots < max * 2) slots *= 2;
+        g_fs_state.fat_bufs = (FAT_SECTOR_BUF *)malloc(max * sizeof(FAT_SECTOR_BUF));
+        g_fs_state.fat_buf_slots = (unsigned int *)calloc(slots, sizeof(unsigned int));
+        if (!g_fs_state.fat_bufs || !g_fs_state.fat_buf_slots) {
+            free(g_fs_state.fat_bufs);
+            free(g_fs_state.fat_buf_slots);
+            g_fs_state.fat_bufs = NULL;
+            g_fs_state.fat_buf_slots = NULL;
+            return NULL;
+        }
+        g_fs_state.fat_buf_max = max;
+        g_fs_state.fat_buf_slot_count = slots;
+        g_fs_state.fat_buf_count = 0;
+    }
+
+    unsigned int mask = g_fs_state.fat_buf_slot_count - 1;
+    unsigned int slot = (sector * 2654435761u) & mask;
+    while (g_fs_state.fat_buf_slots[slot] != 0) {
+        FAT_SECTOR_BUF *buf = &g_fs_state.fat_bufs[g_fs_state.fat_buf_slots[slot] - 1];
+        if (buf->sector == sector) return buf;
+        slot = (slot + 1) & mask;
+    }
+    if (!load) return NULL;
+
+    //full: write everything back and start over
+    if (g_fs_state.fat_buf_count == g_fs_state.fat_buf_max) {
+        if (flush_fat_table() != 0) return NULL; // flush failed, keep what we have
+        slot = (sector * 2654435761u) & mask;
+    }
+
+    unsigned int bytes_per_sector = g_fs_state.fs_bpb.BPB_BytsPerSec;
+    unsigned char *data = (unsigned char *)malloc(bytes_per_sector);
+    if (!data) return NULL;
+    long long offset = (long long)(fat_copy_sector(active_fat()) + sector) * bytes_per_sector;
+    if (image_read(offset, data, bytes_per_sector) != 0) {
+        free(data);
+        return NULL;
+    }
+
+    FAT_SECTOR_BUF *buf = &g_fs_state.fat_bufs[g_fs_state.fat_buf_count++];
+    buf->sector = sector;
+    buf->data = data;
+    buf->logged = 0;
+    g_fs_state.fat_buf_slots[slot] = g_fs_state.fat_buf_count;
+    return buf;
+}
+
+//releases the resident FAT
+void free_fat_table() {
+    free(g_fs_state.fat_table);
+    free(g_fs_state.fat_dirty);
+    g_fs_state.fat_table = NULL;
+    g_fs_state.fat_dirty = NULL;
+    g_fs_state.fat_entries = 0;
+
+    drop_fat_buffers();
+    free(g_fs_state.fat_bufs);
+    free(g_fs_state.fat_buf_slots);
+    g_fs_state.fat_bufs = NULL;
+    g_fs_state.fat_buf_slots = NULL;
+    g_fs_state.fat_buf_max = 0;
+    g_fs_state.fat_buf_slot_count = 0;
+}
+
+//number of 64 bit words in the free cluster bitmap
+static unsigned int free_map_words() {
+    return (get_total_clusters() + 2 + 63) / 64;
+}
+
+//marks a cluster as used or free in the bitmap and keeps the free count right
+static void update_free_map(unsigned int cluster_num, unsigned int value) {
+    if (g_fs_state.free_map == NULL || cluster_num < 2 || cluster_num >= get_total_clusters() + 2) {
+        return;
+    }
+
+    unsigned long long bit = 1ULL << (cluster_num % 64);
+    unsigned long long *word = &g_fs_state.free_map[cluster_num / 64];
+
+    if (value == 0 && (*word & bit)) {
+        *word &= ~bit;
+        g_fs_state.free_count++;
+    } else if (value != 0 && !(*word & bit)) {
+        *word |= bit;
+        g_fs_state.free_count--;
+    }
+}
+
+//reads the FSInfo sector and builds the free cluster bitmap from the FAT
+void load_free_map() {
+    unsigned int bytes_per_sector = g_fs_state.fs_bpb.BPB_BytsPerSec;
+    unsigned int max_cluster = get_total_clusters() + 2; // one past the last valid cluster
+    unsigned int words = free_map_words();
+
+    g_fs_state.free_map = NULL;
+    g_fs_state.free_count = 0;
+    g_fs_state.next_free = 2;
+    g_fs_state.fs_info_valid = 0;
+
+    //FSInfo is only a hint, but its next free cluster is a good place to start
+    if (g_fs_state.fs_bpb.BPB_FSInfo != 0 && g_fs_state.fs_bpb.BPB_FSInfo != 0xFFFF &&
+        image_read(get_sector_offset(g_fs_state.fs_bpb.BPB_FSInfo), &g_fs_state.fs_info, sizeof(FSINFO)) == 0 &&
+        g_fs_state.fs_info.FSI_LeadSig == FSI_LEAD_SIG &&
+        g_fs_state.fs_info.FSI_StrucSig == FSI_STRUC_SIG &&
+        g_fs_state.fs_info.FSI_TrailSig == FSI_TRAIL_SIG) {
+        g_fs_state.fs_info_valid = 1;
+        unsigned int hint = g_fs_state.fs_info.FSI_Nxt_Free;
+        if (hint >= 2 && hint < max_cluster) {
+            g_fs_state.next_free = hint;
+        }
+    }
+
+    unsigned long long *map = (unsigned long long *)malloc((size_t)words * sizeof(unsigned long long));
+    if (!map) {
+        return; // allocator falls back to scanning the FAT
+    }
+    //start with everything in use so bits past the last cluster are never handed out
+    memset(map, 0xFF, (size_t)words * sizeof(unsigned long long));
+
+    //clusters the FAT can actually describe
+    unsigned int fat_capacity = (unsigned int)(((unsigned long long)g_fs_state.fs_bpb.BPB_FATSz32 * bytes_per_sector) / 4);
+    if (max_cluster > fat_capacity) {
+        max_cluster = fat_capacity;
+    }
+
+    unsigned int free_count = 0;
+    if (g_fs_state.fat_table != NULL) {
+        for (unsigned int c = 2; c < max_cluster; c++) {
+            if ((g_fs_state.fat_table[c] & 0x0FFFFFFF) == 0) {
+                map[c / 64] &= ~(1ULL << (c % 64));
+                free_count++;
+            }
+        }
+    } else {
+        //FAT isn't resident, stream it from disk in large chunks instead
+        unsigned int chunk_entries = 16384;
+        unsigned int *chunk = (unsigned int *)malloc(chunk_entries * sizeof(unsigned int));
+        if (!chunk) {
+            free(map);
+            return;
+        }
+        long fat_start = get_sector_offset(fat_copy_sector(active_fat()));
+        for (unsigned int base = 0; base < max_cluster; base += chunk_entries) {
+            unsigned int count = max_cluster - base;
+            if (count > chunk_entries) count = chunk_entries;
+            if (image_read(fat_start + (long)base * 4, chunk, (size_t)count * sizeof(unsigned int)) != 0) {
+                free(chunk);
+                free(map);
+                return;
+            }
+            for (unsigned int i = 0; i < count; i++) {
+                unsigned int c = base + i;
+                if (c >= 2 && (chunk[i] & 0x0FFFFFFF) == 0) {
+                    map[c / 64] &= ~(1ULL << (c % 64));
+                    free_count++;
+                }
+            }
+        }
+        free(chunk);
+    }
+
+    g_fs_state.free_map = map;
+    g_fs_state.free_count = free_count;
+}
+
+//writes the updated free count and next free hint back to the FSInfo sector
+void write_fsinfo() {
+    if (!g_fs_state.fs_info_valid || g_fs_state.free_map == NULL || g_fs_state.image_fd < 0) {
+        return;
+    }
+
+    g_fs_state.fs_info.FSI_Free_Count = g_fs_state.free_count;
+    g_fs_state.fs_info.FSI_Nxt_Free = g_fs_state.next_free;
+
+    if (image_write(get_sector_offset(g_fs_state.fs_bpb.BPB_FSInfo), &g_fs_state.fs_info, sizeof(FSINFO)) != 0) {
+        fprintf(stderr, "Error: Failed to write FSInfo sector\n");
+        return;
+    }
+}
+
+//writes BPB_ExtFlags to the boot sector and its backup
+static int write_ext_flags() {
+    long field = (long)((unsigned char *)&g_fs_state.fs_bpb.BPB_ExtFlags - (unsigned char *)&g_fs_state.fs_bpb);
+    unsigned short flags = g_fs_state.fs_bpb.BPB_ExtFlags;
+
+    if (image_write(field, &flags, sizeof(flags)) != 0) return 1;
+    unsigned int backup = g_fs_state.fs_bpb.BPB_BkBootSec;
+    if (backup != 0 && backup < g_fs_state.fs_bpb.BPB_RsvdSecCnt &&
+        image_write(get_sector_offset(backup) + field, &flags, sizeof(flags)) != 0) {
+        return 1;
+    }
+    return 0;
+}
+
+//-n mount option: turns mirroring off on disk so FAT writes only go to the active FAT.
+//the other copies are brought back in line by resync_fat_mirrors at unmount.
+//if we die before that, the flags on disk still say which FAT is the good one
+int defer_fat_mirrors() {
+    if (g_fs_state.fs_bpb.BPB_NumFATs < 2 || !fat_mirrored()) {
+        return 0; // nothing to mirror
+    }
+
+    //flush first so everything before this point made it into every copy
+    if (flush_fat_table() != 0) return 1;
+
+    g_fs_state.saved_ext_flags = g_fs_state.fs_bpb.BPB_ExtFlags;
+    g_fs_state.fs_bpb.BPB_ExtFlags = (unsigned short)((g_fs_state.fs_bpb.BPB_ExtFlags & ~EXT_FLAGS_ACTIVE_FAT) |
+                                                      EXT_FLAGS_NO_MIRROR); // FAT 0 stays active
+    if (write_ext_flags() != 0) {
+        fprintf(stderr, "Error: Failed to update BPB_ExtFlags\n");
+        g_fs_state.fs_bpb.BPB_ExtFlags = g_fs_state.saved_ext_flags;
+        return 1;
+    }
+    g_fs_state.fat_mirror_deferred = 1;
+    g_fs_state.fat_mirror_stale = 0;
+    return 0;
+}
+
+//copies the active FAT over the other copies in one sequential pass, then turns mirroring
+//back on. call after the last flush_fat_table
+void resync_fat_mirrors() {
+    if (!g_fs_state.fat_mirror_deferred) return;
+
+    unsigned int bytes_per_sector = g_fs_state.fs_bpb.BPB_BytsPerSec;
+    unsigned long long fat_bytes = (unsigned long long)g_fs_state.fs_bpb.BPB_FATSz32 * bytes_per_sector;
+    unsigned int active = active_fat();
+    long long src = (long long)fat_copy_sector(active) * bytes_per_sector;
+    unsigned long calls_before = g_fs_state.io_stats.write_calls;
+    int failed = 0;
+
+    if (g_fs_state.fat_mirror_stale) {
+        //the resident FAT is already the active copy, otherwise stream it through a buffer
+        size_t chunk_size = 1024 * 1024;
+        unsigned char *chunk = g_fs_state.fat_table == NULL ? (unsigned char *)malloc(chunk_size) : NULL;
+        if (g_fs_state.fat_table == NULL && !chunk) {
+            fprintf(stderr, "Error: Memory allocation failed while resyncing the FAT copies\n");
+            return; // leave mirroring off, the active FAT is still right
+        }
+
+        for (unsigned int i = 0; i < g_fs_state.fs_bpb.BPB_NumFATs && !failed; i++) {
+            if (i == active) continue;
+            long long dst = (long long)fat_copy_sector(i) * bytes_per_sector;
+            if (g_fs_state.fat_table != NULL) {
+                failed = image_write(dst, g_fs_state.fat_table, (size_t)fat_bytes) != 0;
+                continue;
+            }
+            for (unsigned long long done = 0; done < fat_bytes && !failed; done += chunk_size) {
+                size_t n = fat_bytes - done < chunk_size ? (size_t)(fat_bytes - done) : chunk_size;
+                failed = image_read(src + (long long)done, chunk, n) != 0 ||
+                         image_write(dst + (long long)done, chunk, n) != 0;
+            }
+        }
+        free(chunk);
+    }
+    g_fs_state.io_stats.fat_write_calls += g_fs_state.io_stats.write_calls - calls_before;
+
+    if (failed) {
+        fprintf(stderr, "Error: Failed to resync the FAT copies, mirroring stays off\n");
+        return;
+    }
+
+    g_fs_state.fs_bpb.BPB_ExtFlags = g_fs_state.saved_ext_flags;
+    if (write_ext_flags() != 0) {
+        fprintf(stderr, "Error: Failed to update BPB_ExtFlags\n");
+    }
+    g_fs_state.fat_mirror_deferred = 0;
+    g_fs_state.fat_mirror_stale = 0;
+}
+
+//releases the free cluster bitmap
+void free_free_map() {
+    free(g_fs_state.free_map);
+    g_fs_state.free_map = NULL;
+}
+
 //calculates the byte offset for any given sector number
 long get_sector_offset(unsigned int sector_num) {
-    // Cast to long long for robust multiplication, then cast to long for fseek
+    // Cast to long long for robust multiplication
     return (long long)sector_num * g_fs_state.fs_bpb.BPB_BytsPerSec;
 }
 
@@ -69,6 +871,36 @@ unsigned int get_total_clusters() {
 
 //PART TWO:
 
+//get formatted name for ls
+void get_formatted_name(unsigned char *raw_name, char *out_name) {
+    char name[9];
+    char ext[4];
+    
+    // clean name
+    strncpy(name, (char*)raw_name, 8);
+    name[8] = '\0';
+    for(int i=7; i>=0; i--) {
+        if(name[i] == ' ') name[i] = '\0';
+        else break;
+    }
+    
+    // clean extension
+    strncpy(ext, (char*)raw_name + 8, 3);
+    ext[3] = '\0';
+    for(int i=2; i>=0; i--) {
+        if(ext[i] == ' ') ext[i] = '\0';
+        else break;
+    }
+    
+    //format output
+    if (strlen(ext) > 0) {
+        sprintf(out_name, "%s.%s", name, ext);
+    } else {
+        strcpy(out_name, name);
+    }
+}
+
+
 // translates a logical cluster number (N) to the physical first  sector
 unsigned int get_cluster_sector(unsigned int cluster_num) {
     unsigned int first_data_sector = get_first_data_sector();
@@ -84,26 +916,38 @@ unsigned int get_cluster_sector(unsigned int cluster_num) {
 unsigned int read_fat_entry(unsigned int cluster_num) {
     unsigned int fat_offset, fat_sector, ent_offset;
     unsigned int next_cluster;
+    STAT_INC(fat_lookups);
+
+    //resident FAT = just an array lookup
+    if (g_fs_state.fat_table != NULL) {
+        if (cluster_num >= g_fs_state.fat_entries) {
+            return 0x0FFFFFFF;
+        }
+        return g_fs_state.fat_table[cluster_num] & 0x0FFFFFFF;
+    }
 
     //calc fat offset
     fat_offset = cluster_num * 4;
 
-    //calc which sector of the FAT contains this entry
-    fat_sector = g_fs_state.fs_bpb.BPB_RsvdSecCnt + (fat_offset / g_fs_state.fs_bpb.BPB_BytsPerSec);
-
     //calc byte offset within the sector
     ent_offset = fat_offset % g_fs_state.fs_bpb.BPB_BytsPerSec;
 
+    //changed and not written back yet = the buffered sector has it
+    FAT_SECTOR_BUF *buffered = fat_sector_buffer(fat_offset / g_fs_state.fs_bpb.BPB_BytsPerSec, 0);
+    if (buffered != NULL) {
+        memcpy(&next_cluster, buffered->data + ent_offset, sizeof(unsigned int));
+        return next_cluster & 0x0FFFFFFF;
+    }
+
+    //calc which sector of the FAT contains this entry
+    fat_sector = fat_copy_sector(active_fat()) + (fat_offset / g_fs_state.fs_bpb.BPB_BytsPerSec);
+
     //calc the exact byte offset in the image
     long long file_offset_ll = (long long)fat_sector * g_fs_state.fs_bpb.BPB_BytsPerSec + ent_offset;
 
     //read entry 
-    if (fseek(g_fs_state.image_fp, (long)file_offset_ll, SEEK_SET) != 0) {
-        fprintf(stderr, "Error: Failed to seek to FAT entry for cluster %u\n", cluster_num);
-        return 0x0FFFFFFF;
-    }
-
-    if (fread(&next_cluster, sizeof(unsigned int), 1, g_fs_state.image_fp) != 1) {
+    STAT_INC(fat_disk_lookups);
+    if (image_read(file_offset_ll, &next_cluster, sizeof(unsigned int)) != 0) {
         fprintf(stderr, "Error: Failed to read FAT entry for cluster %u\n", cluster_num);
         return 0x0FFFFFFF;
     }
@@ -117,7 +961,6 @@ unsigned int read_fat_entry(unsigned int cluster_num) {
 //writes 32 bit value to cluster number in FAT
 void write_fat_entry(unsigned int cluster_num, unsigned int value) {
     unsigned int fat_offset, fat_sector, ent_offset;
-    unsigned int fat_size_sectors = g_fs_state.fs_bpb.BPB_FATSz32;
 
     //only need 28 
     unsigned int masked_value = value & 0x0FFFFFFF;
@@ -125,10 +968,52 @@ void write_fat_entry(unsigned int cluster_num, unsigned int value) {
     // calc byte offeset
     fat_offset = cluster_num * 4;
 
+    //keep the free cluster bitmap in sync
+    update_free_map(cluster_num, masked_value);
+    g_fs_state.io_stats.fat_updates++;
+    STAT_INC(fat_updates);
+
+    //resident FAT = update the array and write the sector back later
+    if (g_fs_state.fat_table != NULL) {
+        if (cluster_num >= g_fs_state.fat_entries) {
+            fprintf(stderr, "Error: Cluster %u is outside the FAT\n", cluster_num);
+            return;
+        }
+        //keep the reserved top 4 bits as they are
+        g_fs_state.fat_table[cluster_num] = (g_fs_state.fat_table[cluster_num] & 0xF0000000) | masked_value;
+        g_fs_state.fat_dirty[fat_offset / g_fs_state.fs_bpb.BPB_BytsPerSec] = 1;
+        g_fs_state.fat_unlogged = 1;
+        return;
+    }
+
+    //otherwise change a buffered copy of the sector, it goes to every FAT copy at the next flush
+    FAT_SECTOR_BUF *buffered = fat_sector_buffer(fat_offset / g_fs_state.fs_bpb.BPB_BytsPerSec, 1);
+    if (buffered != NULL) {
+        unsigned int old_value;
+        ent_offset = fat_offset % g_fs_state.fs_bpb.BPB_BytsPerSec;
+        memcpy(&old_value, buffered->data + ent_offset, sizeof(unsigned int));
+        old_value = (old_value & 0xF0000000) | masked_value;
+        memcpy(buffered->data + ent_offset, &old_value, sizeof(unsigned int));
+        buffered->logged = 0;
+        g_fs_state.fat_unlogged = 1;
+        return;
+    }
+
+    //this write isn't journaled, so at least everything before it has to be committed
+    if (journal_commit() != 0) {
+        fprintf(stderr, "Error: Failed to write FAT entry for cluster %u\n", cluster_num);
+        return;
+    }
+
+    //no buffer to be had: straight to disk, one write per copy (just the active one if not mirrored)
+    int mirrored = fat_mirrored();
+    unsigned int copies = mirrored ? g_fs_state.fs_bpb.BPB_NumFATs : 1;
+    if (!mirrored) g_fs_state.fat_mirror_stale = 1;
+
     //loop through fat copies:
-    for (unsigned int i = 0; i < g_fs_state.fs_bpb.BPB_NumFATs; i++) {
+    for (unsigned int i = 0; i < copies; i++) {
         //calc which sector of the FAT contains this entry
-        fat_sector = g_fs_state.fs_bpb.BPB_RsvdSecCnt + (i * fat_size_sectors) + 
+        fat_sector = fat_copy_sector(mirrored ? i : active_fat()) +
         (fat_offset / g_fs_state.fs_bpb.BPB_BytsPerSec);
 
         //calc byte offset within the sector
@@ -138,24 +1023,47 @@ void write_fat_entry(unsigned int cluster_num, unsigned int value) {
         long long file_offset_ll = (long long)fat_sector * g_fs_state.fs_bpb.BPB_BytsPerSec + ent_offset;
 
         //write the value
-        if (fseek(g_fs_state.image_fp, (long)file_offset_ll, SEEK_SET) != 0) {
-            fprintf(stderr, "Error: Failed to seek to FAT entry for cluster %u\n", cluster_num);
-            return;
-        }
-
-        if (fwrite(&masked_value, sizeof(unsigned int), 1, g_fs_state.image_fp) != 1) {
+        g_fs_state.io_stats.fat_write_calls++;
+        if (image_write(file_offset_ll, &masked_value, sizeof(unsigned int)) != 0) {
             fprintf(stderr, "Error: Failed to write FAT entry for cluster %u\n", cluster_num);
             return;
         }
     }
 }
 
-//finds the first free cluster in the FAT
+//finds a free cluster, next-fit from the allocator cursor
 unsigned int get_free_cluster() {
     unsigned int total_clusters = get_total_clusters();
 
+    if (g_fs_state.free_map != NULL) {
+        if (g_fs_state.free_count == 0) {
+            return 0x0FFFFFFF;
+        }
+
+        unsigned int words = free_map_words();
+        unsigned int start = g_fs_state.next_free / 64;
+        if (start >= words) start = 0;
+
+        //one extra step so the part of the first word before the cursor is checked last
+        for (unsigned int i = 0; i <= words; i++) {
+            unsigned int w = (start + i) % words;
+            unsigned long long free_bits = ~g_fs_state.free_map[w];
+            if (i == 0) {
+                free_bits &= ~0ULL << (g_fs_state.next_free % 64);
+            }
+            if (free_bits != 0) {
+                unsigned int cluster_num = w * 64 + (unsigned int)__builtin_ctzll(free_bits);
+                g_fs_state.next_free = cluster_num + 1;
+                STAT_INC(allocations);
+                return cluster_num;
+            }
+        }
+        return 0x0FFFFFFF;
+    }
+
     for (unsigned int cluster_num = 2; cluster_num < total_clusters + 2; cluster_num++) {
         if (read_fat_entry(cluster_num) == 0) {
+            STAT_INC(allocations);
             return cluster_num;
         }
     }
@@ -163,6 +1071,159 @@ unsigned int get_free_cluster() {
     return 0x0FFFFFFF;
 }
 
+//checks the bitmap for a free cluster
+static int cluster_is_free(unsigned int cluster_num) {
+    return !((g_fs_state.free_map[cluster_num / 64] >> (cluster_num % 64)) & 1ULL);
+}
+
+//finds a free run of at least min_len clusters, next-fit from the allocator cursor.
+//if no run is that long the longest one is returned instead. returns the run length (0 = full)
+static unsigned int find_free_run(unsigned int min_len, unsigned int *run_start) {
+    unsigned int end = get_total_clusters() + 2;
+    unsigned int cursor = g_fs_state.next_free;
+    if (cursor < 2 || cursor >= end) cursor = 2;
+
+    unsigned int best_start = 0, best_len = 0;
+
+    //scan cursor..end first, then wrap around to 2..cursor
+    for (int pass = 0; pass < 2; pass++) {
+        unsigned int lo = (pass == 0) ? cursor : 2;
+        unsigned int hi = (pass == 0) ? end : cursor;
+        unsigned int c = lo;
+
+        while (c < hi) {
+            unsigned long long word = g_fs_state.free_map[c / 64];
+
+            //skip used clusters, a whole word at a time when possible
+            if (!cluster_is_free(c)) {
+                if (c % 64 == 0 && word == ~0ULL) c += 64;
+                else c++;
+                continue;
+            }
+
+            unsigned int start = c;
+            while (c < hi && cluster_is_free(c)) {
+                if (c % 64 == 0 && g_fs_state.free_map[c / 64] == 0 && c + 64 <= hi) c += 64;
+                else c++;
+            }
+
+            unsigned int len = c - start;
+            if (len >= min_len) {
+                *run_start = start;
+                return len;
+            }
+            if (len > best_len) {
+                best_start = start;
+                best_len = len;
+            }
+        }
+    }
+
+    *run_start = best_start;
+    return best_len;
+}
+
+//undoes a failed allocate_cluster_chain: frees what it linked and ends the old chain again
+static void unlink_partial_chain(unsigned int prev_cluster, unsigned int first_cluster) {
+    if (first_cluster == 0x0FFFFFFF) return; // nothing was linked
+    if (prev_cluster >= 2) write_fat_entry(prev_cluster, 0x0FFFFFFF);
+    free_cluster_chain(first_cluster);
+}
+
+//allocates count clusters in as few contiguous runs as possible and links them into one
+//chain, appended after prev_cluster when it isn't 0. num_runs (optional) gets the number of runs.
+//returns the first new cluster, or 0x0FFFFFFF if there isn't enough free space (nothing is
+//allocated then and prev_cluster still ends the chain)
+unsigned int allocate_cluster_chain(unsigned int count, unsigned int prev_cluster, unsigned int *num_runs) {
+    unsigned int first_cluster = 0x0FFFFFFF;
+    unsigned int tail = prev_cluster;
+    unsigned int runs = 0;
+
+    if (num_runs != NULL) *num_runs = 0;
+    if (count == 0) return 0x0FFFFFFF;
+
+    //no bitmap = fall back to one cluster at a time
+    if (g_fs_state.free_map == NULL) {
+        for (unsigned int i = 0; i < count; i++) {
+            unsigned int c = get_free_cluster();
+            if (c == 0 || c >= 0x0FFFFFF8) {
+                unlink_partial_chain(prev_cluster, first_cluster);
+                return 0x0FFFFFFF;
+            }
+            write_fat_entry(c, 0x0FFFFFFF);
+            if (tail >= 2) write_fat_entry(tail, c);
+            if (first_cluster == 0x0FFFFFFF) first_cluster = c;
+            if (tail + 1 != c) runs++;
+            tail = c;
+        }
+        if (num_runs != NULL) *num_runs = runs;
+        return first_cluster;
+    }
+
+    if (count > g_fs_state.free_count) {
+        return 0x0FFFFFFF;
+    }
+
+    unsigned int remaining = count;
+    unsigned int end = get_total_clusters() + 2;
+
+    while (remaining > 0) {
+        unsigned int run_start, run_len;
+
+        //growing a file: keep going right after its last cluster if we can
+        if (tail >= 2 && tail + 1 < end && cluster_is_free(tail + 1)) {
+            run_start = tail + 1;
+            run_len = 0;
+            while (run_start + run_len < end && run_len < remaining && cluster_is_free(run_start + run_len)) {
+                run_len++;
+            }
+        } else {
+            run_len = find_free_run(remaining, &run_start);
+            if (run_len == 0) {
+                unlink_partial_chain(prev_cluster, first_cluster);
+                return 0x0FFFFFFF;
+            }
+        }
+        if (run_len > remaining) run_len = remaining;
+
+        //link the run: each cluster points at the next, the last one is EOC for now
+        STAT_ADD(allocations, run_len);
+        for (unsigned int i = 0; i < run_len; i++) {
+            unsigned int c = run_start + i;
+            write_fat_entry(c, (i + 1 < run_len) ? c + 1 : 0x0FFFFFFF);
+        }
+        if (tail >= 2) {
+            write_fat_entry(tail, run_start);
+        }
+        if (first_cluster == 0x0FFFFFFF) {
+            first_cluster = run_start;
+        }
+        if (tail + 1 != run_start) {
+            runs++;
+        }
+
+        tail = run_start + run_len - 1;
+        remaining -= run_len;
+        g_fs_state.next_free = tail + 1;
+    }
+
+    if (num_runs != NULL) *num_runs = runs;
+    return first_cluster;
+}
+
+//gives every cluster of a chain back to the free pool
+void free_cluster_chain(unsigned int start_cluster) {
+    unsigned int end = get_total_clusters() + 2;
+    unsigned int c = start_cluster;
+
+    //a freed entry reads back as 0, so a looping chain stops where it comes back around
+    while (c >= 2 && c < end) {
+        unsigned int next = read_fat_entry(c);
+        write_fat_entry(c, 0);
+        c = next;
+    }
+}
+
 //PART FOUR:
 
 // helper for read command
@@ -177,6 +1238,7 @@ unsigned int find_cluster_from_offset(unsigned int starting_cluster, long offset
     // Traverse the cluster chain, skipping the required number of clusters
     for (unsigned int i = 0; i < clusters_to_skip; i++) {
         current_cluster = read_fat_entry(current_cluster);
+        STAT_INC(chain_steps);
         
         // If we hit EOC before reaching the target, the offset is invalid
         if (current_cluster >= 0x0FFFFFF8) {
@@ -186,3 +1248,116 @@ unsigned int find_cluster_from_offset(unsigned int starting_cluster, long offset
     
     return current_cluster;
 }
+
+// extent map helpers for open files
+
+//a chain can't hold more clusters than the volume has, one that goes on past that loops.
+//ends the map there so the walk stops
+static int chain_loops(OPEN_FILE *of) {
+    if (of->mapped_clusters < get_total_clusters()) return 0;
+    fprintf(stderr, "Error: Cluster chain starting at %u loops.\n", of->starting_cluster);
+    of->map_complete = 1;
+    return 1;
+}
+
+//walks the chain further until the map covers file_cluster (or the chain ends).
+//returns 1 if file_cluster is mapped
+int extend_extent_map(OPEN_FILE *of, unsigned int file_cluster) {
+    while (file_cluster >= of->mapped_clusters && !of->map_complete) {
+        //where the walk picks up: the start of the file or the cluster after the last extent
+        unsigned int next;
+        if (of->extent_count == 0) {
+            next = of->starting_cluster;
+        } else {
+            FILE_EXTENT *last = &of->extents[of->extent_count - 1];
+            next = read_fat_entry(last->start + last->length - 1);
+            STAT_INC(chain_steps);
+        }
+
+        if (next < 2 || next >= 0x0FFFFFF8) {
+            of->map_complete = 1;
+            break;
+        }
+        if (chain_loops(of)) break;
+
+        //contiguous with the last extent = just make it longer
+        if (of->extent_count > 0) {
+            FILE_EXTENT *last = &of->extents[of->extent_count - 1];
+            if (last->start + last->length == next) {
+                last->length++;
+                of->mapped_clusters++;
+                continue;
+            }
+        }
+
+        if (of->extent_count == of->extent_capacity) {
+            unsigned int new_capacity = of->extent_capacity ? of->extent_capacity * 2 : 8;
+            FILE_EXTENT *grown = (FILE_EXTENT *)realloc(of->extents, new_capacity * sizeof(FILE_EXTENT));
+            if (!grown) {
+                fprintf(stderr, "Error: Memory allocation failed for extent map.\n");
+                return 0;
+            }
+            of->extents = grown;
+            of->extent_capacity = new_capacity;
+        }
+
+        FILE_EXTENT *ext = &of->extents[of->extent_count++];
+        ext->file_cluster = of->mapped_clusters;
+        ext->start = next;
+        ext->length = 1;
+        of->mapped_clusters++;
+    }
+
+    //finish the run we stopped in so run_left covers the whole contiguous span
+    while (!of->map_complete && of->extent_count > 0) {
+        FILE_EXTENT *last = &of->extents[of->extent_count - 1];
+        unsigned int next = read_fat_entry(last->start + last->length - 1);
+        STAT_INC(chain_steps);
+        if (next < 2 || next >= 0x0FFFFFF8) {
+            of->map_complete = 1;
+        } else if (chain_loops(of)) {
+            break;
+        } else if (next == last->start + last->length) {
+            last->length++;
+            of->mapped_clusters++;
+            continue;
+        }
+        break;
+    }
+
+    return file_cluster < of->mapped_clusters;
+}
+
+//finds the physical cluster for the file_cluster'th cluster of an open file (binary search).
+//run_left (optional) gets how many clusters are contiguous on disk from there.
+//returns 0x0FFFFFFF if the chain is shorter than that
+unsigned int lookup_file_cluster(OPEN_FILE *of, unsigned int file_cluster, unsigned int *run_left) {
+    if (!extend_extent_map(of, file_cluster)) {
+        return 0x0FFFFFFF;
+    }
+
+    //last extent whose first cluster is <= file_cluster
+    unsigned int lo = 0, hi = of->extent_count - 1;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi + 1) / 2;
+        if (of->extents[mid].file_cluster <= file_cluster) lo = mid;
+        else hi = mid - 1;
+    }
+
+    FILE_EXTENT *ext = &of->extents[lo];
+    unsigned int into = file_cluster - ext->file_cluster;
+    if (run_left != NULL) {
+        *run_left = ext->length - into;
+    }
+    return ext->start + into;
+}
+
+//forgets the extent map, the next lookup rebuilds it from the start of the chain
+void reset_extent_map(OPEN_FILE *of) {
+    free(of->extents);
+    of->extents = NULL;
+    of->extent_count = 0;
+    of->extent_capacity = 0;
+    of->mapped_clusters = 0;
+    of->map_complete = 0;
+}
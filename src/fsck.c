@@ -0,0 +1,536 @@
+#define _GNU_SOURCE // pthreads, sysconf
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "structs.h"
+#include "commands.h"
+#include "fsck.h"
+
+extern FS_STATE g_fs_state;
+
+#define FAT_BAD 0x0FFFFFF7
+#define FAT_EOC_MIN 0x0FFFFFF8
+
+// state of the check in progress, shared by its workers. they read the image with image_pread,
+// the block cache isn't thread safe
+static unsigned int *g_fat = NULL;     // the active FAT as it is on disk
+static unsigned int g_entries = 0;     // FAT entries that matter: data clusters + 2
+static unsigned char *g_refs = NULL;   // FAT entries pointing at each cluster (stops counting at a few)
+static unsigned char *g_heads = NULL;  // directory entries (and the BPB root) starting at each cluster
+static unsigned int g_cluster_size = 0;
+static FSCK_REPORT *g_report = NULL;
+static pthread_mutex_t g_report_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// directory work queue
+typedef struct {
+    unsigned int cluster;
+    char path[256];
+} DIR_WORK;
+
+static pthread_mutex_t g_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_queue_cond = PTHREAD_COND_INITIALIZER;
+static DIR_WORK *g_queue = NULL;
+static unsigned int g_queue_len = 0;
+static unsigned int g_queue_cap = 0;
+static int g_busy = 0;          // workers in the middle of a directory
+static int g_queue_failed = 0;  // out of memory, the walk is incomplete
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// describes one problem, past FSCK_MAX_MESSAGES they are only counted
+static void note(const char *fmt, ...) {
+    pthread_mutex_lock(&g_report_lock);
+    if (g_report->messages < FSCK_MAX_MESSAGES) {
+        va_list ap;
+        va_start(ap, fmt);
+        vsnprintf(g_report->message[g_report->messages], FSCK_MESSAGE_LEN, fmt, ap);
+        va_end(ap);
+        g_report->messages++;
+    }
+    pthread_mutex_unlock(&g_report_lock);
+}
+
+// counts one more reference, returns the count before it
+static unsigned int add_ref(unsigned char *counts, unsigned int cluster) {
+    if (__atomic_load_n(&counts[cluster], __ATOMIC_RELAXED) >= 2) return 2; // already a cross link
+    return __atomic_fetch_add(&counts[cluster], 1, __ATOMIC_RELAXED);
+}
+
+static unsigned int fat_value(unsigned int cluster) {
+    return g_fat[cluster] & 0x0FFFFFFF;
+}
+
+// clusters in the chain at first, up to limit
+static unsigned int chain_length(unsigned int first, unsigned int limit) {
+    unsigned int n = 0;
+    unsigned int c = first;
+    while (c >= 2 && c < g_entries && n < limit) {
+        n++;
+        unsigned int next = fat_value(c);
+        if (next >= FAT_EOC_MIN || next == 0 || next == FAT_BAD) break;
+        c = next;
+    }
+    return n;
+}
+
+// FAT SCAN: each thread loads and checks one slice of the FAT -----------------------------------------
+
+typedef struct {
+    unsigned int first_sector;  // slice of the FAT, in sectors of one copy
+    unsigned int sectors;
+    int failed;
+    unsigned long mirror_sectors;
+    unsigned int free_clusters, bad_clusters, used_clusters;
+    unsigned long invalid;
+    unsigned long long bytes;
+} FAT_SLICE;
+
+static void *fat_worker(void *arg) {
+    FAT_SLICE *slice = (FAT_SLICE *)arg;
+    unsigned int bps = g_fs_state.fs_bpb.BPB_BytsPerSec;
+    unsigned int active = active_fat();
+    int compare = fat_mirrored() && g_fs_state.fs_bpb.BPB_NumFATs > 1;
+    unsigned char *fat_bytes = (unsigned char *)g_fat;
+    unsigned char *scratch = compare ? (unsigned char *)malloc(FSCK_CHUNK_BYTES) : NULL;
+    if (compare && scratch == NULL) {
+        slice->failed = 1;
+        return NULL;
+    }
+
+    // load the slice of the active FAT, and hold each chunk of it against the other copies
+    unsigned int chunk_sectors = FSCK_CHUNK_BYTES / bps;
+    for (unsigned int s = 0; s < slice->sectors; s += chunk_sectors) {
+        unsigned int count = slice->sectors - s < chunk_sectors ? slice->sectors - s : chunk_sectors;
+        unsigned int sector = slice->first_sector + s;
+        unsigned char *dst = fat_bytes + (size_t)sector * bps;
+        long long base = (long long)g_fs_state.fs_bpb.BPB_RsvdSecCnt + sector;
+        size_t len = (size_t)count * bps;
+
+        if (image_pread((base + (long long)active * g_fs_state.fs_bpb.BPB_FATSz32) * bps, dst, len) != 0) {
+            slice->failed = 1;
+            break;
+        }
+        slice->bytes += len;
+
+        for (unsigned int n = 0; compare && n < g_fs_state.fs_bpb.BPB_NumFATs; n++) {
+            if (n == active) continue;
+            if (image_pread((base + (long long)n * g_fs_state.fs_bpb.BPB_FATSz32) * bps, scratch, len) != 0) {
+                slice->failed = 1;
+                break;
+            }
+            slice->bytes += len;
+            for (unsigned int k = 0; k < count; k++) {
+                if (memcmp(dst + (size_t)k * bps, scratch + (size_t)k * bps, bps) != 0) {
+                    if (slice->mirror_sectors++ == 0) {
+                        note("FAT %u differs from FAT %u at sector %u", n, active, sector + k);
+                    }
+                }
+            }
+        }
+        if (slice->failed) break;
+    }
+    free(scratch);
+    if (slice->failed) return NULL;
+
+    // classify the entries in the slice and count who points where
+    unsigned int first = (unsigned int)(((unsigned long long)slice->first_sector * bps) / 4);
+    unsigned long long end = ((unsigned long long)slice->first_sector + slice->sectors) * bps / 4;
+    if (first < 2) first = 2;
+    if (end > g_entries) end = g_entries;
+    for (unsigned int c = first; c < end; c++) {
+        unsigned int v = fat_value(c);
+        if (v == 0) {
+            slice->free_clusters++;
+        } else if (v == FAT_BAD) {
+            slice->bad_clusters++;
+        } else {
+            slice->used_clusters++;
+            if (v >= FAT_EOC_MIN) continue;
+            if (v >= 2 && v < g_entries) {
+                add_ref(g_refs, v);
+            } else {
+                slice->invalid++;
+                note("Cluster %u points to %u, outside the data area", c, v);
+            }
+        }
+    }
+    return NULL;
+}
+
+// DIRECTORY WALK: workers take directories off a shared queue and add the ones they find -----------------------------------------
+
+// queues a directory, the caller holds g_queue_lock
+static void push_dir(unsigned int cluster, const char *parent, const char *name) {
+    if (g_queue_len == g_queue_cap) {
+        unsigned int cap = g_queue_cap ? g_queue_cap * 2 : 64;
+        DIR_WORK *grown = (DIR_WORK *)realloc(g_queue, cap * sizeof(DIR_WORK));
+        if (!grown) {
+            g_queue_failed = 1;
+            return;
+        }
+        g_queue = grown;
+        g_queue_cap = cap;
+    }
+    DIR_WORK *work = &g_queue[g_queue_len++];
+    work->cluster = cluster;
+    if (name == NULL) snprintf(work->path, sizeof(work->path), "%s", parent);
+    else snprintf(work->path, sizeof(work->path), "%s%s%s", parent, strcmp(parent, "/") == 0 ? "" : "/", name);
+    pthread_cond_signal(&g_queue_cond);
+}
+
+typedef struct {
+    unsigned long directories;
+    unsigned long long entries;
+    unsigned long size_mismatches;
+    unsigned long invalid;
+    int failed;
+} DIR_WORKER;
+
+// checks every entry of one directory
+static void scan_directory(const DIR_WORK *work, unsigned char *buf, DIR_WORKER *self) {
+    unsigned int entries_per_cluster = g_cluster_size / sizeof(DIR_ENTRY);
+    unsigned int cluster = work->cluster;
+    unsigned int steps = 0;
+    self->directories++;
+
+    while (cluster >= 2 && cluster < g_entries && steps++ < g_entries) {
+        long long offset = (long long)get_cluster_sector(cluster) * g_fs_state.fs_bpb.BPB_BytsPerSec;
+        if (image_pread(offset, buf, g_cluster_size) != 0) {
+            self->failed = 1;
+            return;
+        }
+
+        for (unsigned int i = 0; i < entries_per_cluster; i++) {
+            DIR_ENTRY *entry = (DIR_ENTRY *)(buf + i * sizeof(DIR_ENTRY));
+            if (entry->DIR_Name[0] == 0x00) return; // end of directory
+            if (entry->DIR_Name[0] == 0xE5 || entry->DIR_Name[0] == '.') continue;
+            if ((entry->DIR_Attr & ATTR_LFN) == ATTR_LFN || (entry->DIR_Attr & ATTR_VOLUME_ID)) continue;
+            self->entries++;
+
+            char name[13];
+            get_formatted_name(entry->DIR_Name, name);
+            unsigned int start = (unsigned int)entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
+
+            if (start != 0 && (start < 2 || start >= g_entries)) {
+                self->invalid++;
+                note("%s%s%s starts at cluster %u, outside the data area", work->path,
+                     strcmp(work->path, "/") == 0 ? "" : "/", name, start);
+                continue;
+            }
+
+            if (entry->DIR_Attr & ATTR_DIRECTORY) {
+                // only the first entry to reach a directory walks it, so loops end
+                if (start != 0 && add_ref(g_heads, start) == 0) {
+                    pthread_mutex_lock(&g_queue_lock);
+                    push_dir(start, work->path, name);
+                    pthread_mutex_unlock(&g_queue_lock);
+                }
+                continue;
+            }
+
+            unsigned long long needed = ((unsigned long long)entry->DIR_FileSize + g_cluster_size - 1) / g_cluster_size;
+            unsigned int have = 0;
+            if (start != 0) {
+                add_ref(g_heads, start);
+                have = chain_length(start, g_entries);
+            }
+            if (have != needed) {
+                self->size_mismatches++;
+                note("%s%s%s: %u bytes need %llu clusters, the chain has %u", work->path,
+                     strcmp(work->path, "/") == 0 ? "" : "/", name, entry->DIR_FileSize, needed, have);
+            }
+        }
+
+        unsigned int next = fat_value(cluster);
+        if (next >= FAT_EOC_MIN || next == 0 || next == FAT_BAD) break;
+        cluster = next;
+    }
+}
+
+static void *dir_worker(void *arg) {
+    DIR_WORKER *self = (DIR_WORKER *)arg;
+    unsigned char *buf = (unsigned char *)malloc(g_cluster_size);
+    if (!buf) self->failed = 1;
+
+    while (1) {
+        pthread_mutex_lock(&g_queue_lock);
+        while (g_queue_len == 0 && g_busy > 0) {
+            pthread_cond_wait(&g_queue_cond, &g_queue_lock);
+        }
+        if (g_queue_len == 0 || buf == NULL) {
+            // nothing queued and nobody left to queue more
+            pthread_cond_broadcast(&g_queue_cond);
+            pthread_mutex_unlock(&g_queue_lock);
+            break;
+        }
+        DIR_WORK work = g_queue[--g_queue_len];
+        g_busy++;
+        pthread_mutex_unlock(&g_queue_lock);
+
+        scan_directory(&work, buf, self);
+
+        pthread_mutex_lock(&g_queue_lock);
+        g_busy--;
+        if (g_busy == 0 && g_queue_len == 0) pthread_cond_broadcast(&g_queue_cond);
+        pthread_mutex_unlock(&g_queue_lock);
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// CLUSTER PASS: with every reference counted, each thread looks for cross links and lost chains in its range -----------------------------------------
+
+typedef struct {
+    unsigned int first;
+    unsigned int end;
+    unsigned long cross_linked;
+    unsigned long lost_chains;
+    unsigned long long lost_clusters;
+    unsigned long invalid;
+} CLUSTER_RANGE;
+
+static void *cluster_worker(void *arg) {
+    CLUSTER_RANGE *range = (CLUSTER_RANGE *)arg;
+    for (unsigned int c = range->first; c < range->end; c++) {
+        unsigned int v = fat_value(c);
+        unsigned int refs = g_refs[c] + g_heads[c];
+        if (v == 0) {
+            if (refs > 0) {
+                range->invalid++;
+                note("Cluster %u is free but %s points to it", c, g_heads[c] ? "a directory entry" : "the FAT");
+            }
+            continue;
+        }
+        if (v == FAT_BAD) continue;
+
+        if (refs >= 2) {
+            range->cross_linked++;
+            note("Cluster %u is cross-linked (reached %s%u times)", c, refs > 2 ? "at least " : "", refs);
+        } else if (refs == 0) {
+            unsigned int length = chain_length(c, g_entries);
+            range->lost_chains++;
+            range->lost_clusters += length;
+            note("Lost chain of %u cluster(s) at cluster %u", length, c);
+        }
+    }
+    return NULL;
+}
+
+// runs count workers over args (each arg_size bytes) and waits for them
+static void run_workers(void *(*fn)(void *), void *args, size_t arg_size, int count) {
+    pthread_t threads[FSCK_MAX_THREADS];
+    int started[FSCK_MAX_THREADS];
+    for (int i = 0; i < count; i++) {
+        void *arg = (unsigned char *)args + (size_t)i * arg_size;
+        started[i] = pthread_create(&threads[i], NULL, fn, arg) == 0;
+        if (!started[i]) fn(arg); // no thread to be had, do it here
+    }
+    for (int i = 0; i < count; i++) {
+        if (started[i]) pthread_join(threads[i], NULL);
+    }
+}
+
+static int check_bpb() {
+    BPB *bpb = &g_fs_state.fs_bpb;
+    unsigned int bps = bpb->BPB_BytsPerSec;
+    if (bpb->signature != 0xAA55) {
+        note("Boot sector signature is 0x%X, not 0xAA55", bpb->signature);
+        return 0;
+    }
+    if (bps != 512 && bps != 1024 && bps != 2048 && bps != 4096) {
+        note("BPB_BytsPerSec is %u", bps);
+        return 0;
+    }
+    if (bpb->BPB_SecPerClus == 0 || (bpb->BPB_SecPerClus & (bpb->BPB_SecPerClus - 1)) != 0) {
+        note("BPB_SecPerClus is %u, not a power of two", bpb->BPB_SecPerClus);
+        return 0;
+    }
+    if (bpb->BPB_NumFATs == 0 || bpb->BPB_FATSz32 == 0 || bpb->BPB_RsvdSecCnt == 0) {
+        note("BPB has %u FATs of %u sectors after %u reserved sectors", bpb->BPB_NumFATs, bpb->BPB_FATSz32, bpb->BPB_RsvdSecCnt);
+        return 0;
+    }
+    if (get_first_data_sector() >= bpb->BPB_TotSecs32) {
+        note("The FATs end past the last sector of the volume");
+        return 0;
+    }
+    unsigned long long fat_entries = (unsigned long long)bpb->BPB_FATSz32 * bps / 4;
+    if (fat_entries < (unsigned long long)get_total_clusters() + 2) {
+        note("The FAT has %llu entries for %u clusters", fat_entries, get_total_clusters());
+        return 0;
+    }
+    if (bpb->BPB_RootClus < 2 || bpb->BPB_RootClus >= get_total_clusters() + 2) {
+        note("BPB_RootClus %u is outside the data area", bpb->BPB_RootClus);
+        return 0;
+    }
+    return 1;
+}
+
+long fsck_run(int threads, FSCK_REPORT *report) {
+    memset(report, 0, sizeof(*report));
+    g_report = report;
+    double start = now_seconds();
+
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > FSCK_MAX_THREADS) threads = FSCK_MAX_THREADS;
+    report->threads = threads;
+
+    report->bpb_ok = check_bpb();
+    if (!report->bpb_ok) {
+        report->total_seconds = now_seconds() - start;
+        return 1;
+    }
+
+    unsigned int bps = g_fs_state.fs_bpb.BPB_BytsPerSec;
+    g_cluster_size = bps * g_fs_state.fs_bpb.BPB_SecPerClus;
+    report->clusters = get_total_clusters();
+    g_entries = report->clusters + 2;
+    unsigned int fat_sectors = (unsigned int)(((unsigned long long)g_entries * 4 + bps - 1) / bps);
+
+    g_fat = (unsigned int *)malloc((size_t)fat_sectors * bps);
+    g_refs = (unsigned char *)calloc(g_entries, 1);
+    g_heads = (unsigned char *)calloc(g_entries, 1);
+    FAT_SLICE *slices = (FAT_SLICE *)calloc(threads, sizeof(FAT_SLICE));
+    DIR_WORKER *walkers = (DIR_WORKER *)calloc(threads, sizeof(DIR_WORKER));
+    CLUSTER_RANGE *ranges = (CLUSTER_RANGE *)calloc(threads, sizeof(CLUSTER_RANGE));
+    long problems = -1;
+    if (!g_fat || !g_refs || !g_heads || !slices || !walkers || !ranges) {
+        fprintf(stderr, "Error: Not enough memory to check %u clusters\n", report->clusters);
+        goto done;
+    }
+
+    // FAT: whole sectors per thread, copies compared as they are read
+    double phase = now_seconds();
+    unsigned int per_thread = (fat_sectors + threads - 1) / threads;
+    for (int i = 0; i < threads; i++) {
+        unsigned int first = (unsigned int)i * per_thread;
+        slices[i].first_sector = first < fat_sectors ? first : fat_sectors;
+        slices[i].sectors = fat_sectors - slices[i].first_sector < per_thread ? fat_sectors - slices[i].first_sector : per_thread;
+    }
+    run_workers(fat_worker, slices, sizeof(FAT_SLICE), threads);
+    report->mirrors_compared = fat_mirrored() && g_fs_state.fs_bpb.BPB_NumFATs > 1;
+    for (int i = 0; i < threads; i++) {
+        if (slices[i].failed) {
+            fprintf(stderr, "Error: Failed to read the FAT\n");
+            goto done;
+        }
+        report->mirror_sectors += slices[i].mirror_sectors;
+        report->free_clusters += slices[i].free_clusters;
+        report->bad_clusters += slices[i].bad_clusters;
+        report->used_clusters += slices[i].used_clusters;
+        report->invalid_entries += slices[i].invalid;
+        report->fat_bytes += slices[i].bytes;
+    }
+    report->fat_seconds = now_seconds() - phase;
+
+    // directories, from the root down
+    phase = now_seconds();
+    unsigned int root = g_fs_state.fs_bpb.BPB_RootClus;
+    add_ref(g_heads, root);
+    g_queue_len = 0;
+    g_busy = 0;
+    g_queue_failed = 0;
+    push_dir(root, "/", NULL);
+    run_workers(dir_worker, walkers, sizeof(DIR_WORKER), threads);
+    if (g_queue_failed) {
+        fprintf(stderr, "Error: Not enough memory to walk the directories\n");
+        goto done;
+    }
+    for (int i = 0; i < threads; i++) {
+        if (walkers[i].failed) {
+            fprintf(stderr, "Error: Failed to read a directory\n");
+            goto done;
+        }
+        report->directories += walkers[i].directories;
+        report->entries += walkers[i].entries;
+        report->size_mismatches += walkers[i].size_mismatches;
+        report->invalid_entries += walkers[i].invalid;
+    }
+    report->dir_seconds = now_seconds() - phase;
+
+    // cross links and lost chains
+    unsigned int per_range = (g_entries - 2 + threads - 1) / threads;
+    for (int i = 0; i < threads; i++) {
+        unsigned long long first = 2 + (unsigned long long)i * per_range;
+        unsigned long long end = first + per_range;
+        ranges[i].first = first < g_entries ? (unsigned int)first : g_entries;
+        ranges[i].end = end < g_entries ? (unsigned int)end : g_entries;
+    }
+    run_workers(cluster_worker, ranges, sizeof(CLUSTER_RANGE), threads);
+    for (int i = 0; i < threads; i++) {
+        report->cross_linked += ranges[i].cross_linked;
+        report->lost_chains += ranges[i].lost_chains;
+        report->lost_clusters += ranges[i].lost_clusters;
+        report->invalid_entries += ranges[i].invalid;
+    }
+
+    problems = (long)(report->mirror_sectors + report->invalid_entries + report->cross_linked +
+                      report->lost_chains + report->size_mismatches);
+
+done:
+    report->total_seconds = now_seconds() - start;
+    free(g_fat);
+    free(g_refs);
+    free(g_heads);
+    free(g_queue);
+    free(slices);
+    free(walkers);
+    free(ranges);
+    g_fat = NULL;
+    g_refs = NULL;
+    g_heads = NULL;
+    g_queue = NULL;
+    g_queue_cap = 0;
+    g_queue_len = 0;
+    return problems;
+}
+
+void fsck_print(const FSCK_REPORT *report) {
+    const BPB *bpb = &g_fs_state.fs_bpb;
+    if (!report->bpb_ok) {
+        printf("BPB: invalid\n");
+    } else {
+        printf("BPB: ok (%u bytes/sector, %u sectors/cluster, %u FATs, %u clusters)\n",
+               bpb->BPB_BytsPerSec, bpb->BPB_SecPerClus, bpb->BPB_NumFATs, report->clusters);
+        if (!report->mirrors_compared) {
+            printf("FAT copies: not compared (%s)\n", bpb->BPB_NumFATs > 1 ? "mirroring is off" : "only one FAT");
+        } else if (report->mirror_sectors == 0) {
+            printf("FAT copies: identical\n");
+        } else {
+            printf("FAT copies: %lu sector(s) differ from the active FAT\n", report->mirror_sectors);
+        }
+
+        double mib = report->fat_bytes / (1024.0 * 1024.0);
+        printf("FAT: %u used, %u free, %u bad clusters; %.1f MiB read in %.3f s (%.0f MiB/s, %d threads)\n",
+               report->used_clusters, report->free_clusters, report->bad_clusters, mib, report->fat_seconds,
+               report->fat_seconds > 0 ? mib / report->fat_seconds : 0.0, report->threads);
+        printf("Directories: %lu with %llu entries in %.3f s (%.0f entries/s)\n", report->directories,
+               report->entries, report->dir_seconds,
+               report->dir_seconds > 0 ? report->entries / report->dir_seconds : 0.0);
+        printf("Cross-linked clusters: %lu\n", report->cross_linked);
+        printf("Lost chains: %lu (%llu clusters)\n", report->lost_chains, report->lost_clusters);
+        printf("Size mismatches: %lu\n", report->size_mismatches);
+        printf("Invalid references: %lu\n", report->invalid_entries);
+    }
+
+    for (unsigned int i = 0; i < report->messages; i++) {
+        printf("  %s\n", report->message[i]);
+    }
+
+    unsigned long problems = !report->bpb_ok + report->mirror_sectors + report->invalid_entries +
+                             report->cross_linked + report->lost_chains + report->size_mismatches;
+    if (problems > report->messages) {
+        printf("  ... %lu more not shown\n", problems - report->messages);
+    }
+    if (problems == 0) printf("No problems found (%.3f s)\n", report->total_seconds);
+    else printf("%lu problem(s) found (%.3f s)\n", problems, report->total_seconds);
+}
@@ -0,0 +1,522 @@
+#define _GNU_SOURCE // pwritev
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "structs.h"
+#include "image_builder.h"
+
+#define BUILDER_RESERVED_SECTORS 32
+#define BUILDER_EOC 0x0FFFFFFF
+// FAT32 cluster numbers stop below 0x0FFFFFF7 (bad cluster)
+#define BUILDER_MAX_CLUSTERS (0x0FFFFFF6u - 2)
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// marks the build as failed, only the first error is printed
+static int fail(IMAGE_BUILDER *b, const char *message) {
+    if (!b->failed) printf("Error: %s\n", message);
+    b->failed = 1;
+    return 1;
+}
+
+void image_spec_defaults(IMAGE_SPEC *spec) {
+    memset(spec, 0, sizeof(*spec));
+    spec->image_bytes = 64ull * 1024 * 1024;
+    spec->bytes_per_sector = 512;
+    spec->num_fats = 2;
+    spec->label = "NO NAME";
+    spec->seed = 1;
+    spec->fanout = 16;
+    spec->size_dist = SIZE_FIXED;
+    spec->size_min = 4096;
+    spec->size_max = 4096;
+}
+
+// xorshift64, so the same seed gives the same image
+unsigned int builder_random(IMAGE_BUILDER *b) {
+    unsigned long long x = b->rng;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    b->rng = x;
+    return (unsigned int)(x >> 32);
+}
+
+static int write_all(IMAGE_BUILDER *b, const void *buf, size_t len, long long offset) {
+    const unsigned char *p = (const unsigned char *)buf;
+    while (len > 0) {
+        ssize_t n = pwrite(b->fd, p, len, offset);
+        b->writes++;
+        if (n <= 0) return fail(b, "Could not write the image.");
+        p += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+// "F0000001.DAT" -> "F0000001DAT", longer parts are cut to 8.3
+static void short_name(const char *name, unsigned char out[11]) {
+    memset(out, ' ', 11);
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        memcpy(out, name, strlen(name));
+        return;
+    }
+    const char *dot = strchr(name, '.');
+    size_t base = dot ? (size_t)(dot - name) : strlen(name);
+    for (size_t i = 0; i < base && i < 8; i++) out[i] = (unsigned char)toupper((unsigned char)name[i]);
+    if (dot) {
+        for (size_t i = 0; dot[1 + i] && i < 3; i++) out[8 + i] = (unsigned char)toupper((unsigned char)dot[1 + i]);
+    }
+}
+
+static unsigned int clusters_for(IMAGE_BUILDER *b, unsigned long long bytes) {
+    return (unsigned int)((bytes + b->cluster_bytes - 1) / b->cluster_bytes);
+}
+
+static long long cluster_offset(IMAGE_BUILDER *b, unsigned int cluster) {
+    return b->data_offset + (long long)(cluster - 2) * b->cluster_bytes;
+}
+
+// mkfs.fat's FAT32 defaults
+static unsigned int default_cluster_bytes(unsigned long long image_bytes) {
+    unsigned long long gib = 1024ull * 1024 * 1024;
+    if (image_bytes < 8 * gib) return 4096;
+    if (image_bytes < 16 * gib) return 8192;
+    if (image_bytes < 32 * gib) return 16384;
+    return 32768;
+}
+
+int builder_start(IMAGE_BUILDER *b, const char *path, const IMAGE_SPEC *spec) {
+    memset(b, 0, sizeof(*b));
+    b->fd = -1;
+    b->spec = *spec;
+    b->rng = 0x9E3779B97F4A7C15ull ^ spec->seed;
+
+    unsigned int bps = spec->bytes_per_sector;
+    if (bps != 512 && bps != 1024 && bps != 2048 && bps != 4096) {
+        return fail(b, "Sector size must be 512, 1024, 2048 or 4096 bytes.");
+    }
+    unsigned int spc = spec->sectors_per_cluster;
+    if (spc == 0) {
+        spc = default_cluster_bytes(spec->image_bytes) / bps;
+        if (spc == 0) spc = 1;
+    }
+    if (spc > 128 || (spc & (spc - 1)) != 0) {
+        return fail(b, "Sectors per cluster must be a power of two up to 128.");
+    }
+    if (spec->num_fats < 1 || spec->num_fats > 4) {
+        return fail(b, "There must be 1 to 4 FATs.");
+    }
+    unsigned long long total = spec->image_bytes / bps;
+    if (total > 0xFFFFFFFFull) return fail(b, "The image is too big for FAT32.");
+
+    // FAT size and cluster count depend on each other, go until they agree
+    unsigned int fat_sectors = 1;
+    unsigned long long clusters = 0;
+    for (;;) {
+        unsigned long long meta = BUILDER_RESERVED_SECTORS + (unsigned long long)spec->num_fats * fat_sectors;
+        if (meta + spc > total) return fail(b, "The image is too small.");
+        clusters = (total - meta) / spc;
+        unsigned int need = (unsigned int)(((clusters + 2) * 4 + bps - 1) / bps);
+        if (need <= fat_sectors) break;
+        fat_sectors = need;
+    }
+    if (clusters > BUILDER_MAX_CLUSTERS) return fail(b, "Too many clusters for FAT32, use bigger clusters.");
+
+    b->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (b->fd < 0) return fail(b, "Could not create the image.");
+    if (ftruncate(b->fd, (off_t)spec->image_bytes) != 0) return fail(b, "Could not size the image.");
+
+    BPB *bpb = &b->bpb;
+    memcpy(bpb->BS_JmpBoot, "\xEB\x58\x90", 3);
+    memcpy(bpb->BS_OEMName, "FATBUILD", 8);
+    bpb->BPB_BytsPerSec = (unsigned short)bps;
+    bpb->BPB_SecPerClus = (unsigned char)spc;
+    bpb->BPB_RsvdSecCnt = BUILDER_RESERVED_SECTORS;
+    bpb->BPB_NumFATs = (unsigned char)spec->num_fats;
+    bpb->BPB_Media = 0xF8;
+    bpb->BPB_SecPerTrk = 32;
+    bpb->BPB_NumHeads = 64;
+    bpb->BPB_TotSecs32 = (unsigned int)total;
+    bpb->BPB_FATSz32 = fat_sectors;
+    bpb->BPB_RootClus = 2;
+    bpb->BPB_FSInfo = 1;
+    bpb->BPB_BkBootSec = 6;
+    bpb->BS_DrvNum = 0x80;
+    bpb->BS_BootSig = 0x29;
+    bpb->BS_VolID = 0x46415400 ^ spec->seed;
+    memset(bpb->BS_VolLab, ' ', 11);
+    for (size_t i = 0; spec->label && spec->label[i] && i < 11; i++) {
+        bpb->BS_VolLab[i] = (unsigned char)toupper((unsigned char)spec->label[i]);
+    }
+    memcpy(bpb->BS_FilSysType, "FAT32   ", 8);
+    bpb->signature = 0xAA55;
+
+    b->fat_entries = fat_sectors * (bps / 4);
+    b->clusters = (unsigned int)clusters;
+    b->cluster_bytes = spc * bps;
+    b->data_offset = (long long)(BUILDER_RESERVED_SECTORS + (unsigned long long)spec->num_fats * fat_sectors) * bps;
+    b->fat = (unsigned int *)calloc(b->fat_entries, sizeof(unsigned int));
+    if (!b->fat) return fail(b, "Memory allocation failed.");
+    b->fat[0] = 0x0FFFFFF8;
+    b->fat[1] = BUILDER_EOC;
+    b->next = 2;
+
+    if (spec->fill) {
+        b->pattern = (unsigned char *)malloc(BUILDER_FILL_BYTES + 26);
+        b->stage = (unsigned char *)malloc(BUILDER_FILL_BYTES);
+        if (!b->pattern || !b->stage) return fail(b, "Memory allocation failed.");
+        for (unsigned int i = 0; i < BUILDER_FILL_BYTES + 26; i++) b->pattern[i] = (unsigned char)('a' + i % 26);
+    }
+    return 0;
+}
+
+unsigned int builder_alloc(IMAGE_BUILDER *b, unsigned int count) {
+    if (count == 0 || b->failed) return 0;
+    if (count > b->clusters - (b->next - 2)) {
+        fail(b, "The image is full.");
+        return 0;
+    }
+    unsigned int first = b->next;
+    for (unsigned int i = 0; i < count - 1; i++) b->fat[first + i] = first + i + 1;
+    b->fat[first + count - 1] = BUILDER_EOC;
+    b->next += count;
+    return first;
+}
+
+int builder_add_entry(IMAGE_BUILDER *b, BUILDER_DIR *d, const char *name, unsigned char attr, unsigned int cluster, unsigned int size) {
+    if (b->failed) return 1;
+    if (d->count == d->capacity) return fail(b, "A directory is out of entries.");
+    DIR_ENTRY *e = &d->entries[d->count++];
+    short_name(name, e->DIR_Name);
+    e->DIR_Attr = attr;
+    e->DIR_FstClusHI = (unsigned short)(cluster >> 16);
+    e->DIR_FstClusLO = (unsigned short)(cluster & 0xFFFF);
+    e->DIR_FileSize = size;
+    return 0;
+}
+
+int builder_open_dir(IMAGE_BUILDER *b, BUILDER_DIR *d, unsigned int parent, unsigned int capacity) {
+    memset(d, 0, sizeof(*d));
+    if (b->failed) return 1;
+    if (capacity > BUILDER_MAX_DIR_ENTRIES - 2) return fail(b, "A directory can't hold that many entries.");
+
+    d->capacity = capacity + (parent != 0 ? 2 : 0);
+    d->clusters = clusters_for(b, (unsigned long long)(d->capacity ? d->capacity : 1) * sizeof(DIR_ENTRY));
+    d->cluster = builder_alloc(b, d->clusters);
+    if (d->cluster == 0) return 1;
+    d->entries = (DIR_ENTRY *)calloc((size_t)d->clusters * b->cluster_bytes, 1);
+    if (!d->entries) return fail(b, "Memory allocation failed.");
+    d->capacity = (unsigned int)((size_t)d->clusters * b->cluster_bytes / sizeof(DIR_ENTRY));
+
+    if (parent == 0) {
+        b->bpb.BPB_RootClus = d->cluster;
+        return 0;
+    }
+    builder_add_entry(b, d, ".", ATTR_DIRECTORY, d->cluster, 0);
+    return builder_add_entry(b, d, "..", ATTR_DIRECTORY, parent == b->bpb.BPB_RootClus ? 0 : parent, 0);
+}
+
+int builder_add_subdir(IMAGE_BUILDER *b, BUILDER_DIR *parent, BUILDER_DIR *child, const char *name, unsigned int capacity) {
+    if (builder_open_dir(b, child, parent->cluster, capacity) != 0) return 1;
+    return builder_add_entry(b, parent, name, ATTR_DIRECTORY, child->cluster, 0);
+}
+
+// file contents are gathered here while the clusters they land in follow each other,
+// so the data area goes out in BUILDER_FILL_BYTES writes instead of one per run
+static void flush_fill(IMAGE_BUILDER *b) {
+    if (b->stage_len > 0) write_all(b, b->stage, b->stage_len, b->stage_offset);
+    b->stage_len = 0;
+}
+
+// len bytes of the pattern as it continues from file offset pos, then zeros to the end of the run
+static void fill_run(IMAGE_BUILDER *b, unsigned int cluster, unsigned long long pos, size_t len, size_t run_bytes) {
+    long long offset = cluster_offset(b, cluster);
+    if (b->stage_len > 0 && offset != b->stage_offset + (long long)b->stage_len) flush_fill(b);
+    for (size_t done = 0; done < run_bytes && !b->failed; ) {
+        if (b->stage_len == 0) b->stage_offset = offset + (long long)done;
+        size_t n = run_bytes - done;
+        if (n > BUILDER_FILL_BYTES - b->stage_len) n = BUILDER_FILL_BYTES - b->stage_len;
+        if (done < len) {
+            if (n > len - done) n = len - done;
+            memcpy(b->stage + b->stage_len, b->pattern + (pos + done) % 26, n);
+        } else {
+            memset(b->stage + b->stage_len, 0, n);
+        }
+        b->stage_len += n;
+        done += n;
+        if (b->stage_len == BUILDER_FILL_BYTES) flush_fill(b);
+    }
+}
+
+int builder_alloc_files(IMAGE_BUILDER *b, const unsigned int *sizes, unsigned int count, unsigned int run, unsigned int *first) {
+    if (b->failed) return 1;
+    unsigned int *last = (unsigned int *)calloc(count, sizeof(unsigned int));
+    unsigned int *left = (unsigned int *)calloc(count, sizeof(unsigned int));
+    unsigned long long *pos = (unsigned long long *)calloc(count, sizeof(unsigned long long));
+    if (!last || !left || !pos) {
+        free(last);
+        free(left);
+        free(pos);
+        return fail(b, "Memory allocation failed.");
+    }
+
+    unsigned long long remaining = 0;
+    for (unsigned int i = 0; i < count; i++) {
+        first[i] = 0;
+        left[i] = clusters_for(b, sizes[i]);
+        remaining += left[i];
+        b->files++;
+        b->file_bytes += sizes[i];
+    }
+
+    unsigned int turn = 0;
+    while (remaining > 0 && !b->failed) {
+        // contiguous files go in order, fragmented ones take turns at random
+        unsigned int k = run == 0 ? turn : builder_random(b) % count;
+        while (left[k] == 0) k = (k + 1) % count;
+        unsigned int n = (run == 0 || left[k] < run) ? left[k] : run;
+        unsigned int c = builder_alloc(b, n);
+        if (c == 0) break;
+        if (last[k]) b->fat[last[k]] = c;
+        else first[k] = c;
+        last[k] = c + n - 1;
+
+        if (b->pattern) {
+            size_t run_bytes = (size_t)n * b->cluster_bytes;
+            size_t bytes = run_bytes;
+            if (bytes > sizes[k] - pos[k]) bytes = (size_t)(sizes[k] - pos[k]);
+            fill_run(b, c, pos[k], bytes, run_bytes);
+        }
+        pos[k] += (unsigned long long)n * b->cluster_bytes;
+        left[k] -= n;
+        remaining -= n;
+        if (left[k] == 0) turn++;
+    }
+
+    free(last);
+    free(left);
+    free(pos);
+    return b->failed;
+}
+
+int builder_add_file(IMAGE_BUILDER *b, BUILDER_DIR *d, const char *name, unsigned int size) {
+    unsigned int first;
+    if (builder_alloc_files(b, &size, 1, 0, &first) != 0) return 1;
+    return builder_add_entry(b, d, name, ATTR_ARCHIVE, first, size);
+}
+
+int builder_close_dir(IMAGE_BUILDER *b, BUILDER_DIR *d) {
+    if (b->failed) {
+        free(d->entries);
+        d->entries = NULL;
+        return 1;
+    }
+    if (b->dir_count == b->dir_capacity) {
+        unsigned int capacity = b->dir_capacity ? b->dir_capacity * 2 : 64;
+        BUILDER_DIR **dirs = (BUILDER_DIR **)realloc(b->dirs, capacity * sizeof(BUILDER_DIR *));
+        if (!dirs) return fail(b, "Memory allocation failed.");
+        b->dirs = dirs;
+        b->dir_capacity = capacity;
+    }
+    BUILDER_DIR *copy = (BUILDER_DIR *)malloc(sizeof(BUILDER_DIR));
+    if (!copy) return fail(b, "Memory allocation failed.");
+    *copy = *d;
+    d->entries = NULL; // the builder owns it now
+    b->dirs[b->dir_count++] = copy;
+    return 0;
+}
+
+static int compare_dirs(const void *a, const void *b) {
+    unsigned int x = (*(BUILDER_DIR *const *)a)->cluster, y = (*(BUILDER_DIR *const *)b)->cluster;
+    return (x > y) - (x < y);
+}
+
+// one pwritev per stretch of directories that sit next to each other, short writes finished by hand
+static int write_dirs(IMAGE_BUILDER *b) {
+    qsort(b->dirs, b->dir_count, sizeof(BUILDER_DIR *), compare_dirs);
+    struct iovec iov[IO_MAX_IOV];
+    unsigned int i = 0;
+    while (i < b->dir_count && !b->failed) {
+        unsigned int start = i, n = 0;
+        unsigned long long bytes = 0;
+        do {
+            iov[n].iov_base = b->dirs[i]->entries;
+            iov[n].iov_len = (size_t)b->dirs[i]->clusters * b->cluster_bytes;
+            bytes += iov[n].iov_len;
+            n++;
+            i++;
+        } while (i < b->dir_count && n < IO_MAX_IOV &&
+                 b->dirs[i]->cluster == b->dirs[i - 1]->cluster + b->dirs[i - 1]->clusters);
+
+        long long offset = cluster_offset(b, b->dirs[start]->cluster);
+        ssize_t done = pwritev(b->fd, iov, (int)n, offset);
+        b->writes++;
+        if (done < 0) return fail(b, "Could not write the directories.");
+        for (unsigned int k = 0; k < n && !b->failed; k++) {
+            size_t len = iov[k].iov_len;
+            if ((size_t)done >= len) {
+                done -= (ssize_t)len;
+            } else {
+                write_all(b, (unsigned char *)iov[k].iov_base + done, len - (size_t)done, offset + done);
+                done = 0;
+            }
+            offset += (long long)len;
+        }
+    }
+    return b->failed;
+}
+
+int builder_finish(IMAGE_BUILDER *b, IMAGE_BUILD_STATS *stats) {
+    if (!b->failed && b->fd >= 0) {
+        flush_fill(b);
+        write_dirs(b);
+
+        // every FAT copy in one sequential write
+        size_t fat_bytes = (size_t)b->fat_entries * 4;
+        long long fat_offset = (long long)BUILDER_RESERVED_SECTORS * b->bpb.BPB_BytsPerSec;
+        for (unsigned int i = 0; i < b->bpb.BPB_NumFATs && !b->failed; i++) {
+            write_all(b, b->fat, fat_bytes, fat_offset + (long long)i * fat_bytes);
+        }
+
+        // boot sector and FSInfo, then the backup copies
+        FSINFO info;
+        memset(&info, 0, sizeof(info));
+        info.FSI_LeadSig = FSI_LEAD_SIG;
+        info.FSI_StrucSig = FSI_STRUC_SIG;
+        info.FSI_Free_Count = b->clusters - (b->next - 2);
+        info.FSI_Nxt_Free = b->next;
+        info.FSI_TrailSig = FSI_TRAIL_SIG;
+        unsigned int bps = b->bpb.BPB_BytsPerSec;
+        unsigned int copies[2] = { 0, b->bpb.BPB_BkBootSec };
+        for (int i = 0; i < 2 && !b->failed; i++) {
+            write_all(b, &b->bpb, sizeof(BPB), (long long)copies[i] * bps);
+            write_all(b, &info, sizeof(info), (long long)(copies[i] + b->bpb.BPB_FSInfo) * bps);
+        }
+    }
+
+    if (stats) {
+        stats->clusters = b->clusters;
+        stats->cluster_bytes = b->cluster_bytes;
+        stats->used_clusters = b->next - 2;
+        stats->directories = b->dir_count;
+        stats->files = b->files;
+        stats->file_bytes = b->file_bytes;
+        stats->writes = b->writes;
+    }
+
+    for (unsigned int i = 0; i < b->dir_count; i++) {
+        free(b->dirs[i]->entries);
+        free(b->dirs[i]);
+    }
+    free(b->dirs);
+    free(b->fat);
+    free(b->pattern);
+    free(b->stage);
+    b->dirs = NULL;
+    b->fat = NULL;
+    b->pattern = NULL;
+    b->stage = NULL;
+    if (b->fd >= 0 && close(b->fd) != 0) fail(b, "Could not close the image.");
+    b->fd = -1;
+    return b->failed;
+}
+
+// GENERATED TREES -----------------------------------------
+
+static unsigned int pick_size(IMAGE_BUILDER *b, const IMAGE_SPEC *spec) {
+    unsigned long long lo = spec->size_min, hi = spec->size_max;
+    if (hi > 0xFFFFFFFFull) hi = 0xFFFFFFFFull;
+    if (spec->size_dist == SIZE_FIXED || hi <= lo) return (unsigned int)(lo > hi ? hi : lo);
+
+    if (spec->size_dist == SIZE_LOG) {
+        // pick an octave first, so small and big files are equally likely per octave
+        unsigned int low_bit = 0, high_bit = 0;
+        while (low_bit < 63 && (2ull << low_bit) <= lo) low_bit++;
+        while (high_bit < 63 && (2ull << high_bit) <= hi) high_bit++;
+        unsigned int bit = low_bit + builder_random(b) % (high_bit - low_bit + 1);
+        unsigned long long start = 1ull << bit, end = (2ull << bit) - 1;
+        if (start < lo) start = lo;
+        if (end > hi) end = hi;
+        lo = start;
+        hi = end;
+    }
+    unsigned long long r = ((unsigned long long)builder_random(b) << 32) | builder_random(b);
+    return (unsigned int)(lo + r % (hi - lo + 1));
+}
+
+int image_build(const char *path, const IMAGE_SPEC *spec, IMAGE_BUILD_STATS *stats) {
+    double start = now_seconds();
+    IMAGE_BUILDER b;
+    if (builder_start(&b, path, spec) != 0) return builder_finish(&b, stats);
+
+    // directory i's parent is (i - 1) / fanout, 0 being the root, so parents come first
+    unsigned int fanout = spec->fanout ? spec->fanout : 1;
+    unsigned int ndirs = spec->dirs + 1;
+    unsigned long per_dir = spec->files / ndirs, extra = spec->files % ndirs;
+    BUILDER_DIR *dirs = (BUILDER_DIR *)calloc(ndirs, sizeof(BUILDER_DIR));
+    unsigned int *sizes = (unsigned int *)malloc(BUILDER_WRITERS * sizeof(unsigned int));
+    unsigned int *firsts = (unsigned int *)malloc(BUILDER_WRITERS * sizeof(unsigned int));
+    if (!dirs || !sizes || !firsts) {
+        fail(&b, "Memory allocation failed.");
+    }
+
+    // every directory first, so the metadata sits together at the front of the data area
+    char name[16];
+    for (unsigned int i = 0; i < ndirs && !b.failed; i++) {
+        unsigned long long children = 0;
+        if ((unsigned long long)i * fanout + 1 < ndirs) {
+            children = ndirs - ((unsigned long long)i * fanout + 1);
+            if (children > fanout) children = fanout;
+        }
+        unsigned long long capacity = children + per_dir + (i < extra) + spec->spare_entries;
+        if (capacity > BUILDER_MAX_DIR_ENTRIES - 2) {
+            fail(&b, "Too many entries per directory, add directories.");
+            break;
+        }
+        if (i == 0) {
+            builder_open_dir(&b, &dirs[0], 0, (unsigned int)capacity);
+        } else {
+            snprintf(name, sizeof(name), "D%07u", i);
+            builder_add_subdir(&b, &dirs[(i - 1) / fanout], &dirs[i], name, (unsigned int)capacity);
+        }
+    }
+
+    // files in groups that are allocated together, interleaved when fragmented
+    unsigned int run = 0;
+    if (spec->fragmentation > 0) run = spec->fragmentation >= 100 ? 1 : 100 / spec->fragmentation;
+    unsigned long file = 0;
+    for (unsigned int i = 0; i < ndirs && !b.failed; i++) {
+        unsigned long count = per_dir + (i < extra);
+        for (unsigned long done = 0; done < count && !b.failed; ) {
+            unsigned int group = count - done > BUILDER_WRITERS ? BUILDER_WRITERS : (unsigned int)(count - done);
+            for (unsigned int k = 0; k < group; k++) sizes[k] = pick_size(&b, spec);
+            if (builder_alloc_files(&b, sizes, group, run, firsts) != 0) break;
+            for (unsigned int k = 0; k < group; k++) {
+                snprintf(name, sizeof(name), "F%07lu.DAT", file++);
+                builder_add_entry(&b, &dirs[i], name, ATTR_ARCHIVE, firsts[k], sizes[k]);
+            }
+            done += group;
+        }
+    }
+
+    for (unsigned int i = 0; dirs && i < ndirs; i++) {
+        if (dirs[i].entries) builder_close_dir(&b, &dirs[i]);
+    }
+    free(dirs);
+    free(sizes);
+    free(firsts);
+    int failed = builder_finish(&b, stats);
+    if (stats) stats->seconds = now_seconds() - start;
+    return failed;
+}
@@ -0,0 +1,299 @@
+#define _GNU_SOURCE // pwritev, fdatasync
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "structs.h"
+#include "commands.h"
+#include "block_cache.h"
+#include "journal.h"
+#include "trace.h"
+
+extern FS_STATE g_fs_state;
+
+static int g_fd = -1;             // the sidecar, -1 when journaling is off
+static char g_path[4096];
+static unsigned int g_sequence = 1;
+static int g_committing = 0;      // a commit is writing back, don't start another
+static JOURNAL_STATS g_stats;
+
+// records waiting for the next commit
+static unsigned char *g_pending = NULL;
+static size_t g_pending_cap = 0;
+static unsigned int g_records_at_op_start = 0;
+
+static unsigned int fnv1a(const unsigned char *p, size_t len) {
+    unsigned int h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// appends one record to the pending group. returns 0 on success
+static int add_record(unsigned int type, unsigned long long where, const void *data, size_t len) {
+    size_t need = g_stats.pending_bytes + sizeof(JOURNAL_RECORD) + len;
+    if (need > g_pending_cap) {
+        size_t cap = g_pending_cap ? g_pending_cap : 64 * 1024;
+        while (cap < need) cap *= 2;
+        unsigned char *grown = (unsigned char *)realloc(g_pending, cap);
+        if (!grown) return 1;
+        g_pending = grown;
+        g_pending_cap = cap;
+    }
+
+    JOURNAL_RECORD rec = { type, (unsigned int)len, where };
+    memcpy(g_pending + g_stats.pending_bytes, &rec, sizeof(rec));
+    memcpy(g_pending + g_stats.pending_bytes + sizeof(rec), data, len);
+    g_stats.pending_bytes = need;
+    g_stats.pending_records++;
+    return 0;
+}
+
+// writes one FAT sector image to the FAT copies the BPB on disk says are in use
+static int replay_fat_sector(unsigned int sector, const unsigned char *data, size_t len) {
+    int mirrored = fat_mirrored();
+    unsigned int copies = mirrored ? g_fs_state.fs_bpb.BPB_NumFATs : 1;
+    for (unsigned int i = 0; i < copies; i++) {
+        unsigned int n = mirrored ? i : active_fat();
+        long long offset = ((long long)g_fs_state.fs_bpb.BPB_RsvdSecCnt +
+                            (long long)n * g_fs_state.fs_bpb.BPB_FATSz32 + sector) *
+                           g_fs_state.fs_bpb.BPB_BytsPerSec;
+        if (image_write(offset, data, len) != 0) return 1;
+    }
+    return 0;
+}
+
+// applies every complete transaction in the journal, in order. stops at the first torn or
+// corrupt one: it was never committed. returns the number replayed, -1 on an I/O error
+static long replay(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) return -1;
+    if (st.st_size == 0) return 0;
+
+    size_t size = (size_t)st.st_size;
+    unsigned char *log = (unsigned char *)malloc(size);
+    if (!log) return -1;
+    size_t got = 0;
+    while (got < size) {
+        ssize_t n = pread(fd, log + got, size - got, (off_t)got);
+        if (n <= 0) {
+            free(log);
+            return -1;
+        }
+        got += (size_t)n;
+    }
+
+    long replayed = 0;
+    size_t pos = 0;
+    unsigned int expect = 0;
+    while (pos + sizeof(JOURNAL_HEADER) <= size) {
+        JOURNAL_HEADER hdr;
+        memcpy(&hdr, log + pos, sizeof(hdr));
+        if (hdr.magic != JOURNAL_MAGIC || (replayed > 0 && hdr.sequence != expect)) break;
+        if (hdr.bytes > size - pos - sizeof(hdr)) break;
+        const unsigned char *body = log + pos + sizeof(hdr);
+        if (fnv1a(body, hdr.bytes) != hdr.checksum) break;
+
+        // the checksum matched, so the records are well formed
+        size_t at = 0;
+        for (unsigned int r = 0; r < hdr.records && at + sizeof(JOURNAL_RECORD) <= hdr.bytes; r++) {
+            JOURNAL_RECORD rec;
+            memcpy(&rec, body + at, sizeof(rec));
+            const unsigned char *data = body + at + sizeof(rec);
+            int failed = rec.type == JREC_FAT_SECTOR ? replay_fat_sector((unsigned int)rec.where, data, rec.length)
+                                                     : image_write((long long)rec.where, data, rec.length);
+            if (failed) {
+                free(log);
+                return -1;
+            }
+            at += sizeof(rec) + rec.length;
+        }
+
+        replayed++;
+        expect = hdr.sequence + 1;
+        pos += sizeof(hdr) + hdr.bytes;
+    }
+
+    free(log);
+    return replayed;
+}
+
+// fsync for the image, msync when it is mapped
+static int sync_image() {
+    if (g_fs_state.image_map != NULL) {
+        image_sync();
+        return 0;
+    }
+    return fdatasync(g_fs_state.image_fd);
+}
+
+int journal_open(const char *image_path) {
+    memset(&g_stats, 0, sizeof(g_stats));
+    snprintf(g_path, sizeof(g_path), "%s%s", image_path, JOURNAL_SUFFIX);
+
+    // the mmap backend can't hold writes back until the journal is on disk, so it only replays
+    int mapped = g_fs_state.image_map != NULL;
+    int fd = open(g_path, mapped ? O_RDWR : O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        if (!mapped) fprintf(stderr, "Warning: Could not open journal '%s', metadata is written in place.\n", g_path);
+        return 0;
+    }
+
+    long replayed = replay(fd);
+    if (replayed < 0) {
+        fprintf(stderr, "Error: Failed to replay journal '%s'.\n", g_path);
+        close(fd);
+        return 1;
+    }
+    if (replayed > 0) {
+        if (sync_image() != 0) {
+            fprintf(stderr, "Error: Failed to sync the image after replaying the journal.\n");
+            close(fd);
+            return 1;
+        }
+        fprintf(stderr, "Replayed %ld journal transaction(s) from '%s'.\n", replayed, g_path);
+    }
+    g_stats.replayed = (unsigned long)replayed;
+
+    // everything in it is in the image now
+    if (ftruncate(fd, 0) != 0 || fsync(fd) != 0) {
+        fprintf(stderr, "Error: Failed to reset journal '%s'.\n", g_path);
+        close(fd);
+        return 1;
+    }
+
+    if (mapped) {
+        close(fd);
+        unlink(g_path);
+        return 0;
+    }
+    g_fd = fd;
+    g_stats.active = 1;
+    g_sequence = 1;
+    return 0;
+}
+
+void journal_close() {
+    if (g_fd < 0) return;
+    close(g_fd);
+    g_fd = -1;
+    g_stats.active = 0;
+    // an empty journal has nothing to replay, don't leave it lying around
+    if (g_stats.size == 0) unlink(g_path);
+    free(g_pending);
+    g_pending = NULL;
+    g_pending_cap = 0;
+}
+
+int journal_write(long long offset, const void *buf, size_t len) {
+    TRACE_NOTE_DIR(offset, len); // only directories come through here
+    if (g_fd >= 0 && add_record(JREC_BYTES, (unsigned long long)offset, buf, len) != 0) {
+        // no memory for the record: the commit makes what's pending safe, then write in place
+        if (journal_commit() != 0) return 1;
+        if (bcache_write(offset, buf, len) != 0) return 1;
+        return bcache_flush();
+    }
+    return bcache_write(offset, buf, len);
+}
+
+void journal_log_fat_sector(unsigned int sector, const void *data, size_t len) {
+    if (g_fd < 0) return;
+    if (add_record(JREC_FAT_SECTOR, sector, data, len) != 0) {
+        fprintf(stderr, "Error: Out of memory logging FAT sector %u\n", sector);
+    }
+}
+
+int journal_commit() {
+    if (g_fd < 0 || g_committing) return 0;
+
+    g_committing = 1;
+    log_fat_changes(); // the FAT sectors changed alongside the records
+    if (g_stats.pending_records == 0) {
+        g_committing = 0;
+        return 0;
+    }
+
+    JOURNAL_HEADER hdr;
+    hdr.magic = JOURNAL_MAGIC;
+    hdr.sequence = g_sequence;
+    hdr.records = g_stats.pending_records;
+    hdr.bytes = (unsigned int)g_stats.pending_bytes;
+    hdr.checksum = fnv1a(g_pending, g_stats.pending_bytes);
+
+    struct iovec iov[2] = {
+        { &hdr, sizeof(hdr) },
+        { g_pending, g_stats.pending_bytes },
+    };
+    size_t total = sizeof(hdr) + g_stats.pending_bytes;
+    ssize_t n = pwritev(g_fd, iov, 2, (off_t)g_stats.size);
+    if (n != (ssize_t)total || fdatasync(g_fd) != 0) {
+        fprintf(stderr, "Error: Failed to commit journal transaction %u: %s\n", g_sequence,
+                n < 0 ? strerror(errno) : "short write");
+        g_committing = 0;
+        return 1;
+    }
+
+    g_sequence++;
+    g_stats.size += (long long)total;
+    g_stats.bytes += total;
+    g_stats.fsyncs++;
+    g_stats.transactions++;
+    g_stats.records += g_stats.pending_records;
+    g_stats.pending_records = 0;
+    g_stats.pending_bytes = 0;
+    g_stats.pending_ops = 0;
+    g_records_at_op_start = 0;
+
+    // committed, the cached metadata can go to its home location now
+    int status = bcache_flush();
+    g_committing = 0;
+    return status;
+}
+
+void journal_end_op() {
+    // no journal: metadata goes out at the end of every command, as it always did
+    if (g_fd < 0) {
+        bcache_flush();
+        return;
+    }
+
+    if (g_stats.pending_records != g_records_at_op_start) g_stats.pending_ops++;
+    g_records_at_op_start = g_stats.pending_records;
+
+    if (g_stats.pending_ops >= JOURNAL_GROUP_OPS || g_stats.pending_bytes >= JOURNAL_GROUP_BYTES) {
+        journal_commit();
+    }
+    if (g_stats.size >= (long long)JOURNAL_MAX_BYTES) {
+        journal_checkpoint();
+    }
+}
+
+int journal_checkpoint() {
+    int status = 0;
+    if (journal_commit() != 0) status = 1;
+    if (bcache_flush() != 0) status = 1;
+    // a FAT sector that didn't reach the image only exists in the journal, so keep it
+    if (flush_fat_table() != 0) status = 1;
+    if (g_fd < 0 || status != 0) return status;
+
+    // the image has to be on disk before the journal can forget it
+    if (g_stats.size > 0) {
+        if (sync_image() != 0 || ftruncate(g_fd, 0) != 0) {
+            fprintf(stderr, "Error: Failed to checkpoint the journal: %s\n", strerror(errno));
+            return 1;
+        }
+        g_stats.size = 0;
+        g_stats.checkpoints++;
+    }
+    return 0;
+}
+
+void journal_get_stats(JOURNAL_STATS *stats) {
+    *stats = g_stats;
+}
@@ -4,18 +4,13 @@
 #include <string.h> 
 
 
-extern int start_program_shell(int argc, char *argv[]); 
-
-int main(int argc, char *argv[])
-{
-    return start_program_shell(argc, argv);
-}
-
 tokenlist *new_tokenlist(void) {
     tokenlist *tokens = (tokenlist *)malloc(sizeof(tokenlist));
     if (!tokens) { perror("Failed to allocate tokenlist"); exit(EXIT_FAILURE); }
     
     tokens->size = 0;
+    tokens->capacity = 1;
+    tokens->quoted = -1;
     tokens->items = (char **)malloc(sizeof(char *)); 
     if (!tokens->items) { perror("Failed to allocate token array"); exit(EXIT_FAILURE); }
     tokens->items[0] = NULL; 
@@ -35,6 +30,7 @@ void add_token(tokenlist *tokens, char *item) {
     tokens->items[i + 1] = NULL; 
 
     tokens->size += 1;
+    tokens->capacity = i + 2;
 }
 
 tokenlist *get_tokens(char *input) {
@@ -64,4 +60,56 @@ void free_tokens(tokenlist *tokens) {
     }
     free(tokens->items);
     free(tokens);
-}
\ No newline at end of file
+}
+
+// IN PLACE TOKENIZER -----------------------------------------
+
+// appends a pointer to the item array, growing it (doubling) only when it's full
+static void push_token(tokenlist *tokens, char *item) {
+    if (tokens->size + 1 >= tokens->capacity) {
+        size_t capacity = tokens->capacity ? tokens->capacity * 2 : 8;
+        tokens->items = (char **)realloc(tokens->items, capacity * sizeof(char *));
+        if (!tokens->items) { perror("Failed to reallocate token array"); exit(EXIT_FAILURE); }
+        tokens->capacity = capacity;
+    }
+    tokens->items[tokens->size++] = item;
+    tokens->items[tokens->size] = NULL;
+}
+
+// splits line into tokens by writing '\0' over the separators, so the tokens point into
+// line and nothing is copied. the item array is kept and reused from line to line and
+// only grows when a line has more tokens than any line before it.
+// everything between the first and last double quote is one token (quotes dropped),
+// its index goes in quoted (-1 if the line has no quoted part)
+void tokenize_in_place(tokenlist *tokens, char *line) {
+    char *open_quote = strchr(line, '"');
+    char *close_quote = open_quote ? strrchr(line, '"') : NULL;
+    if (close_quote == open_quote) open_quote = close_quote = NULL; // a lone quote is just a character
+
+    tokens->size = 0;
+    tokens->quoted = -1;
+    if (tokens->items) tokens->items[0] = NULL;
+
+    char *p = line;
+    for (;;) {
+        while (*p == ' ' || *p == '\t') p++;
+
+        if (p == open_quote) {
+            *close_quote = '\0';
+            tokens->quoted = (int)tokens->size;
+            push_token(tokens, p + 1);
+            p = close_quote + 1;
+            continue;
+        }
+        if (*p == '\0') break;
+
+        push_token(tokens, p);
+        while (*p != '\0' && *p != ' ' && *p != '\t' && p != open_quote) p++;
+        if (p == open_quote) {
+            // the word runs into the quote, end it there and take the quoted part next
+            *p = '\0';
+            continue;
+        }
+        if (*p != '\0') *p++ = '\0';
+    }
+}
@@ -0,0 +1,6 @@
+extern int start_program_shell(int argc, char *argv[]); 
+
+int main(int argc, char *argv[])
+{
+    return start_program_shell(argc, argv);
+}
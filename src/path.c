@@ -0,0 +1,130 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "structs.h"
+#include "dentry.h"
+#include "path.h"
+
+// HELPERS -----------------------------------------
+
+// walks a normalized directory path ("/A/B/") down to its cluster
+static int walk(const char *canon, unsigned int *cluster) {
+    unsigned int current = g_fs_state.fs_bpb.BPB_RootClus;
+    const char *p = canon + 1;
+
+    // paths under the current directory start from it instead of the root
+    size_t cwd_len = strlen(g_fs_state.current_path);
+    if (strncmp(canon, g_fs_state.current_path, cwd_len) == 0) {
+        current = g_fs_state.current_cluster < 2 ? g_fs_state.fs_bpb.BPB_RootClus : g_fs_state.current_cluster;
+        p = canon + cwd_len;
+    }
+
+    while (*p != '\0') {
+        const char *slash = strchr(p, '/');
+        size_t len = slash ? (size_t)(slash - p) : strlen(p);
+        char name[DIR_NAME_MAX];
+        if (len >= sizeof(name)) return PATH_NOT_FOUND;
+        memcpy(name, p, len);
+        name[len] = '\0';
+
+        DIR_ENTRY entry;
+        int found = dentry_lookup(current, name, &entry, NULL);
+        if (found < 0) return PATH_IO_ERROR;
+        if (found == 0) return PATH_NOT_FOUND;
+        if (!(entry.DIR_Attr & ATTR_DIRECTORY)) return PATH_NOT_DIR;
+
+        current = (unsigned int)entry.DIR_FstClusHI << 16 | entry.DIR_FstClusLO;
+        if (current < 2) current = g_fs_state.fs_bpb.BPB_RootClus;
+
+        p += len;
+        if (*p == '/') p++;
+    }
+
+    *cluster = current;
+    return PATH_OK;
+}
+
+// PATH API -----------------------------------------
+
+int path_normalize(const char *path, char *out, size_t out_size) {
+    if (out_size < 2) return PATH_INVALID;
+
+    // relative paths start from the current directory
+    const char *parts[2] = { path, NULL };
+    if (path[0] != '/') {
+        parts[0] = g_fs_state.current_path;
+        parts[1] = path;
+    }
+
+    size_t len = 1;
+    out[0] = '/';
+    out[1] = '\0';
+
+    for (int i = 0; i < 2 && parts[i] != NULL; i++) {
+        const char *p = parts[i];
+        while (*p != '\0') {
+            while (*p == '/') p++;
+            if (*p == '\0') break;
+
+            const char *end = strchr(p, '/');
+            size_t n = end ? (size_t)(end - p) : strlen(p);
+
+            if (n == 1 && p[0] == '.') {
+                // stays put
+            } else if (n == 2 && p[0] == '.' && p[1] == '.') {
+                // drop the last name, the root's parent is the root
+                if (len > 1) {
+                    len--;
+                    while (len > 0 && out[len - 1] != '/') len--;
+                    out[len] = '\0';
+                }
+            } else {
+                if (len + n + 2 > out_size) return PATH_INVALID;
+                memcpy(out + len, p, n);
+                len += n;
+                out[len++] = '/';
+                out[len] = '\0';
+            }
+            p += n;
+        }
+    }
+    return PATH_OK;
+}
+
+int path_resolve_dir(const char *path, unsigned int *cluster, char *canon, size_t canon_size) {
+    char buf[sizeof(g_fs_state.current_path)];
+    int err = path_normalize(path, buf, sizeof(buf));
+    if (err != PATH_OK) return err;
+
+    err = walk(buf, cluster);
+    if (err == PATH_OK && canon != NULL) {
+        if (strlen(buf) >= canon_size) return PATH_INVALID;
+        strcpy(canon, buf);
+    }
+    return err;
+}
+
+int path_resolve_parent(const char *path, unsigned int *parent, char *parent_path, size_t parent_path_size,
+                        char *leaf, size_t leaf_size) {
+    char buf[sizeof(g_fs_state.current_path)];
+    int err = path_normalize(path, buf, sizeof(buf));
+    if (err != PATH_OK) return err;
+
+    // the root has no name of its own
+    size_t len = strlen(buf);
+    if (len <= 1) return PATH_INVALID;
+
+    // split "/A/B/NAME/" into "/A/B/" and "NAME"
+    buf[len - 1] = '\0';
+    char *last_slash = strrchr(buf, '/');
+    if (strlen(last_slash + 1) >= leaf_size) return PATH_INVALID;
+    strcpy(leaf, last_slash + 1);
+    last_slash[1] = '\0';
+
+    err = walk(buf, parent);
+    if (err == PATH_OK && parent_path != NULL) {
+        if (strlen(buf) >= parent_path_size) return PATH_INVALID;
+        strcpy(parent_path, buf);
+    }
+    return err;
+}
@@ -0,0 +1,421 @@
+#define _GNU_SOURCE // preadv, pthreads
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include "structs.h"
+#include "commands.h"
+#include "readahead.h"
+#include "trace.h"
+
+// slot states
+#define SLOT_EMPTY 0
+#define SLOT_PENDING 1 // queued or being read by the thread, never evicted
+#define SLOT_READY 2
+
+// one prefetched cluster
+typedef struct {
+    unsigned int cluster;  // physical cluster held
+    int state;
+    int used;              // a read has copied from it
+    unsigned long gen;     // write generation when it was queued
+    int hash_next;         // next slot in the bucket, -1 = end
+    unsigned char *data;
+} RA_SLOT;
+
+// one contiguous run for the thread to read
+typedef struct {
+    unsigned int cluster;  // first physical cluster
+    unsigned int count;
+    int slots[RA_RUN_MAX];
+} RA_REQUEST;
+
+// pool state, everything below is guarded by g_lock
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_work = PTHREAD_COND_INITIALIZER;   // queue got a request or stop was set
+static pthread_cond_t g_done = PTHREAD_COND_INITIALIZER;   // a request finished
+static pthread_t g_thread;
+static int g_running = 0;
+static int g_stop = 0;
+static int g_enabled = 1;
+
+static size_t g_cluster_size = 0;
+static unsigned char *g_pool = NULL;
+static RA_SLOT *g_slots = NULL;
+static unsigned int g_num_slots = 0;
+static unsigned int g_hand = 0;          // clock hand for picking slots to reuse
+static int *g_buckets = NULL;
+static unsigned int g_num_buckets = 0;   // power of two
+static unsigned long g_gen = 1;
+
+static RA_REQUEST g_queue[RA_QUEUE_LEN];
+static unsigned int g_queue_head = 0, g_queue_len = 0;
+
+static READAHEAD_STATS g_stats;
+
+// HELPERS -----------------------------------------
+
+static unsigned int hash_cluster(unsigned int cluster) {
+    return (cluster * 2654435761u) & (g_num_buckets - 1);
+}
+
+static int find_slot(unsigned int cluster) {
+    int i = g_buckets[hash_cluster(cluster)];
+    while (i >= 0 && g_slots[i].cluster != cluster) {
+        i = g_slots[i].hash_next;
+    }
+    return i;
+}
+
+static void unhash_slot(int i) {
+    int *link = &g_buckets[hash_cluster(g_slots[i].cluster)];
+    while (*link >= 0 && *link != i) {
+        link = &g_slots[*link].hash_next;
+    }
+    if (*link == i) *link = g_slots[i].hash_next;
+}
+
+// empties a slot that isn't pending
+static void drop_slot(int i) {
+    if (g_slots[i].state == SLOT_EMPTY) return;
+    if (!g_slots[i].used) g_stats.wasted++;
+    unhash_slot(i);
+    g_slots[i].state = SLOT_EMPTY;
+}
+
+// takes a slot for cluster, reusing the next one the clock hand finds that isn't pending.
+// returns -1 when every slot is pending
+static int claim_slot(unsigned int cluster) {
+    for (unsigned int tries = 0; tries < g_num_slots; tries++) {
+        int i = (int)g_hand;
+        g_hand = (g_hand + 1) % g_num_slots;
+        if (g_slots[i].state == SLOT_PENDING) continue;
+
+        drop_slot(i);
+        g_slots[i].cluster = cluster;
+        g_slots[i].state = SLOT_PENDING;
+        g_slots[i].used = 0;
+        g_slots[i].gen = g_gen;
+        unsigned int h = hash_cluster(cluster);
+        g_slots[i].hash_next = g_buckets[h];
+        g_buckets[h] = i;
+        return i;
+    }
+    return -1;
+}
+
+// slot holding a current copy of cluster (ready or on its way), -1 if there isn't one
+static int live_slot(unsigned int cluster) {
+    int i = find_slot(cluster);
+    if (i >= 0 && g_slots[i].state == SLOT_READY && g_slots[i].gen != g_gen) {
+        drop_slot(i); // read before a write, can't be trusted
+        return -1;
+    }
+    return i;
+}
+
+// THREAD -----------------------------------------
+
+static void *readahead_thread(void *arg) {
+    struct iovec iov[RA_RUN_MAX];
+
+    pthread_mutex_lock(&g_lock);
+    while (1) {
+        while (g_queue_len == 0 && !g_stop) {
+            pthread_cond_wait(&g_work, &g_lock);
+        }
+        if (g_stop) break;
+
+        RA_REQUEST req = g_queue[g_queue_head];
+        g_queue_head = (g_queue_head + 1) % RA_QUEUE_LEN;
+        g_queue_len--;
+
+        // pending slots can't be reused, so their buffers are safe to fill unlocked
+        for (unsigned int k = 0; k < req.count; k++) {
+            iov[k].iov_base = g_slots[req.slots[k]].data;
+            iov[k].iov_len = g_cluster_size;
+        }
+        pthread_mutex_unlock(&g_lock);
+
+        long long offset = (long long)get_cluster_sector(req.cluster) * g_fs_state.fs_bpb.BPB_BytsPerSec;
+        size_t want = (size_t)req.count * g_cluster_size;
+        ssize_t n;
+        long long start = TRACE_CLOCK();
+        do {
+            n = preadv(g_fs_state.image_fd, iov, (int)req.count, offset);
+        } while (n < 0 && errno == EINTR);
+        if (start != 0) trace_io(start, offset, want, 0, 1);
+
+        pthread_mutex_lock(&g_lock);
+        g_stats.prefetch_reads++;
+
+        // clusters that came in whole are ready, the rest (short read or error) are dropped
+        size_t got = n > 0 ? (size_t)n : 0;
+        if (got > want) got = want;
+        for (unsigned int k = 0; k < req.count; k++) {
+            RA_SLOT *slot = &g_slots[req.slots[k]];
+            if ((size_t)(k + 1) * g_cluster_size <= got) {
+                slot->state = SLOT_READY;
+                g_stats.prefetched++;
+            } else {
+                slot->used = 1; // not worth counting as waste
+                drop_slot(req.slots[k]);
+            }
+        }
+        pthread_cond_broadcast(&g_done);
+    }
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+// queues what it can of a physical run, skipping clusters already in the pool.
+// returns how many clusters from the start of the run are taken care of
+static unsigned int queue_run(unsigned int cluster, unsigned int count) {
+    unsigned int done = 0;
+    while (done < count) {
+        if (live_slot(cluster + done) >= 0) {
+            done++;
+            continue;
+        }
+        if (g_queue_len == RA_QUEUE_LEN) break;
+
+        RA_REQUEST *req = &g_queue[(g_queue_head + g_queue_len) % RA_QUEUE_LEN];
+        req->cluster = cluster + done;
+        req->count = 0;
+        while (done < count && req->count < RA_RUN_MAX && live_slot(cluster + done) < 0) {
+            int i = claim_slot(cluster + done);
+            if (i < 0) break;
+            req->slots[req->count++] = i;
+            done++;
+        }
+        if (req->count == 0) break; // pool is full of pending reads
+        g_queue_len++;
+        pthread_cond_signal(&g_work);
+    }
+    return done;
+}
+
+// SETUP -----------------------------------------
+
+void readahead_init(size_t cluster_size) {
+    readahead_shutdown();
+    memset(&g_stats, 0, sizeof(g_stats));
+    g_cluster_size = cluster_size;
+
+    // mmap backend: the kernel does the reading, we only hint
+    if (g_fs_state.image_map != NULL) return;
+
+    g_num_slots = (unsigned int)(RA_POOL_BYTES / cluster_size);
+    if (g_num_slots < 16) g_num_slots = 16;
+    g_num_buckets = 64;
+    while (g_num_buckets < g_num_slots * 2) g_num_buckets *= 2;
+
+    g_pool = (unsigned char *)malloc((size_t)g_num_slots * cluster_size);
+    g_slots = (RA_SLOT *)calloc(g_num_slots, sizeof(RA_SLOT));
+    g_buckets = (int *)malloc(g_num_buckets * sizeof(int));
+    if (!g_pool || !g_slots || !g_buckets) {
+        fprintf(stderr, "Error: Memory allocation failed for read-ahead, running without it.\n");
+        readahead_shutdown();
+        return;
+    }
+    for (unsigned int i = 0; i < g_num_slots; i++) {
+        g_slots[i].data = g_pool + (size_t)i * cluster_size;
+    }
+    memset(g_buckets, 0xFF, g_num_buckets * sizeof(int)); // all -1
+
+    g_stop = 0;
+    g_queue_head = g_queue_len = 0;
+    if (pthread_create(&g_thread, NULL, readahead_thread, NULL) != 0) {
+        fprintf(stderr, "Error: Could not start the read-ahead thread, running without it.\n");
+        readahead_shutdown();
+        return;
+    }
+    g_running = 1;
+    g_stats.slots = g_num_slots;
+    g_stats.threaded = 1;
+}
+
+void readahead_shutdown() {
+    if (g_running) {
+        pthread_mutex_lock(&g_lock);
+        g_stop = 1;
+        pthread_cond_broadcast(&g_work);
+        pthread_mutex_unlock(&g_lock);
+        pthread_join(g_thread, NULL);
+        g_running = 0;
+    }
+    free(g_pool);
+    free(g_slots);
+    free(g_buckets);
+    g_pool = NULL;
+    g_slots = NULL;
+    g_buckets = NULL;
+    g_num_slots = 0;
+    g_num_buckets = 0;
+    g_hand = 0;
+    g_stats.slots = 0;
+    g_stats.threaded = 0;
+}
+
+void readahead_set_enabled(int enabled) {
+    g_enabled = enabled;
+}
+
+// READ SIDE -----------------------------------------
+
+void readahead_reset(OPEN_FILE *of) {
+    of->ra.next_offset = 0;
+    of->ra.window = 0;
+    of->ra.ahead = 0;
+}
+
+int readahead_begin(OPEN_FILE *of, long len) {
+    unsigned int min_window = (unsigned int)((RA_MIN_WINDOW_BYTES + g_cluster_size - 1) / g_cluster_size);
+
+    // picking up where the last read stopped = sequential, anything else shrinks the window
+    if (of->offset == of->ra.next_offset) {
+        if (of->ra.window < min_window) of->ra.window = min_window;
+    } else {
+        of->ra.window /= 2;
+        if (of->ra.window < min_window) of->ra.window = 0;
+        of->ra.ahead = 0;
+    }
+    of->ra.next_offset = of->offset + len;
+
+    if (!g_enabled || of->ra.window == 0 || g_cluster_size == 0) return 0;
+
+    // keep window clusters queued past the end of this read (its last cluster included,
+    // the next read starts there)
+    unsigned int file_clusters = (unsigned int)(((unsigned long long)of->file_size + g_cluster_size - 1) / g_cluster_size);
+    unsigned int from = (unsigned int)((of->offset + len) / (long)g_cluster_size);
+    unsigned int to = from + of->ra.window;
+    if (to > file_clusters) to = file_clusters;
+    if (of->ra.ahead > from) {
+        // still well ahead of the reader: top up in one batch once it is halfway through
+        if (of->ra.ahead - from > of->ra.window / 2) return 1;
+        from = of->ra.ahead;
+    }
+
+    if (!g_running) {
+        // mmap: tell the kernel which pages are next
+        while (from < to) {
+            unsigned int run_left = 0;
+            unsigned int cluster = lookup_file_cluster(of, from, &run_left);
+            if (cluster >= 0x0FFFFFF8) break;
+            if (run_left > to - from) run_left = to - from;
+            image_prefetch((long long)get_cluster_sector(cluster) * g_fs_state.fs_bpb.BPB_BytsPerSec,
+                           (size_t)run_left * g_cluster_size);
+            from += run_left;
+        }
+        of->ra.ahead = from;
+        return 0;
+    }
+
+    // find the runs first: without a resident FAT that reads the image, and the thread
+    // shouldn't wait on g_lock for it. what doesn't fit here gets queued next read
+    unsigned int run_cluster[RA_QUEUE_LEN], run_count[RA_QUEUE_LEN];
+    unsigned int runs = 0;
+    for (unsigned int at = from; at < to && runs < RA_QUEUE_LEN; runs++) {
+        unsigned int run_left = 0;
+        unsigned int cluster = lookup_file_cluster(of, at, &run_left);
+        if (cluster >= 0x0FFFFFF8) break;
+        if (run_left > to - at) run_left = to - at;
+        run_cluster[runs] = cluster;
+        run_count[runs] = run_left;
+        at += run_left;
+    }
+
+    pthread_mutex_lock(&g_lock);
+    for (unsigned int r = 0; r < runs; r++) {
+        unsigned int queued = queue_run(run_cluster[r], run_count[r]);
+        from += queued;
+        if (queued < run_count[r]) break; // queue or pool is full, try again next read
+    }
+    pthread_mutex_unlock(&g_lock);
+    of->ra.ahead = from;
+    return 1;
+}
+
+void readahead_end(OPEN_FILE *of, int missed) {
+    unsigned int max_window = (unsigned int)(RA_MAX_WINDOW_BYTES / g_cluster_size);
+    unsigned int min_window = (unsigned int)((RA_MIN_WINDOW_BYTES + g_cluster_size - 1) / g_cluster_size);
+    if (max_window < min_window) max_window = min_window;
+    if (of->ra.window == 0) return;
+
+    // the prefetch kept up: look further ahead. it didn't: pull back
+    if (missed) {
+        of->ra.window /= 2;
+        if (of->ra.window < min_window) of->ra.window = min_window;
+    } else {
+        of->ra.window *= 2;
+        if (of->ra.window > max_window) of->ra.window = max_window;
+    }
+}
+
+int readahead_copy(long long offset, void *buf, size_t len) {
+    if (!g_running || !g_enabled || len == 0) return 1;
+
+    unsigned int bytes_per_sector = g_fs_state.fs_bpb.BPB_BytsPerSec;
+    long long data_start = (long long)get_first_data_sector() * bytes_per_sector;
+    unsigned char *out = (unsigned char *)buf;
+
+    pthread_mutex_lock(&g_lock);
+    while (len > 0) {
+        unsigned int cluster = (unsigned int)((offset - data_start) / (long long)g_cluster_size) + 2;
+        size_t into = (size_t)((offset - data_start) % (long long)g_cluster_size);
+        size_t n = g_cluster_size - into;
+        if (n > len) n = len;
+
+        int i = live_slot(cluster);
+        if (i >= 0 && g_slots[i].state == SLOT_PENDING) {
+            g_stats.waits++;
+            while (g_slots[i].state == SLOT_PENDING) {
+                pthread_cond_wait(&g_done, &g_lock);
+            }
+            i = live_slot(cluster); // the read may have failed
+        }
+        if (i < 0 || g_slots[i].state != SLOT_READY) {
+            g_stats.misses++;
+            pthread_mutex_unlock(&g_lock);
+            return 1;
+        }
+
+        memcpy(out, g_slots[i].data + into, n);
+        g_slots[i].used = 1;
+        out += n;
+        offset += (long long)n;
+        len -= n;
+    }
+    g_stats.hits++;
+    pthread_mutex_unlock(&g_lock);
+    return 0;
+}
+
+void readahead_invalidate() {
+    if (!g_running) return;
+    pthread_mutex_lock(&g_lock);
+    g_gen++;
+    pthread_mutex_unlock(&g_lock);
+}
+
+// STATS -----------------------------------------
+
+void readahead_get_stats(READAHEAD_STATS *stats) {
+    pthread_mutex_lock(&g_lock);
+    *stats = g_stats;
+    pthread_mutex_unlock(&g_lock);
+    stats->enabled = g_enabled;
+}
+
+void readahead_reset_stats() {
+    pthread_mutex_lock(&g_lock);
+    unsigned int slots = g_stats.slots;
+    int threaded = g_stats.threaded;
+    memset(&g_stats, 0, sizeof(g_stats));
+    g_stats.slots = slots;
+    g_stats.threaded = threaded;
+    pthread_mutex_unlock(&g_lock);
+}
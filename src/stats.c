@@ -0,0 +1,167 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+#include "block_cache.h"
+
+#ifdef FS_INSTRUMENT
+
+FS_COUNTERS g_counters;
+static long long g_last_end = -1;
+static COMMAND_STATS g_command_stats[STATS_MAX_COMMANDS];
+static unsigned int g_command_count = 0;
+
+static long long now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void stats_access(long long offset, size_t len, int write) {
+    if (offset != g_last_end) g_counters.seeks++;
+    g_last_end = offset + (long long)len;
+    if (write) {
+        g_counters.writes++;
+        g_counters.bytes_written += len;
+    } else {
+        g_counters.reads++;
+        g_counters.bytes_read += len;
+    }
+}
+
+// the block cache keeps its own hit and miss counts
+static void take_counters(FS_COUNTERS *out) {
+    BCACHE_STATS cache;
+    bcache_get_stats(&cache);
+    *out = g_counters;
+    out->cache_hits = cache.hits;
+    out->cache_misses = cache.misses;
+}
+
+void stats_begin(STATS_SAMPLE *sample) {
+    take_counters(&sample->counters);
+    sample->start_ns = now_ns();
+}
+
+// a - b field by field, counters reset in between count from 0
+#define DELTA(field) d->field = a->field >= b->field ? a->field - b->field : a->field
+static void subtract(FS_COUNTERS *d, const FS_COUNTERS *a, const FS_COUNTERS *b) {
+    DELTA(reads); DELTA(writes); DELTA(bytes_read); DELTA(bytes_written); DELTA(seeks);
+    DELTA(fat_lookups); DELTA(fat_disk_lookups); DELTA(fat_updates); DELTA(chain_steps);
+    DELTA(allocations); DELTA(cache_hits); DELTA(cache_misses);
+}
+
+#define ACCUMULATE(field) total->field += d->field
+static void accumulate(FS_COUNTERS *total, const FS_COUNTERS *d) {
+    ACCUMULATE(reads); ACCUMULATE(writes); ACCUMULATE(bytes_read); ACCUMULATE(bytes_written);
+    ACCUMULATE(seeks); ACCUMULATE(fat_lookups); ACCUMULATE(fat_disk_lookups); ACCUMULATE(fat_updates);
+    ACCUMULATE(chain_steps); ACCUMULATE(allocations); ACCUMULATE(cache_hits); ACCUMULATE(cache_misses);
+}
+
+static unsigned int bucket_of(long long ns) {
+    unsigned long long us = (unsigned long long)ns / 1000;
+    unsigned int b = 0;
+    while (us > 0 && b < STATS_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    return b;
+}
+
+// command names come from the command table, so the pointer stays valid
+static COMMAND_STATS *command_stats(const char *name) {
+    for (unsigned int i = 0; i < g_command_count; i++) {
+        if (strcmp(g_command_stats[i].name, name) == 0) return &g_command_stats[i];
+    }
+    if (g_command_count == STATS_MAX_COMMANDS) return NULL;
+    COMMAND_STATS *c = &g_command_stats[g_command_count++];
+    memset(c, 0, sizeof(*c));
+    c->name = name;
+    return c;
+}
+
+long long stats_end(const char *name, const STATS_SAMPLE *sample, FS_COUNTERS *delta) {
+    long long ns = now_ns() - sample->start_ns;
+    FS_COUNTERS now, d;
+    take_counters(&now);
+    subtract(&d, &now, &sample->counters);
+    if (delta != NULL) *delta = d;
+
+    COMMAND_STATS *c = command_stats(name);
+    if (c != NULL) {
+        c->count++;
+        c->total_ns += (unsigned long long)ns;
+        if ((unsigned long long)ns > c->max_ns) c->max_ns = (unsigned long long)ns;
+        c->buckets[bucket_of(ns)]++;
+        accumulate(&c->counters, &d);
+    }
+    return ns;
+}
+
+void stats_print_cost(const char *name, long long ns, const FS_COUNTERS *d) {
+    printf("time %s: %.1f us\n", name, ns / 1e3);
+    printf("  I/O: %lu reads (%llu bytes), %lu writes (%llu bytes), %lu seeks\n",
+           d->reads, d->bytes_read, d->writes, d->bytes_written, d->seeks);
+    printf("  FAT: %lu lookups (%lu from disk), %lu updates, %lu chain steps, %lu allocations\n",
+           d->fat_lookups, d->fat_disk_lookups, d->fat_updates, d->chain_steps, d->allocations);
+    printf("  Block cache: %lu hits, %lu misses\n", d->cache_hits, d->cache_misses);
+}
+
+static void print_bucket(unsigned int b, unsigned long count) {
+    if (b == 0) printf(" <1us:%lu", count);
+    else if (b == STATS_BUCKETS - 1) printf(" >=%luus:%lu", 1UL << (b - 1), count);
+    else printf(" %lu-%luus:%lu", 1UL << (b - 1), 1UL << b, count);
+}
+
+int stats_command(char *arg) {
+    if (arg != NULL && strcmp(arg, "reset") == 0) {
+        memset(&g_counters, 0, sizeof(g_counters));
+        g_command_count = 0;
+        g_last_end = -1;
+        return 0;
+    }
+    if (arg != NULL) {
+        printf("Error: Usage: stats [reset]\n");
+        return 1;
+    }
+
+    FS_COUNTERS total;
+    take_counters(&total);
+    printf("I/O: %lu reads (%llu bytes), %lu writes (%llu bytes), %lu seeks\n",
+           total.reads, total.bytes_read, total.writes, total.bytes_written, total.seeks);
+    printf("FAT: %lu lookups (%lu from disk), %lu updates, %lu chain steps, %lu allocations\n",
+           total.fat_lookups, total.fat_disk_lookups, total.fat_updates, total.chain_steps, total.allocations);
+    printf("Block cache: %lu hits, %lu misses\n", total.cache_hits, total.cache_misses);
+    if (g_command_count == 0) return 0;
+
+    printf("%-10s %8s %10s %10s %8s %8s %8s %8s %8s %8s\n", "command", "count", "mean us", "max us",
+           "reads", "writes", "seeks", "fat", "steps", "allocs");
+    for (unsigned int i = 0; i < g_command_count; i++) {
+        COMMAND_STATS *c = &g_command_stats[i];
+        printf("%-10s %8lu %10.1f %10.1f %8lu %8lu %8lu %8lu %8lu %8lu\n", c->name, c->count,
+               c->total_ns / 1e3 / c->count, c->max_ns / 1e3, c->counters.reads, c->counters.writes,
+               c->counters.seeks, c->counters.fat_lookups, c->counters.chain_steps, c->counters.allocations);
+    }
+    printf("Latency histograms:\n");
+    for (unsigned int i = 0; i < g_command_count; i++) {
+        COMMAND_STATS *c = &g_command_stats[i];
+        printf("  %-10s", c->name);
+        for (unsigned int b = 0; b < STATS_BUCKETS; b++) {
+            if (c->buckets[b] != 0) print_bucket(b, c->buckets[b]);
+        }
+        printf("\n");
+    }
+    return 0;
+}
+
+#else
+
+// uninstrumented build: nothing was counted
+int stats_command(char *arg) {
+    (void)arg;
+    printf("Error: Built without instrumentation, rebuild with 'make clean && make INSTRUMENT=1'.\n");
+    return 1;
+}
+
+#endif // FS_INSTRUMENT
@@ -0,0 +1,231 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "structs.h"
+#include "commands.h"
+#include "trace.h"
+
+int g_trace_on = 0;
+
+static TRACE_RECORD *g_ring = NULL;
+static unsigned long long g_next = 0;  // records ever written, the ring index is g_next % TRACE_RECORDS
+static long long g_epoch = 0;
+static const char *g_exit_path = NULL;
+
+// origin names, 0 and 1 are fixed, commands are added as they first run
+static const char *g_origins[TRACE_MAX_ORIGINS] = { "shell", "readahead" };
+static unsigned int g_origin_count = 2;
+static unsigned short g_origin = 0;
+
+// region bounds, in bytes, and one bit per cluster that held a directory
+static long long g_fat_start;
+static long long g_data_start;
+static unsigned int g_cluster_bytes;
+static unsigned int g_max_cluster;
+static unsigned char *g_dir_map = NULL;
+
+static const char *g_region_names[] = { "boot", "fat", "dir", "data" };
+
+// HELPERS -----------------------------------------
+
+long long trace_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static unsigned char region_of(long long offset) {
+    if (offset < g_fat_start) return TRACE_BOOT;
+    if (offset < g_data_start) return TRACE_FAT;
+    unsigned long long cluster = (unsigned long long)(offset - g_data_start) / g_cluster_bytes + 2;
+    if (cluster <= g_max_cluster && (g_dir_map[cluster >> 3] & (1u << (cluster & 7)))) return TRACE_DIR;
+    return TRACE_DATA;
+}
+
+// TRACING -----------------------------------------
+
+// the slot comes from an atomic add, so the read-ahead thread and the shell never share one
+void trace_io(long long start, long long offset, size_t len, int write, int background) {
+    long long end = trace_clock();
+    unsigned long long i = __atomic_fetch_add(&g_next, 1, __ATOMIC_RELAXED);
+    TRACE_RECORD *r = &g_ring[i & (TRACE_RECORDS - 1)];
+    r->ns = (unsigned long long)(start - g_epoch);
+    r->offset = (unsigned long long)offset;
+    r->len = len > 0xFFFFFFFFu ? 0xFFFFFFFFu : (unsigned int)len;
+    r->dur_ns = end - start > 0xFFFFFFFFLL ? 0xFFFFFFFFu : (unsigned int)(end - start);
+    r->write = (unsigned char)write;
+    // read-ahead only ever reads file data, and the directory map belongs to the shell
+    if (background) {
+        r->origin = 1;
+        r->region = TRACE_DATA;
+    } else {
+        r->origin = g_origin;
+        r->region = region_of(offset);
+    }
+}
+
+// names come from the command table, so comparing pointers is enough
+void trace_set_command(const char *name) {
+    if (name == NULL) {
+        g_origin = 0;
+        return;
+    }
+    for (unsigned int i = 2; i < g_origin_count; i++) {
+        if (g_origins[i] == name) {
+            g_origin = (unsigned short)i;
+            return;
+        }
+    }
+    if (g_origin_count == TRACE_MAX_ORIGINS) {
+        g_origin = 0;
+        return;
+    }
+    g_origins[g_origin_count] = name;
+    g_origin = (unsigned short)g_origin_count++;
+}
+
+void trace_note_dir(long long offset, size_t len) {
+    if (offset < g_data_start || len == 0) return;
+    unsigned long long first = (unsigned long long)(offset - g_data_start) / g_cluster_bytes + 2;
+    unsigned long long last = (unsigned long long)(offset + (long long)len - 1 - g_data_start) / g_cluster_bytes + 2;
+    for (unsigned long long c = first; c <= last && c <= g_max_cluster; c++) {
+        g_dir_map[c >> 3] |= (unsigned char)(1u << (c & 7));
+    }
+}
+
+int trace_start() {
+    if (g_ring == NULL) {
+        g_ring = malloc((size_t)TRACE_RECORDS * sizeof(TRACE_RECORD));
+        g_max_cluster = get_total_clusters() + 1;
+        g_dir_map = calloc(g_max_cluster / 8 + 1, 1);
+        if (g_ring == NULL || g_dir_map == NULL) {
+            free(g_ring);
+            free(g_dir_map);
+            g_ring = NULL;
+            g_dir_map = NULL;
+            return 1;
+        }
+        unsigned int bytes_per_sector = g_fs_state.fs_bpb.BPB_BytsPerSec;
+        g_fat_start = (long long)g_fs_state.fs_bpb.BPB_RsvdSecCnt * bytes_per_sector;
+        g_data_start = (long long)get_first_data_sector() * bytes_per_sector;
+        g_cluster_bytes = bytes_per_sector * g_fs_state.fs_bpb.BPB_SecPerClus;
+        // the root is a directory whether or not anything has read it yet
+        trace_note_dir((long long)get_cluster_sector(g_fs_state.fs_bpb.BPB_RootClus) * bytes_per_sector, 1);
+    }
+    g_epoch = trace_clock();
+    g_next = 0;
+    g_trace_on = 1;
+    return 0;
+}
+
+void trace_stop() {
+    g_trace_on = 0;
+}
+
+// DUMPING -----------------------------------------
+
+static void write_csv(FILE *out, unsigned long long first, unsigned long long last) {
+    unsigned int bytes_per_sector = g_fs_state.fs_bpb.BPB_BytsPerSec;
+    fprintf(out, "time_ns,duration_ns,offset,sector,length,op,region,command\n");
+    for (unsigned long long i = first; i < last; i++) {
+        TRACE_RECORD *r = &g_ring[i & (TRACE_RECORDS - 1)];
+        fprintf(out, "%llu,%u,%llu,%llu,%u,%s,%s,%s\n", r->ns, r->dur_ns, r->offset, r->offset / bytes_per_sector,
+                r->len, r->write ? "write" : "read", g_region_names[r->region], g_origins[r->origin]);
+    }
+}
+
+// complete ("X") events in microseconds, one thread lane per origin so each command gets a row
+static void write_chrome_json(FILE *out, unsigned long long first, unsigned long long last) {
+    unsigned int bytes_per_sector = g_fs_state.fs_bpb.BPB_BytsPerSec;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (unsigned int o = 0; o < g_origin_count; o++) {
+        fprintf(out, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}},\n",
+                o, g_origins[o]);
+    }
+    for (unsigned long long i = first; i < last; i++) {
+        TRACE_RECORD *r = &g_ring[i & (TRACE_RECORDS - 1)];
+        fprintf(out, "{\"name\":\"%s %s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%u,"
+                     "\"args\":{\"offset\":%llu,\"sector\":%llu,\"length\":%u}}%s\n",
+                r->write ? "write" : "read", g_region_names[r->region], g_region_names[r->region],
+                r->ns / 1e3, r->dur_ns / 1e3, r->origin, r->offset, r->offset / bytes_per_sector, r->len,
+                i + 1 < last ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+int trace_dump(const char *path) {
+    if (g_ring == NULL) {
+        printf("Error: Nothing traced yet, start with 'trace on'.\n");
+        return 1;
+    }
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        printf("Error: Could not open trace file '%s'.\n", path);
+        return 1;
+    }
+
+    unsigned long long last = __atomic_load_n(&g_next, __ATOMIC_RELAXED);
+    unsigned long long first = last > TRACE_RECORDS ? last - TRACE_RECORDS : 0;
+    size_t len = strlen(path);
+    if (len >= 5 && strcmp(path + len - 5, ".json") == 0) write_chrome_json(out, first, last);
+    else write_csv(out, first, last);
+
+    if (fclose(out) != 0) {
+        printf("Error: Could not write trace file '%s'.\n", path);
+        return 1;
+    }
+    printf("Trace: %llu accesses written to %s", last - first, path);
+    if (first > 0) printf(" (%llu older ones overwritten)", first);
+    printf("\n");
+    return 0;
+}
+
+void trace_dump_at_exit(const char *path) {
+    g_exit_path = path;
+}
+
+void trace_finish() {
+    trace_stop();
+    if (g_exit_path != NULL && g_ring != NULL) trace_dump(g_exit_path);
+    free(g_ring);
+    free(g_dir_map);
+    g_ring = NULL;
+    g_dir_map = NULL;
+}
+
+// trace command: "trace on" starts a new trace, "trace off" stops it, "trace dump FILE" writes
+// it out. on its own it prints the ring's state
+int trace_command(char *arg, char *path) {
+    if (arg != NULL) {
+        if (strcmp(arg, "on") == 0) {
+            if (trace_start() != 0) {
+                printf("Error: Not enough memory for the trace buffer.\n");
+                return 1;
+            }
+            return 0;
+        }
+        if (strcmp(arg, "off") == 0) {
+            trace_stop();
+            return 0;
+        }
+        if (strcmp(arg, "dump") == 0) {
+            if (path == NULL) {
+                printf("Error: 'trace dump' requires a file (.json for Chrome trace, otherwise CSV).\n");
+                return 1;
+            }
+            return trace_dump(path);
+        }
+        printf("Error: Unknown trace option '%s' (on, off or dump FILE).\n", arg);
+        return 1;
+    }
+
+    unsigned long long total = __atomic_load_n(&g_next, __ATOMIC_RELAXED);
+    printf("Trace: %s, ring of %u accesses (%zu KiB)\n", g_trace_on ? "on" : "off", TRACE_RECORDS,
+           (size_t)TRACE_RECORDS * sizeof(TRACE_RECORD) / 1024);
+    printf("Recorded: %llu  Held: %llu  Overwritten: %llu\n", total,
+           total > TRACE_RECORDS ? (unsigned long long)TRACE_RECORDS : total,
+           total > TRACE_RECORDS ? total - TRACE_RECORDS : 0);
+    return 0;
+}
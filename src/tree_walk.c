@@ -0,0 +1,394 @@
+#define _GNU_SOURCE // pthreads, FNM_CASEFOLD
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include "structs.h"
+#include "commands.h"
+#include "tree_walk.h"
+
+extern FS_STATE g_fs_state;
+
+// a directory waiting to be walked
+typedef struct {
+    unsigned int cluster;
+    char path[WALK_PATH_MAX];
+} WALK_ITEM;
+
+// the owner pushes and pops at the bottom (newest first, so it stays deep in one subtree),
+// thieves take from the top (oldest, usually the biggest subtrees left)
+typedef struct {
+    pthread_mutex_t lock;
+    WALK_ITEM *items;
+    unsigned int cap;
+    unsigned int top;
+    unsigned int bottom;
+} WALK_DEQUE;
+
+// one thread of the walk and what it found
+typedef struct {
+    int index;
+    WALK_DEQUE deque;
+    WALK_DIR *dirs;
+    unsigned int dir_count, dir_cap;
+    char **matches;
+    unsigned int match_count, match_cap;
+    unsigned long files;
+    unsigned long long entries;
+    unsigned long steals;
+    int failed;
+} WALKER;
+
+// shared by the threads of the walk in progress. they read with image_pread and the FAT
+// without its buffers, neither the block cache nor the FAT buffers are thread safe
+static WALKER *g_walkers = NULL;
+static int g_walker_count = 0;
+static long g_pending = 0;              // directories queued or being walked
+static unsigned char *g_visited = NULL; // one bit per cluster, set once a directory there is queued
+static const WALK_OPTIONS *g_opts = NULL;
+static unsigned int g_entries = 0;      // data clusters + 2
+static unsigned int g_cluster_size = 0;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// DEQUES -----------------------------------------
+
+static int deque_push(WALK_DEQUE *dq, const WALK_ITEM *item) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom == dq->cap) {
+        if (dq->top > 0) {
+            // room at the front, slide everything down
+            memmove(dq->items, dq->items + dq->top, (dq->bottom - dq->top) * sizeof(WALK_ITEM));
+            dq->bottom -= dq->top;
+            dq->top = 0;
+        } else {
+            unsigned int cap = dq->cap ? dq->cap * 2 : WALK_DEQUE_START;
+            WALK_ITEM *grown = (WALK_ITEM *)realloc(dq->items, cap * sizeof(WALK_ITEM));
+            if (!grown) {
+                pthread_mutex_unlock(&dq->lock);
+                return 1;
+            }
+            dq->items = grown;
+            dq->cap = cap;
+        }
+    }
+    dq->items[dq->bottom++] = *item;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+static int deque_pop(WALK_DEQUE *dq, WALK_ITEM *item) {
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        *item = dq->items[--dq->bottom];
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+static int deque_steal(WALK_DEQUE *dq, WALK_ITEM *item) {
+    int found = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->bottom > dq->top) {
+        *item = dq->items[dq->top++];
+        if (dq->top == dq->bottom) dq->top = dq->bottom = 0;
+        found = 1;
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return found;
+}
+
+// WALKING -----------------------------------------
+
+// next cluster in a chain, from the resident FAT or straight from the active FAT on disk
+static unsigned int fat_next(unsigned int cluster) {
+    if (g_fs_state.fat_table != NULL) return g_fs_state.fat_table[cluster] & 0x0FFFFFFF;
+    unsigned int value;
+    long long offset = ((long long)g_fs_state.fs_bpb.BPB_RsvdSecCnt +
+                        (long long)active_fat() * g_fs_state.fs_bpb.BPB_FATSz32) * g_fs_state.fs_bpb.BPB_BytsPerSec +
+                       4LL * cluster;
+    if (image_pread(offset, &value, sizeof(value)) != 0) return 0x0FFFFFFF;
+    return value & 0x0FFFFFFF;
+}
+
+static int chain_continues(unsigned int next) {
+    return next >= 2 && next < g_entries;
+}
+
+static unsigned int chain_length(unsigned int first) {
+    unsigned int n = 0;
+    for (unsigned int c = first; c >= 2 && c < g_entries && n < g_entries; c = fat_next(c)) {
+        n++;
+    }
+    return n;
+}
+
+// queues a directory on this thread's deque, unless some entry got there first
+static void queue_dir(WALKER *self, unsigned int cluster, const char *path) {
+    unsigned char bit = (unsigned char)(1u << (cluster & 7));
+    if (__atomic_fetch_or(&g_visited[cluster >> 3], bit, __ATOMIC_RELAXED) & bit) return;
+
+    WALK_ITEM item;
+    item.cluster = cluster;
+    snprintf(item.path, sizeof(item.path), "%s", path);
+    __atomic_add_fetch(&g_pending, 1, __ATOMIC_SEQ_CST);
+    if (deque_push(&self->deque, &item) != 0) {
+        self->failed = 1;
+        __atomic_sub_fetch(&g_pending, 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static int add_match(WALKER *self, const char *path, int is_dir) {
+    if (self->match_count == self->match_cap) {
+        unsigned int cap = self->match_cap ? self->match_cap * 2 : 64;
+        char **grown = (char **)realloc(self->matches, cap * sizeof(char *));
+        if (!grown) return 1;
+        self->matches = grown;
+        self->match_cap = cap;
+    }
+    size_t len = strlen(path);
+    char *copy = (char *)malloc(len + 2);
+    if (!copy) return 1;
+    memcpy(copy, path, len);
+    if (is_dir) copy[len++] = '/';
+    copy[len] = '\0';
+    self->matches[self->match_count++] = copy;
+    return 0;
+}
+
+// goes through one directory: records it, collects matches and queues its subdirectories
+static void walk_directory(WALKER *self, const WALK_ITEM *item, unsigned char *buf) {
+    if (self->dir_count == self->dir_cap) {
+        unsigned int cap = self->dir_cap ? self->dir_cap * 2 : 64;
+        WALK_DIR *grown = (WALK_DIR *)realloc(self->dirs, cap * sizeof(WALK_DIR));
+        if (!grown) {
+            self->failed = 1;
+            return;
+        }
+        self->dirs = grown;
+        self->dir_cap = cap;
+    }
+    WALK_DIR *dir = &self->dirs[self->dir_count++];
+    memcpy(dir->path, item->path, sizeof(dir->path));
+    dir->files = 0;
+    dir->clusters = 0;
+    dir->total = 0;
+
+    int at_root = strcmp(item->path, "/") == 0;
+    unsigned int entries_per_cluster = g_cluster_size / sizeof(DIR_ENTRY);
+    unsigned int cluster = item->cluster;
+    unsigned int steps = 0;
+
+    while (cluster >= 2 && cluster < g_entries && steps++ < g_entries) {
+        dir->clusters++;
+        long long offset = (long long)get_cluster_sector(cluster) * g_fs_state.fs_bpb.BPB_BytsPerSec;
+        if (image_pread(offset, buf, g_cluster_size) != 0) {
+            self->failed = 1;
+            return;
+        }
+
+        for (unsigned int i = 0; i < entries_per_cluster; i++) {
+            DIR_ENTRY *entry = (DIR_ENTRY *)(buf + i * sizeof(DIR_ENTRY));
+            if (entry->DIR_Name[0] == 0x00) return; // end of directory
+            if (entry->DIR_Name[0] == 0xE5 || entry->DIR_Name[0] == '.') continue;
+            if ((entry->DIR_Attr & ATTR_LFN) == ATTR_LFN || (entry->DIR_Attr & ATTR_VOLUME_ID)) continue;
+            self->entries++;
+
+            char name[13];
+            char path[WALK_PATH_MAX];
+            get_formatted_name(entry->DIR_Name, name);
+            if ((size_t)snprintf(path, sizeof(path), "%s%s%s", item->path, at_root ? "" : "/", name) >= sizeof(path)) {
+                continue; // too deep to name
+            }
+            unsigned int start = (unsigned int)entry->DIR_FstClusHI << 16 | entry->DIR_FstClusLO;
+            int is_dir = (entry->DIR_Attr & ATTR_DIRECTORY) != 0;
+
+            if (g_opts->pattern != NULL && fnmatch(g_opts->pattern, name, FNM_CASEFOLD) == 0 &&
+                add_match(self, path, is_dir) != 0) {
+                self->failed = 1;
+                return;
+            }
+
+            if (is_dir) {
+                if (start >= 2 && start < g_entries) queue_dir(self, start, path);
+                continue;
+            }
+            self->files++;
+            dir->files++;
+            if (g_opts->count_clusters && start != 0) dir->clusters += chain_length(start);
+        }
+
+        unsigned int next = fat_next(cluster);
+        if (!chain_continues(next)) break;
+        cluster = next;
+    }
+}
+
+static void *walk_worker(void *arg) {
+    WALKER *self = (WALKER *)arg;
+    unsigned char *buf = (unsigned char *)malloc(g_cluster_size);
+    if (!buf) {
+        self->failed = 1;
+        return NULL;
+    }
+
+    WALK_ITEM item;
+    while (1) {
+        int found = deque_pop(&self->deque, &item);
+        // nothing of our own left: take the oldest directory off someone else's deque
+        for (int k = 1; !found && k < g_walker_count; k++) {
+            found = deque_steal(&g_walkers[(self->index + k) % g_walker_count].deque, &item);
+            if (found) self->steals++;
+        }
+
+        if (found) {
+            walk_directory(self, &item, buf);
+            __atomic_sub_fetch(&g_pending, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        // every queued directory has been walked and nobody can queue more
+        if (__atomic_load_n(&g_pending, __ATOMIC_SEQ_CST) == 0) break;
+        sched_yield();
+    }
+
+    free(buf);
+    return NULL;
+}
+
+// MERGING -----------------------------------------
+
+static int compare_dirs(const void *a, const void *b) {
+    return strcmp(((const WALK_DIR *)a)->path, ((const WALK_DIR *)b)->path);
+}
+
+static int compare_paths(const void *a, const void *b) {
+    return strcmp(*(const char *const *)a, *(const char *const *)b);
+}
+
+// sorts everything the threads found and adds each directory's total into its parent's
+static int merge_results(WALK_RESULT *result) {
+    unsigned int dir_count = 0, match_count = 0;
+    for (int i = 0; i < g_walker_count; i++) {
+        dir_count += g_walkers[i].dir_count;
+        match_count += g_walkers[i].match_count;
+        result->files += g_walkers[i].files;
+        result->entries += g_walkers[i].entries;
+        result->steals += g_walkers[i].steals;
+    }
+
+    result->dirs = (WALK_DIR *)malloc((dir_count ? dir_count : 1) * sizeof(WALK_DIR));
+    result->matches = (char **)malloc((match_count ? match_count : 1) * sizeof(char *));
+    if (!result->dirs || !result->matches) return 1;
+
+    for (int i = 0; i < g_walker_count; i++) {
+        WALKER *w = &g_walkers[i];
+        memcpy(result->dirs + result->dir_count, w->dirs, w->dir_count * sizeof(WALK_DIR));
+        result->dir_count += w->dir_count;
+        memcpy(result->matches + result->match_count, w->matches, w->match_count * sizeof(char *));
+        result->match_count += w->match_count;
+        w->match_count = 0; // the result owns the strings now
+    }
+    qsort(result->dirs, result->dir_count, sizeof(WALK_DIR), compare_dirs);
+    qsort(result->matches, result->match_count, sizeof(char *), compare_paths);
+
+    // children sort after their parent, so going backwards every total is complete
+    // before it is added to the parent's
+    for (unsigned int i = result->dir_count; i-- > 0;) {
+        WALK_DIR *dir = &result->dirs[i];
+        dir->total += dir->clusters;
+        if (i == 0) break; // the starting directory
+
+        WALK_DIR key;
+        char *slash = strrchr(dir->path, '/');
+        size_t len = slash == dir->path ? 1 : (size_t)(slash - dir->path);
+        memcpy(key.path, dir->path, len);
+        key.path[len] = '\0';
+        WALK_DIR *parent = (WALK_DIR *)bsearch(&key, result->dirs, i, sizeof(WALK_DIR), compare_dirs);
+        if (parent != NULL) parent->total += dir->total;
+    }
+    return 0;
+}
+
+int tree_walk(unsigned int start_cluster, const char *start_path, const WALK_OPTIONS *opts, WALK_RESULT *result) {
+    memset(result, 0, sizeof(*result));
+    double start = now_seconds();
+
+    int threads = opts->threads > 0 ? opts->threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads < 1) threads = 1;
+    if (threads > WALK_MAX_THREADS) threads = WALK_MAX_THREADS;
+    result->threads = threads;
+
+    g_opts = opts;
+    g_cluster_size = g_fs_state.fs_bpb.BPB_BytsPerSec * g_fs_state.fs_bpb.BPB_SecPerClus;
+    g_entries = get_total_clusters() + 2;
+    g_visited = (unsigned char *)calloc(g_entries / 8 + 1, 1);
+    g_walkers = (WALKER *)calloc(threads, sizeof(WALKER));
+    if (!g_visited || !g_walkers) {
+        free(g_visited);
+        free(g_walkers);
+        g_visited = NULL;
+        g_walkers = NULL;
+        return 1;
+    }
+    g_walker_count = threads;
+    g_pending = 0;
+    for (int i = 0; i < threads; i++) {
+        g_walkers[i].index = i;
+        pthread_mutex_init(&g_walkers[i].deque.lock, NULL);
+    }
+
+    // the first thread starts with the starting directory, the others steal from there
+    queue_dir(&g_walkers[0], start_cluster, start_path);
+
+    pthread_t ids[WALK_MAX_THREADS];
+    int started[WALK_MAX_THREADS];
+    for (int i = 1; i < threads; i++) {
+        started[i] = pthread_create(&ids[i], NULL, walk_worker, &g_walkers[i]) == 0;
+    }
+    walk_worker(&g_walkers[0]);
+    for (int i = 1; i < threads; i++) {
+        if (started[i]) pthread_join(ids[i], NULL);
+    }
+
+    int failed = 0;
+    for (int i = 0; i < threads; i++) failed |= g_walkers[i].failed;
+    if (!failed) failed = merge_results(result);
+
+    for (int i = 0; i < threads; i++) {
+        WALKER *w = &g_walkers[i];
+        for (unsigned int k = 0; k < w->match_count; k++) free(w->matches[k]);
+        free(w->matches);
+        free(w->dirs);
+        free(w->deque.items);
+        pthread_mutex_destroy(&w->deque.lock);
+    }
+    free(g_walkers);
+    free(g_visited);
+    g_walkers = NULL;
+    g_visited = NULL;
+    g_walker_count = 0;
+
+    result->seconds = now_seconds() - start;
+    if (failed) tree_walk_free(result);
+    return failed;
+}
+
+void tree_walk_free(WALK_RESULT *result) {
+    for (unsigned int i = 0; i < result->match_count; i++) free(result->matches[i]);
+    free(result->matches);
+    free(result->dirs);
+    result->matches = NULL;
+    result->dirs = NULL;
+    result->match_count = 0;
+    result->dir_count = 0;
+}
@@ -0,0 +1,74 @@
+// fsck: checks a FAT32 image without opening it in the shell. the image is opened
+// read only, so nothing is replayed, flushed or repaired.
+//
+// usage: bin/fsck [-j threads] <image>
+// exit status: 0 clean, 1 problems found, 2 the check couldn't run
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "structs.h"
+#include "commands.h"
+#include "journal.h"
+#include "fsck.h"
+
+extern FS_STATE g_fs_state;
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-j threads] <FAT32 image>\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    int threads = 0;
+    int argi = 1;
+    if (argi + 1 < argc && strcmp(argv[argi], "-j") == 0) {
+        threads = atoi(argv[argi + 1]);
+        if (threads <= 0) {
+            usage(argv[0]);
+            return 2;
+        }
+        argi += 2;
+    }
+    if (argc - argi != 1) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    const char *image_path = argv[argi];
+    int fd = open(image_path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open file image '%s'.\n", image_path);
+        return 2;
+    }
+    g_fs_state.image_fd = fd;
+    if (image_read(0, &g_fs_state.fs_bpb, sizeof(BPB)) != 0) {
+        fprintf(stderr, "Error: Failed to read the BPB of '%s'.\n", image_path);
+        close(fd);
+        return 2;
+    }
+
+    // committed metadata that never made it into the image would show up as damage
+    char journal_path[4096];
+    struct stat st;
+    snprintf(journal_path, sizeof(journal_path), "%s%s", image_path, JOURNAL_SUFFIX);
+    if (stat(journal_path, &st) == 0 && st.st_size > 0) {
+        fprintf(stderr, "Warning: '%s' has not been replayed, open the image in filesys first.\n", journal_path);
+    }
+
+    FSCK_REPORT *report = (FSCK_REPORT *)malloc(sizeof(FSCK_REPORT));
+    if (!report) {
+        fprintf(stderr, "Error: Memory allocation failed.\n");
+        close(fd);
+        return 2;
+    }
+    printf("Checking %s\n", image_path);
+    long problems = fsck_run(threads, report);
+    if (problems >= 0) fsck_print(report);
+    free(report);
+    close(fd);
+    if (problems < 0) return 2;
+    return problems > 0 ? 1 : 0;
+}
@@ -0,0 +1,114 @@
+// mkfat32: writes a FAT32 image as a sparse file, optionally with a generated tree, without
+// mkfs.fat or loop mounts. the same seed gives the same image.
+//
+// usage: bin/mkfat32 [options] <image> <size>
+//   -S bytes      sector size: 512, 1024, 2048 or 4096 (512)
+//   -c sectors    sectors per cluster (picked from the size like mkfs.fat)
+//   -F count      number of FATs (2)
+//   -d count      directories besides the root (0)
+//   -w count      subdirectories per directory (16)
+//   -n count      files, spread over the root and every directory (0)
+//   -s sizes      file sizes: N, uniform:MIN-MAX or log:MIN-MAX (4K)
+//   -r percent    fragmentation, the percent of a file's clusters that start a new run (0)
+//   -e count      free entries left in every directory (0)
+//   -x            write file contents, otherwise the data area stays sparse
+//   -z seed       (1)
+//   -L label
+// sizes take K, M, G and T suffixes (powers of 1024).
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "structs.h"
+#include "image_builder.h"
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-S sector] [-c spc] [-F fats] [-d dirs] [-w fanout] [-n files]\n"
+                    "       [-s N|uniform:MIN-MAX|log:MIN-MAX] [-r percent] [-e spare] [-x] [-z seed] [-L label]\n"
+                    "       <image> <size>\n", prog);
+}
+
+// "64G" -> 68719476736. returns 0 on success
+static int parse_bytes(const char *text, unsigned long long *out) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    if (end == text) return 1;
+    switch (*end) {
+    case 'T': case 't': value <<= 10; // fall through
+    case 'G': case 'g': value <<= 10; // fall through
+    case 'M': case 'm': value <<= 10; // fall through
+    case 'K': case 'k': value <<= 10; end++; break;
+    case '\0': break;
+    default: return 1;
+    }
+    if (*end != '\0') return 1;
+    *out = value;
+    return 0;
+}
+
+static int parse_sizes(char *text, IMAGE_SPEC *spec) {
+    char *range = text;
+    if (strncmp(text, "uniform:", 8) == 0) {
+        spec->size_dist = SIZE_UNIFORM;
+        range = text + 8;
+    } else if (strncmp(text, "log:", 4) == 0) {
+        spec->size_dist = SIZE_LOG;
+        range = text + 4;
+    } else {
+        spec->size_dist = SIZE_FIXED;
+        if (parse_bytes(text, &spec->size_min) != 0) return 1;
+        spec->size_max = spec->size_min;
+        return spec->size_min > 0xFFFFFFFFull;
+    }
+    char *dash = strchr(range, '-');
+    if (dash == NULL) return 1;
+    *dash = '\0';
+    if (parse_bytes(range, &spec->size_min) != 0 || parse_bytes(dash + 1, &spec->size_max) != 0) return 1;
+    return spec->size_min > spec->size_max || spec->size_max > 0xFFFFFFFFull;
+}
+
+int main(int argc, char *argv[]) {
+    IMAGE_SPEC spec;
+    image_spec_defaults(&spec);
+    int opt;
+    while ((opt = getopt(argc, argv, "S:c:F:d:w:n:s:r:e:xz:L:")) != -1) {
+        switch (opt) {
+        case 'S': spec.bytes_per_sector = (unsigned int)strtoul(optarg, NULL, 10); break;
+        case 'c': spec.sectors_per_cluster = (unsigned int)strtoul(optarg, NULL, 10); break;
+        case 'F': spec.num_fats = (unsigned int)strtoul(optarg, NULL, 10); break;
+        case 'd': spec.dirs = (unsigned int)strtoul(optarg, NULL, 10); break;
+        case 'w': spec.fanout = (unsigned int)strtoul(optarg, NULL, 10); break;
+        case 'n': spec.files = strtoul(optarg, NULL, 10); break;
+        case 's':
+            if (parse_sizes(optarg, &spec) != 0) {
+                fprintf(stderr, "Error: Bad file sizes '%s'.\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r': spec.fragmentation = (unsigned int)strtoul(optarg, NULL, 10); break;
+        case 'e': spec.spare_entries = (unsigned int)strtoul(optarg, NULL, 10); break;
+        case 'x': spec.fill = 1; break;
+        case 'z': spec.seed = (unsigned int)strtoul(optarg, NULL, 10); break;
+        case 'L': spec.label = optarg; break;
+        default: usage(argv[0]); return EXIT_FAILURE;
+        }
+    }
+    if (argc - optind != 2 || parse_bytes(argv[optind + 1], &spec.image_bytes) != 0 || spec.fragmentation > 100) {
+        usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    IMAGE_BUILD_STATS stats;
+    if (image_build(argv[optind], &spec, &stats) != 0) return EXIT_FAILURE;
+
+    // mkfs.fat only makes FAT32 from this many clusters up, smaller images still work here
+    if (stats.clusters < 65525) {
+        fprintf(stderr, "Warning: %u clusters is few enough that other tools will take this for FAT16.\n", stats.clusters);
+    }
+    printf("%s: %llu MiB, %u clusters of %u bytes, %u used\n", argv[optind], spec.image_bytes >> 20,
+           stats.clusters, stats.cluster_bytes, stats.used_clusters);
+    printf("%u directories, %lu files, %llu MiB of file data, %lu writes, %.3f s\n", stats.directories,
+           stats.files, stats.file_bytes >> 20, stats.writes, stats.seconds);
+    return EXIT_SUCCESS;
+}